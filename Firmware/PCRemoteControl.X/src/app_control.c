@@ -44,6 +44,9 @@ static bool initialized = false;
 static uint8_t init_cycles = 0;
 static int led_counter[NUM_PCS] = {0};
 static char names[NUM_PCS][PC_MAX_NAME] = {{0}, {0}};
+/* Status as of the last APP_control_loop(), to detect changes. */
+static uint8_t last_status[NUM_PCS] = {0};
+static uint8_t status_changes = 0;
 
 static void control_switch_set(uint8_t pc, uint8_t state) {
   if(pc == 0) {
@@ -100,7 +103,7 @@ void APP_control_interrupts(void) {
 }
 
 void APP_control_loop(void) {
-  uint8_t i;
+  uint8_t i, status;
   if(need_update_status) {
     if(initialized) {
       for(i = 0; i < NUM_PCS; ++i) {
@@ -132,6 +135,13 @@ void APP_control_loop(void) {
     }
     need_update_status = false;
   }
+  for(i = 0; i < NUM_PCS; ++i) {
+    status = APP_control_get_pc_status(i);
+    if(status != last_status[i]) {
+      last_status[i] = status;
+      status_changes |= (1 << i);
+    }
+  }
   if(!initialized) {
     for(i = 0; i < NUM_PCS; ++i) {
       if(APP_control_is_pc_on(i)) {
@@ -183,6 +193,12 @@ uint8_t APP_control_get_pc_status(uint8_t pc) {
   return status;
 }
 
+uint8_t APP_control_take_status_changes(void) {
+  uint8_t changes = status_changes;
+  status_changes = 0;
+  return changes;
+}
+
 void APP_control_switch_press(uint8_t pc, bool force) {
   if(initialized) {
     switch_stat[pc] = force ? SW_STATE_NEED_FORCE_PRESS : SW_STATE_NEED_PRESS;
@@ -42,6 +42,8 @@ bool APP_control_is_pc_on(uint8_t pc);
 bool APP_control_is_autoboot_enabled(uint8_t pc);
 void APP_control_set_autoboot_enabled(uint8_t pc, bool enabled);
 uint8_t APP_control_get_pc_status(uint8_t pc);
+/* Bitmask of computers whose status changed since the previous call. */
+uint8_t APP_control_take_status_changes(void);
 void APP_control_set_pc_name(uint8_t pc, const char name[PC_MAX_NAME]);
 void APP_control_get_pc_name(uint8_t pc, char name[PC_MAX_NAME]);
 const char* APP_control_get_pc_name_ptr(uint8_t pc);
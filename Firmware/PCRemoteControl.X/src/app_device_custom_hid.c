@@ -32,6 +32,16 @@
 #include "app_control.h"
 #include "app_network.h"
 
+/* Number of IN reports which might be waiting for the endpoint, so answers
+ * to back-to-back commands are not lost while previous one is in flight.
+ */
+#define IN_QUEUE_SIZE 4
+
+/* Number of IN reports which can be armed at once, endpoint runs in the full
+ * ping-pong mode (see usb_config.h).
+ */
+#define IN_PING_PONG_DEPTH 2
+
 /* Some processors have a limited range of RAM addresses where the USB module
  * is able to access.  The following section is for those devices.  This section
  * assigns the buffers that need to be used by the USB module into those
@@ -42,19 +52,30 @@
 #    pragma udata HID_CUSTOM_OUT_DATA_BUFFER = HID_CUSTOM_OUT_DATA_BUFFER_ADDRESS
 unsigned char ReceivedDataBuffer[64];
 #    pragma udata HID_CUSTOM_IN_DATA_BUFFER = HID_CUSTOM_IN_DATA_BUFFER_ADDRESS
-unsigned char ToSendDataBuffer[64];
+unsigned char ToSendDataBuffer[IN_QUEUE_SIZE][64];
 #    pragma udata
 #  else defined(__XC8)
 unsigned char ReceivedDataBuffer[64] @ HID_CUSTOM_OUT_DATA_BUFFER_ADDRESS;
-unsigned char ToSendDataBuffer[64] @ HID_CUSTOM_IN_DATA_BUFFER_ADDRESS;
+unsigned char ToSendDataBuffer[IN_QUEUE_SIZE][64] @ HID_CUSTOM_IN_DATA_BUFFER_ADDRESS;
 #  endif
 #else
 unsigned char ReceivedDataBuffer[64];
-unsigned char ToSendDataBuffer[64];
+unsigned char ToSendDataBuffer[IN_QUEUE_SIZE][64];
 #endif
 
 volatile USB_HANDLE USBOutHandle;
-volatile USB_HANDLE USBInHandle;
+/* Handle of the last transmission from every IN buffer. */
+volatile USB_HANDLE USBInHandle[IN_QUEUE_SIZE];
+
+/* Ring of IN buffers which are waiting to be transmitted. */
+static uint8_t inQueueHead;
+static uint8_t inQueueCount;
+
+/* Whether the host asked for event reports, and computers whose status
+ * changes are not reported yet.
+ */
+static bool eventsEnabled;
+static uint8_t eventChanges;
 
 typedef enum {
   COMMAND_TEST             = 0x80,
@@ -68,20 +89,376 @@ typedef enum {
   COMMAND_CFG_GET_MAC      = 0x88,
   COMMAND_CFG_GET_STATUS   = 0x89,
   COMMAND_CFG_GET_PC_NAME  = 0x90,
+  COMMAND_GET_SNAPSHOT     = 0x91,
+  COMMAND_FRAME            = 0x92,
+  COMMAND_SET_EVENTS       = 0x93,
+  COMMAND_GET_CAPABILITIES = 0x94,
 } CUSTOM_HID_COMMANDS;
 
-/* Transmit the response to the host/ */
+/* Version of the protocol, bumped whenever commands or layouts change. */
+#define PROTOCOL_VERSION 1
+
+/* Commands reported in the COMMAND_GET_CAPABILITIES bitmap. */
+static const uint8_t supportedCommands[] = {
+  COMMAND_TEST,
+  COMMAND_SWITCH_PRESS,
+  COMMAND_CFG_SET_AUTOBOOT,
+  COMMAND_CFG_SET_IP,
+  COMMAND_CFG_SET_MAC,
+  COMMAND_CFG_SET_PC_NAME,
+  COMMAND_CFG_GET_AUTOBOOT,
+  COMMAND_CFG_GET_IP,
+  COMMAND_CFG_GET_MAC,
+  COMMAND_CFG_GET_STATUS,
+  COMMAND_CFG_GET_PC_NAME,
+  COMMAND_GET_SNAPSHOT,
+  COMMAND_FRAME,
+  COMMAND_SET_EVENTS,
+  COMMAND_GET_CAPABILITIES,
+};
+
+/* Unsolicited reports sent to the host once it enabled events. */
+typedef enum {
+  EVENT_STATUS_CHANGED = 0x01,
+} CUSTOM_HID_EVENTS;
+
+/* Status of a single command, only reported for commands in a frame. */
+typedef enum {
+  COMMAND_STATUS_OK               = 0,
+  COMMAND_STATUS_INVALID_ARGUMENT = 1,
+  COMMAND_STATUS_UNKNOWN_COMMAND  = 2,
+  COMMAND_STATUS_NO_SPACE         = 3,
+} CUSTOM_HID_COMMAND_STATUS;
+
+/* Layout of the COMMAND_GET_SNAPSHOT response:
+ *
+ *   0..3   IP address
+ *   4..9   MAC address
+ *   10     Number of computers
+ *   11..   Per-computer blocks of status, autoboot flag and name.
+ */
+#define SNAPSHOT_NUM_PCS_OFFSET 10
+#define SNAPSHOT_PC_OFFSET 11
+#define SNAPSHOT_PC_SIZE (2 + PC_MAX_NAME)
+
+/* Layout of the COMMAND_GET_CAPABILITIES response:
+ *
+ *   0      PROTOCOL_VERSION
+ *   1      Number of computers
+ *   2      PC_MAX_NAME
+ *   3      Report size
+ *   4      Number of answers which might be queued, IN_QUEUE_SIZE
+ *   5      Maximum size of COMMAND_FRAME records, FRAME_MAX_SIZE
+ *   6..21  Bitmap of supported commands, bit N of byte M is set when
+ *          command 0x80 + M * 8 + N is supported.
+ */
+#define CAPABILITIES_BITMAP_OFFSET 6
+#define CAPABILITIES_BITMAP_SIZE 16
+
+/* COMMAND_FRAME packs several commands into a single report:
+ *
+ *   OUT: COMMAND_FRAME, then records of <command> <length> <arguments>,
+ *        terminated by a zero command or the request ID byte.
+ *   IN:  number of executed commands, then records of
+ *        <command> <status> <length> <answer>.
+ *
+ * Commands are executed in order. Execution stops at the first command
+ * whose answer doesn't fit into the IN report any more, it's reported with
+ * COMMAND_STATUS_NO_SPACE, so host can re-send the rest.
+ */
+#define FRAME_RECORD_HEADER_SIZE 2
+#define FRAME_ANSWER_HEADER_SIZE 3
+#define FRAME_MAX_SIZE REQUEST_ID_OFFSET
+
+/* Last byte of every OUT report is the request ID, which is echoed in the
+ * same byte of the answer, so the host can match answers to requests.
+ * Zero means the host doesn't tag its requests.
+ */
+#define REQUEST_ID_OFFSET 63
+
+/* Request ID of the event reports, it's never used by the host. */
+#define REQUEST_ID_EVENT 0xFF
+
+/* Layout of the EVENT_STATUS_CHANGED report:
+ *
+ *   0      EVENT_STATUS_CHANGED
+ *   1      Bitmask of computers whose status changed
+ *   2      Number of computers
+ *   3..    Status of every computer
+ */
+#define EVENT_CHANGES_OFFSET 1
+#define EVENT_NUM_PCS_OFFSET 2
+#define EVENT_STATUS_OFFSET 3
+
+/* Size of the answer to the given command, 0 for commands without one. */
+static uint8_t answerSize(uint8_t command) {
+  switch (command) {
+    case COMMAND_CFG_GET_AUTOBOOT:
+      return 1;
+    case COMMAND_CFG_GET_IP:
+      return 4;
+    case COMMAND_CFG_GET_MAC:
+      return 6;
+    case COMMAND_CFG_GET_STATUS:
+      return 1 + APP_control_num_pcs();
+    case COMMAND_CFG_GET_PC_NAME:
+      return PC_MAX_NAME;
+    case COMMAND_GET_SNAPSHOT:
+      return SNAPSHOT_PC_OFFSET + APP_control_num_pcs() * SNAPSHOT_PC_SIZE;
+    case COMMAND_GET_CAPABILITIES:
+      return CAPABILITIES_BITMAP_OFFSET + CAPABILITIES_BITMAP_SIZE;
+  }
+  return 0;
+}
+
+/* Execute single command with the given arguments.
+ *
+ * Answer, if command has one, is written to the answer buffer which is
+ * expected to be at least answerSize() bytes big.
+ */
+static uint8_t executeCommand(uint8_t command,
+                              const uint8_t *args,
+                              uint8_t args_len,
+                              uint8_t *answer) {
+  uint8_t i, n, pc;
+  uint8_t *pc_data;
+  char name[PC_MAX_NAME];
+  switch (command) {
+    case COMMAND_TEST:
+      APP_network_debug_blink();
+      break;
+    case COMMAND_SWITCH_PRESS:
+      pc = args[0];
+      if (args_len < 2 || pc >= APP_control_num_pcs()) {
+        return COMMAND_STATUS_INVALID_ARGUMENT;
+      }
+      APP_control_switch_press(pc, args[1] != 0);
+      break;
+    case COMMAND_CFG_SET_AUTOBOOT:
+      pc = args[0];
+      if (args_len < 2 || pc >= APP_control_num_pcs()) {
+        return COMMAND_STATUS_INVALID_ARGUMENT;
+      }
+      APP_control_set_autoboot_enabled(pc, args[1] != 0);
+      break;
+    case COMMAND_CFG_SET_IP:
+      if (args_len < 4) {
+        return COMMAND_STATUS_INVALID_ARGUMENT;
+      }
+      APP_network_set_ip(args[0], args[1], args[2], args[3]);
+      break;
+    case COMMAND_CFG_SET_MAC:
+      if (args_len < 6) {
+        return COMMAND_STATUS_INVALID_ARGUMENT;
+      }
+      APP_network_set_mac(args[0], args[1], args[2],
+                          args[3], args[4], args[5]);
+      break;
+    case COMMAND_CFG_SET_PC_NAME:
+      pc = args[0];
+      if (args_len < 1 || pc >= APP_control_num_pcs()) {
+        return COMMAND_STATUS_INVALID_ARGUMENT;
+      }
+      /* Name might be shorter than PC_MAX_NAME in a frame. */
+      n = args_len - 1 < PC_MAX_NAME ? args_len - 1 : PC_MAX_NAME;
+      memset(name, 0, PC_MAX_NAME);
+      memcpy(name, args + 1, n);
+      APP_control_set_pc_name(pc, name);
+      break;
+    case COMMAND_SET_EVENTS:
+      if (args_len < 1) {
+        return COMMAND_STATUS_INVALID_ARGUMENT;
+      }
+      eventsEnabled = args[0] != 0;
+      /* Start with the full state of all computers. */
+      eventChanges = eventsEnabled ? (1 << APP_control_num_pcs()) - 1 : 0;
+      break;
+    case COMMAND_CFG_GET_AUTOBOOT:
+      pc = args[0];
+      if (args_len < 1 || pc >= APP_control_num_pcs()) {
+        answer[0] = 0;
+        return COMMAND_STATUS_INVALID_ARGUMENT;
+      }
+      answer[0] = APP_control_is_autoboot_enabled(pc);
+      break;
+    case COMMAND_CFG_GET_IP:
+      APP_network_get_ip(&answer[0], &answer[1], &answer[2], &answer[3]);
+      break;
+    case COMMAND_CFG_GET_MAC:
+      APP_network_get_mac(&answer[0], &answer[1], &answer[2],
+                          &answer[3], &answer[4], &answer[5]);
+      break;
+    case COMMAND_CFG_GET_STATUS:
+      n = APP_control_num_pcs();
+      answer[0] = n;
+      for (i = 0; i < n; ++i) {
+        answer[i + 1] = APP_control_get_pc_status(i);
+      }
+      break;
+    case COMMAND_CFG_GET_PC_NAME:
+      pc = args[0];
+      if (args_len < 1 || pc >= APP_control_num_pcs()) {
+        memset(answer, 0, PC_MAX_NAME);
+        return COMMAND_STATUS_INVALID_ARGUMENT;
+      }
+      APP_control_get_pc_name(pc, (char *)answer);
+      break;
+    case COMMAND_GET_SNAPSHOT:
+      APP_network_get_ip(&answer[0], &answer[1], &answer[2], &answer[3]);
+      APP_network_get_mac(&answer[4], &answer[5], &answer[6],
+                          &answer[7], &answer[8], &answer[9]);
+      n = APP_control_num_pcs();
+      answer[SNAPSHOT_NUM_PCS_OFFSET] = n;
+      for (i = 0; i < n; ++i) {
+        pc_data = &answer[SNAPSHOT_PC_OFFSET + i * SNAPSHOT_PC_SIZE];
+        pc_data[0] = APP_control_get_pc_status(i);
+        pc_data[1] = APP_control_is_autoboot_enabled(i);
+        APP_control_get_pc_name(i, (char *)&pc_data[2]);
+      }
+      break;
+    case COMMAND_GET_CAPABILITIES:
+      answer[0] = PROTOCOL_VERSION;
+      answer[1] = APP_control_num_pcs();
+      answer[2] = PC_MAX_NAME;
+      answer[3] = 64;
+      answer[4] = IN_QUEUE_SIZE;
+      answer[5] = FRAME_MAX_SIZE;
+      memset(&answer[CAPABILITIES_BITMAP_OFFSET], 0, CAPABILITIES_BITMAP_SIZE);
+      for (i = 0; i < sizeof(supportedCommands); ++i) {
+        n = supportedCommands[i] - 0x80;
+        answer[CAPABILITIES_BITMAP_OFFSET + n / 8] |= 1 << (n % 8);
+      }
+      break;
+    default:
+      return COMMAND_STATUS_UNKNOWN_COMMAND;
+  }
+  return COMMAND_STATUS_OK;
+}
+
+/* Execute all commands from the COMMAND_FRAME report, answers are combined
+ * into the response.
+ */
+static void executeFrame(const uint8_t *request, uint8_t *response) {
+  uint8_t pos = 1, answer_pos = 1, num_executed = 0;
+  uint8_t command, args_len, answer_len;
+  uint8_t *record;
+  while (pos + FRAME_RECORD_HEADER_SIZE <= FRAME_MAX_SIZE) {
+    command = request[pos];
+    args_len = request[pos + 1];
+    if (command == 0 ||
+        pos + FRAME_RECORD_HEADER_SIZE + args_len > FRAME_MAX_SIZE) {
+      break;
+    }
+    record = &response[answer_pos];
+    /* Frames can not be nested. */
+    answer_len = command == COMMAND_FRAME ? 0 : answerSize(command);
+    if (answer_pos + FRAME_ANSWER_HEADER_SIZE + answer_len > FRAME_MAX_SIZE) {
+      if (answer_pos + FRAME_ANSWER_HEADER_SIZE <= FRAME_MAX_SIZE) {
+        record[0] = command;
+        record[1] = COMMAND_STATUS_NO_SPACE;
+        record[2] = 0;
+        ++num_executed;
+      }
+      break;
+    }
+    record[0] = command;
+    if (command == COMMAND_FRAME) {
+      record[1] = COMMAND_STATUS_UNKNOWN_COMMAND;
+    } else {
+      record[1] = executeCommand(command,
+                                 &request[pos + FRAME_RECORD_HEADER_SIZE],
+                                 args_len,
+                                 &record[FRAME_ANSWER_HEADER_SIZE]);
+    }
+    record[2] = answer_len;
+    answer_pos += FRAME_ANSWER_HEADER_SIZE + answer_len;
+    pos += FRAME_RECORD_HEADER_SIZE + args_len;
+    ++num_executed;
+  }
+  response[0] = num_executed;
+}
+
+/* Transmit queued responses while there are free ping-pong buffers. */
+static void transmitQueuedResponses(void) {
+  uint8_t previous;
+  while (inQueueCount != 0) {
+    /* Responses are transmitted in order, so the ping-pong buffer to be
+     * armed now was last used IN_PING_PONG_DEPTH transmissions ago.
+     */
+    previous = (inQueueHead + IN_QUEUE_SIZE - IN_PING_PONG_DEPTH) %
+               IN_QUEUE_SIZE;
+    if (HIDTxHandleBusy(USBInHandle[previous])) {
+      break;
+    }
+    USBInHandle[inQueueHead] = HIDTxPacket(CUSTOM_DEVICE_HID_EP,
+                                           ToSendDataBuffer[inQueueHead],
+                                           64);
+    inQueueHead = (inQueueHead + 1) % IN_QUEUE_SIZE;
+    --inQueueCount;
+  }
+}
+
+/* Get buffer for the next response, NULL if all of them are in use. */
+static uint8_t *allocateResponse(void) {
+  uint8_t slot;
+  if (inQueueCount == IN_QUEUE_SIZE) {
+    return NULL;
+  }
+  slot = (inQueueHead + inQueueCount) % IN_QUEUE_SIZE;
+  if (HIDTxHandleBusy(USBInHandle[slot])) {
+    return NULL;
+  }
+  memset(ToSendDataBuffer[slot], 0, 64);
+  return ToSendDataBuffer[slot];
+}
+
+/* Queue the response from allocateResponse() for transmission. */
 static void transmitResponse(void) {
-  if (!HIDTxHandleBusy(USBInHandle)) {
-    USBInHandle = HIDTxPacket(CUSTOM_DEVICE_HID_EP,
-                              (uint8_t*)&ToSendDataBuffer[0], 64);
+  ++inQueueCount;
+  transmitQueuedResponses();
+}
+
+/* Queue event report if status of any computer changed. */
+static void transmitEvents(void) {
+  uint8_t i, n;
+  uint8_t *response;
+  eventChanges |= APP_control_take_status_changes();
+  if (!eventsEnabled || eventChanges == 0) {
+    return;
   }
+  /* Changes are accumulated until there's a free buffer. */
+  response = allocateResponse();
+  if (response == NULL) {
+    return;
+  }
+  n = APP_control_num_pcs();
+  response[0] = EVENT_STATUS_CHANGED;
+  response[EVENT_CHANGES_OFFSET] = eventChanges;
+  response[EVENT_NUM_PCS_OFFSET] = n;
+  for (i = 0; i < n; ++i) {
+    response[EVENT_STATUS_OFFSET + i] = APP_control_get_pc_status(i);
+  }
+  response[REQUEST_ID_OFFSET] = REQUEST_ID_EVENT;
+  eventChanges = 0;
+  transmitResponse();
 }
 
 /* Initializes the Custom HID code. */
 void APP_DeviceCustomHIDInitialize(void) {
-  /* Initialize the variable holding the handle for the last transmission. */
-  USBInHandle = 0;
+  uint8_t i;
+
+  /* Initialize the variables holding the handles for the last transmissions
+   * and drop responses which were not sent yet.
+   */
+  for (i = 0; i < IN_QUEUE_SIZE; ++i) {
+    USBInHandle[i] = 0;
+  }
+  inQueueHead = 0;
+  inQueueCount = 0;
+
+  /* Host has to enable events again after re-configuration. */
+  eventsEnabled = false;
+  eventChanges = 0;
 
   /* Enable the HID endpoint. */
   USBEnableEndpoint(CUSTOM_DEVICE_HID_EP,
@@ -103,90 +480,38 @@ void APP_DeviceCustomHIDInitialize(void) {
 *
 ********************************************************************/
 void APP_DeviceCustomHIDTasks(void) {
+  uint8_t command;
+  uint8_t *response;
+
+  transmitQueuedResponses();
+  transmitEvents();
+
   /* Check if we have received an OUT data packet from the host. */
   if (HIDRxHandleBusy(USBOutHandle) == false) {
-    int i, n, pc;
+    /* Only take the command when there's a buffer for its answer. Until
+     * then the OUT endpoint stays busy and the host is NAKed, so nothing
+     * gets lost.
+     */
+    response = allocateResponse();
+    if (response == NULL) {
+      return;
+    }
     /* We just received a packet of data from the USB host.
      * Check the first uint8_t of the packet to see what command the host
      * application software wants us to fulfill.
      */
-
-     /* Look at the data the host sent, to see what kind of application specific
-      * command it sent. */
-    switch (ReceivedDataBuffer[0]) {
-      case COMMAND_TEST:
-        APP_network_debug_blink();
-        break;
-      case COMMAND_SWITCH_PRESS:
-        pc = ReceivedDataBuffer[1];
-        if(pc >= 0 && pc < APP_control_num_pcs()) {
-            APP_control_switch_press(pc, ReceivedDataBuffer[2] != 0);
-        }
-        break;
-      case COMMAND_CFG_SET_AUTOBOOT:
-        pc = ReceivedDataBuffer[1];
-        if(pc >= 0 && pc < APP_control_num_pcs()) {
-          APP_control_set_autoboot_enabled(pc, ReceivedDataBuffer[2] != 0);
-        }
-        break;
-      case COMMAND_CFG_SET_IP:
-        APP_network_set_ip(ReceivedDataBuffer[1],
-                           ReceivedDataBuffer[2],
-                           ReceivedDataBuffer[3],
-                           ReceivedDataBuffer[4]);
-        break;
-      case COMMAND_CFG_SET_MAC:
-        APP_network_set_mac(ReceivedDataBuffer[1],
-                            ReceivedDataBuffer[2],
-                            ReceivedDataBuffer[3],
-                            ReceivedDataBuffer[4],
-                            ReceivedDataBuffer[5],
-                            ReceivedDataBuffer[6]);
-      case COMMAND_CFG_SET_PC_NAME:
-        pc = ReceivedDataBuffer[1];
-        if(pc >= 0 && pc < APP_control_num_pcs()) {
-          APP_control_set_pc_name(pc, ReceivedDataBuffer + 2);
-        }
-        break;
-      case COMMAND_CFG_GET_AUTOBOOT:
-        pc = ReceivedDataBuffer[1];
-        if(pc >= 0 && pc < APP_control_num_pcs()) {
-          ToSendDataBuffer[0] =
-                  APP_control_is_autoboot_enabled(pc);
-          transmitResponse();
-        }
-        break;
-      case COMMAND_CFG_GET_IP:
-        APP_network_get_ip(&ToSendDataBuffer[0],
-                           &ToSendDataBuffer[1],
-                           &ToSendDataBuffer[2],
-                           &ToSendDataBuffer[3]);
-        transmitResponse();
-        break;
-      case COMMAND_CFG_GET_MAC:
-        APP_network_get_mac(&ToSendDataBuffer[0],
-                            &ToSendDataBuffer[1],
-                            &ToSendDataBuffer[2],
-                            &ToSendDataBuffer[3],
-                            &ToSendDataBuffer[4],
-                            &ToSendDataBuffer[5]);
-        transmitResponse();
-        break;
-      case COMMAND_CFG_GET_STATUS:
-        n = APP_control_num_pcs();
-        ToSendDataBuffer[0] = n;
-        for (i = 0; i < n; ++i) {
-          ToSendDataBuffer[i + 1] = APP_control_get_pc_status(i);
-        }
-        transmitResponse();
-        break;
-      case COMMAND_CFG_GET_PC_NAME:
-        pc = ReceivedDataBuffer[1];
-        if(pc >= 0 && pc < APP_control_num_pcs()) {
-          APP_control_get_pc_name(pc, ToSendDataBuffer);
-        }
-        transmitResponse();
-        break;
+    command = ReceivedDataBuffer[0];
+    if (command == COMMAND_FRAME) {
+      executeFrame(ReceivedDataBuffer, response);
+    } else {
+      executeCommand(command,
+                     &ReceivedDataBuffer[1],
+                     REQUEST_ID_OFFSET - 1,
+                     response);
+    }
+    if (command == COMMAND_FRAME || answerSize(command) != 0) {
+      response[REQUEST_ID_OFFSET] = ReceivedDataBuffer[REQUEST_ID_OFFSET];
+      transmitResponse();
     }
     /* Re-arm the OUT endpoint, so we can receive the next OUT data packet
      * that the host may try to send us.
@@ -25,6 +25,7 @@
 #define FIXED_ADDRESS_MEMORY
 
 #define HID_CUSTOM_OUT_DATA_BUFFER_ADDRESS 0x500
+/* Ring of IN_QUEUE_SIZE reports, 0x540..0x63F. */
 #define HID_CUSTOM_IN_DATA_BUFFER_ADDRESS 0x540
 
 #endif  /* __FIXED_MEMORY_ADDRESS__ */
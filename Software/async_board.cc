@@ -0,0 +1,764 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "async_board.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <libusb.h>
+
+#include "device.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+/* Frames are rounded up to the granule, bigger ones are not pooled. */
+const size_t FRAME_GRANULE = 64;
+const size_t NUM_FRAME_CLASSES = 32;
+
+/* How long wait_state() relies on events before asking for the status,
+ * in case an event is lost.
+ */
+const int EVENT_STATUS_INTERVAL_MS = 1000;
+/* Status polling interval for firmware without events. */
+const int POLL_STATUS_INTERVAL_MS = 10;
+const int WAIT_STATE_TIMEOUT_MS = 60000;
+/* Requests in flight at once, the rest wait for a free request ID. */
+const int MAX_REQUESTS = REQUEST_ID_MAX - REQUEST_ID_MIN + 1;
+
+struct FreeFrame {
+  FreeFrame *next;
+};
+
+class FramePool {
+ public:
+  FramePool() : num_heap_allocations(0) {
+    std::fill(free_lists, free_lists + NUM_FRAME_CLASSES, (FreeFrame *)NULL);
+  }
+
+  ~FramePool() {
+    for (size_t i = 0; i < NUM_FRAME_CLASSES; ++i) {
+      while (free_lists[i] != NULL) {
+        FreeFrame *frame = free_lists[i];
+        free_lists[i] = frame->next;
+        ::operator delete(frame);
+      }
+    }
+  }
+
+  FreeFrame *free_lists[NUM_FRAME_CLASSES];
+  int num_heap_allocations;
+};
+
+thread_local FramePool frame_pool;
+
+size_t frame_class(size_t size) {
+  return size == 0 ? 0 : (size - 1) / FRAME_GRANULE;
+}
+
+}  /* namespace */
+
+void *frame_pool_allocate(size_t size) {
+  size_t index = frame_class(size);
+  FreeFrame *frame =
+      index < NUM_FRAME_CLASSES ? frame_pool.free_lists[index] : NULL;
+  if (frame != NULL) {
+    frame_pool.free_lists[index] = frame->next;
+    return frame;
+  }
+  ++frame_pool.num_heap_allocations;
+  if (index >= NUM_FRAME_CLASSES) {
+    return ::operator new(size);
+  }
+  return ::operator new((index + 1) * FRAME_GRANULE);
+}
+
+void frame_pool_free(void *ptr, size_t size) {
+  size_t index = frame_class(size);
+  if (index >= NUM_FRAME_CLASSES) {
+    ::operator delete(ptr);
+    return;
+  }
+  FreeFrame *frame = (FreeFrame *)ptr;
+  frame->next = frame_pool.free_lists[index];
+  frame_pool.free_lists[index] = frame;
+}
+
+int frame_pool_num_heap_allocations(void) {
+  return frame_pool.num_heap_allocations;
+}
+
+std::coroutine_handle<> Task::FinalAwaiter::await_suspend(
+    Handle handle) noexcept {
+  promise_type &promise = handle.promise();
+  if (promise.continuation) {
+    return promise.continuation;
+  }
+  if (promise.executor != NULL) {
+    Executor *executor = promise.executor;
+    if (promise.r_result != NULL) {
+      *promise.r_result = promise.result;
+    }
+    handle.destroy();
+    executor->task_finished();
+  }
+  return std::noop_coroutine();
+}
+
+Task::Task(Handle handle) : handle_(handle) {
+}
+
+Task::Task(Task &&other) noexcept : handle_(other.handle_) {
+  other.handle_ = NULL;
+}
+
+Task::~Task() {
+  if (handle_) {
+    handle_.destroy();
+  }
+}
+
+std::coroutine_handle<> Task::await_suspend(
+    std::coroutine_handle<> awaiter) {
+  handle_.promise().continuation = awaiter;
+  return handle_;
+}
+
+int Task::await_resume(void) {
+  return handle_.promise().result;
+}
+
+Task::Handle Task::release(void) {
+  Handle handle = handle_;
+  handle_ = NULL;
+  return handle;
+}
+
+Cancellation::Cancellation(Executor *executor)
+    : executor_(executor),
+      cancelled_(false) {
+}
+
+void Cancellation::cancel(void) {
+  if (!cancelled_) {
+    cancelled_ = true;
+    executor_->cancel(this);
+  }
+}
+
+bool Cancellation::is_cancelled(void) const {
+  return cancelled_;
+}
+
+WaitAwaiter::WaitAwaiter(Executor *executor,
+                         Waiter::Kind kind,
+                         int timeout_ms,
+                         Cancellation *cancellation)
+    : executor_(executor),
+      waiter_() {
+  waiter_.kind = kind;
+  waiter_.deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+  waiter_.cancellation = cancellation;
+}
+
+bool WaitAwaiter::await_ready(void) {
+  if (waiter_.cancellation != NULL && waiter_.cancellation->is_cancelled()) {
+    waiter_.result = LIBUSB_ERROR_INTERRUPTED;
+    return true;
+  }
+  return false;
+}
+
+void WaitAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  waiter_.handle = handle;
+  executor_->suspend(&waiter_);
+}
+
+int WaitAwaiter::await_resume(void) {
+  return waiter_.result;
+}
+
+RequestAwaiter::RequestAwaiter(Executor *executor,
+                               unsigned char report[PACKET_INT_LEN],
+                               unsigned char answer[PACKET_INT_LEN],
+                               int timeout_ms,
+                               Cancellation *cancellation)
+    : WaitAwaiter(executor, Waiter::WAIT_ANSWER, timeout_ms, cancellation) {
+  waiter_.report = report;
+  waiter_.answer = answer;
+}
+
+bool RequestAwaiter::await_ready(void) {
+  return WaitAwaiter::await_ready() || executor_->start_request(&waiter_);
+}
+
+StatusAwaiter::StatusAwaiter(Executor *executor,
+                             int pc,
+                             int timeout_ms,
+                             Cancellation *cancellation)
+    : WaitAwaiter(executor, Waiter::WAIT_STATUS, timeout_ms, cancellation) {
+  waiter_.pc = pc;
+}
+
+Executor::Executor()
+    : waiters_(NULL),
+      num_requests_(0),
+      num_tasks_(0),
+      stopped_(false) {
+}
+
+Executor::~Executor() {
+  /* Tasks which were not finished stay suspended, only their requests are
+   * forgotten.
+   */
+  for (Waiter *waiter = waiters_; waiter != NULL; waiter = waiter->next) {
+    if (waiter->submitted) {
+      device_cancel_request(waiter->request);
+    }
+  }
+}
+
+void Executor::spawn(Task task, int *r_result) {
+  Task::Handle handle = task.release();
+  handle.promise().executor = this;
+  handle.promise().r_result = r_result;
+  ++num_tasks_;
+  schedule(handle);
+}
+
+int Executor::run(void) {
+  stopped_ = false;
+  while (!stopped_ && num_tasks_ > 0) {
+    ready_.swap(running_);
+    size_t i = 0;
+    for (; i < running_.size() && !stopped_; ++i) {
+      running_[i].resume();
+    }
+    /* Tasks not resumed before the stop run first on the next run(). */
+    ready_.insert(ready_.begin(), running_.begin() + i, running_.end());
+    running_.clear();
+    if (stopped_ || num_tasks_ == 0 || !ready_.empty()) {
+      continue;
+    }
+    if (waiters_ == NULL) {
+      /* Remaining tasks wait for something which never comes. */
+      break;
+    }
+    wait_device();
+    expire_waiters();
+    start_queued_requests();
+  }
+  return num_tasks_;
+}
+
+void Executor::stop(void) {
+  stopped_ = true;
+}
+
+WaitAwaiter Executor::sleep(int timeout_ms, Cancellation *cancellation) {
+  return WaitAwaiter(this, Waiter::WAIT_SLEEP, timeout_ms, cancellation);
+}
+
+void Executor::schedule(std::coroutine_handle<> handle) {
+  ready_.push_back(handle);
+}
+
+void Executor::suspend(Waiter *waiter) {
+  waiter->prev = NULL;
+  waiter->next = waiters_;
+  if (waiters_ != NULL) {
+    waiters_->prev = waiter;
+  }
+  waiters_ = waiter;
+}
+
+void Executor::wake(Waiter *waiter, int result) {
+  if (waiter->prev != NULL) {
+    waiter->prev->next = waiter->next;
+  } else {
+    waiters_ = waiter->next;
+  }
+  if (waiter->next != NULL) {
+    waiter->next->prev = waiter->prev;
+  }
+  if (waiter->submitted) {
+    waiter->submitted = false;
+    --num_requests_;
+  }
+  waiter->result = result;
+  schedule(waiter->handle);
+}
+
+bool Executor::start_request(Waiter *waiter) {
+  if (num_requests_ >= MAX_REQUESTS) {
+    /* Submitted once another request is done. */
+    return false;
+  }
+  waiter->request = device_submit_request(waiter->report);
+  if (waiter->request < 0) {
+    waiter->result = waiter->request;
+    return true;
+  }
+  /* Answers which come through the daemon are there right away. */
+  waiter->result = device_poll_answer(waiter->request, waiter->answer);
+  if (waiter->result != LIBUSB_ERROR_TIMEOUT) {
+    return true;
+  }
+  waiter->submitted = true;
+  waiter->retry_deadline =
+      Clock::now() +
+      std::chrono::milliseconds(device_request_timeout(waiter->request));
+  ++num_requests_;
+  return false;
+}
+
+void Executor::start_queued_requests(void) {
+  Waiter *next;
+  for (Waiter *waiter = waiters_;
+       waiter != NULL && num_requests_ < MAX_REQUESTS;
+       waiter = next) {
+    next = waiter->next;
+    if (waiter->kind == Waiter::WAIT_ANSWER &&
+        !waiter->submitted &&
+        start_request(waiter)) {
+      wake(waiter, waiter->result);
+    }
+  }
+}
+
+void Executor::cancel(Cancellation *cancellation) {
+  Waiter *next;
+  for (Waiter *waiter = waiters_; waiter != NULL; waiter = next) {
+    next = waiter->next;
+    if (waiter->cancellation != cancellation) {
+      continue;
+    }
+    if (waiter->submitted) {
+      device_cancel_request(waiter->request);
+    }
+    wake(waiter, LIBUSB_ERROR_INTERRUPTED);
+  }
+}
+
+void Executor::task_finished(void) {
+  --num_tasks_;
+}
+
+bool Executor::has_waiters(Waiter::Kind kind) {
+  for (Waiter *waiter = waiters_; waiter != NULL; waiter = waiter->next) {
+    if (waiter->kind == kind) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Sleep until an answer or event comes, or the nearest deadline. */
+void Executor::wait_device(void) {
+  Clock::time_point deadline = Clock::time_point::max();
+  for (Waiter *waiter = waiters_; waiter != NULL; waiter = waiter->next) {
+    deadline = std::min(deadline, waiter->deadline);
+    if (waiter->submitted) {
+      deadline = std::min(deadline, waiter->retry_deadline);
+    }
+  }
+  Clock::time_point now = Clock::now();
+  int timeout_ms = 0;
+  if (deadline > now) {
+    /* Round up, so the deadline has passed when poll() returns. */
+    timeout_ms = std::chrono::ceil<std::chrono::milliseconds>(
+        deadline - now).count();
+  }
+  pollfd fds[2];
+  int num_fds = 0;
+  int answer_fd = device_answer_fd();
+  if (answer_fd >= 0 && has_waiters(Waiter::WAIT_ANSWER)) {
+    fds[num_fds++] = (pollfd){answer_fd, POLLIN, 0};
+  }
+  int event_fd = device_event_fd();
+  if (event_fd >= 0 && has_waiters(Waiter::WAIT_STATUS)) {
+    fds[num_fds++] = (pollfd){event_fd, POLLIN, 0};
+    /* Events from the daemon might be queued already. */
+    if (device_is_daemon_client()) {
+      read_events();
+      if (!ready_.empty()) {
+        return;
+      }
+    }
+  }
+  if (poll(fds, num_fds, timeout_ms) <= 0) {
+    return;
+  }
+  for (int i = 0; i < num_fds; ++i) {
+    if (!(fds[i].revents & POLLIN)) {
+      continue;
+    }
+    if (fds[i].fd == answer_fd) {
+      uint64_t value;
+      if (read(answer_fd, &value, sizeof(value)) < 0) {
+        /* Counter is reset already. */
+      }
+      poll_answers();
+    } else {
+      read_events();
+    }
+  }
+}
+
+void Executor::poll_answers(void) {
+  Waiter *next;
+  for (Waiter *waiter = waiters_; waiter != NULL; waiter = next) {
+    next = waiter->next;
+    if (!waiter->submitted) {
+      continue;
+    }
+    int r = device_poll_answer(waiter->request, waiter->answer);
+    if (r != LIBUSB_ERROR_TIMEOUT) {
+      wake(waiter, r);
+    }
+  }
+}
+
+/* Give new status of the computers to the coroutines which wait for it. */
+void Executor::read_events(void) {
+  unsigned char event[PACKET_INT_LEN];
+  int r;
+  while ((r = device_wait_event(event, 0)) == 0) {
+    if (event[0] != EVENT_STATUS_CHANGED) {
+      continue;
+    }
+    int num_pcs = std::min((int)event[EVENT_NUM_PCS_OFFSET], NUM_PCS);
+    Waiter *next;
+    for (Waiter *waiter = waiters_; waiter != NULL; waiter = next) {
+      next = waiter->next;
+      if (waiter->kind == Waiter::WAIT_STATUS &&
+          waiter->pc < num_pcs &&
+          (event[EVENT_CHANGES_OFFSET] & (1 << waiter->pc))) {
+        wake(waiter, event[EVENT_STATUS_OFFSET + waiter->pc]);
+      }
+    }
+  }
+  if (r == LIBUSB_ERROR_NO_DEVICE) {
+    Waiter *next;
+    for (Waiter *waiter = waiters_; waiter != NULL; waiter = next) {
+      next = waiter->next;
+      if (waiter->kind == Waiter::WAIT_STATUS) {
+        wake(waiter, r);
+      }
+    }
+  }
+}
+
+void Executor::expire_waiters(void) {
+  Clock::time_point now = Clock::now();
+  Waiter *next;
+  for (Waiter *waiter = waiters_; waiter != NULL; waiter = next) {
+    next = waiter->next;
+    bool expired = waiter->deadline <= now;
+    bool retry = waiter->submitted && waiter->retry_deadline <= now;
+    if (!expired && !retry) {
+      continue;
+    }
+    if (waiter->kind == Waiter::WAIT_SLEEP) {
+      wake(waiter, 0);
+      continue;
+    }
+    if (waiter->submitted) {
+      /* Answer might have come after the last poll. */
+      int r = device_poll_answer(waiter->request, waiter->answer);
+      if (r != LIBUSB_ERROR_TIMEOUT) {
+        wake(waiter, r);
+        continue;
+      }
+      if (expired) {
+        device_cancel_request(waiter->request);
+      } else {
+        r = device_retry_request(waiter->request);
+        if (r == 0) {
+          waiter->retry_deadline =
+              now +
+              std::chrono::milliseconds(
+                  device_request_timeout(waiter->request));
+          continue;
+        }
+        /* Request is ended already. */
+        wake(waiter, r);
+        continue;
+      }
+    }
+    wake(waiter, LIBUSB_ERROR_TIMEOUT);
+  }
+}
+
+AsyncBoard::AsyncBoard(Executor *executor)
+    : executor_(executor),
+      timeout_ms_(TIMEOUT),
+      events_checked_(false),
+      events_enabled_(false),
+      capabilities_checked_(false),
+      capabilities_known_(false) {
+}
+
+void AsyncBoard::set_timeout(int timeout_ms) {
+  timeout_ms_ = timeout_ms;
+}
+
+RequestAwaiter AsyncBoard::request(unsigned char report[PACKET_INT_LEN],
+                                   unsigned char answer[PACKET_INT_LEN],
+                                   Cancellation *cancellation) {
+  return RequestAwaiter(executor_, report, answer, timeout_ms_, cancellation);
+}
+
+/* Commands without an answer are done once the report is submitted. */
+int AsyncBoard::send(unsigned char report[PACKET_INT_LEN],
+                     Cancellation *cancellation) {
+  if (cancellation != NULL && cancellation->is_cancelled()) {
+    return LIBUSB_ERROR_INTERRUPTED;
+  }
+  return device_submit_buffer(report);
+}
+
+Task AsyncBoard::test(Cancellation *cancellation) {
+  unsigned char report[PACKET_INT_LEN] = {0};
+  report[0] = COMMAND_TEST;
+  co_return send(report, cancellation);
+}
+
+Task AsyncBoard::press(PressRequest request, Cancellation *cancellation) {
+  unsigned char report[PACKET_INT_LEN];
+  int r = encode_request(request, report);
+  co_return r < 0 ? r : send(report, cancellation);
+}
+
+Task AsyncBoard::set_autoboot(SetAutobootRequest request,
+                              Cancellation *cancellation) {
+  unsigned char report[PACKET_INT_LEN];
+  int r = encode_request(request, report);
+  co_return r < 0 ? r : send(report, cancellation);
+}
+
+Task AsyncBoard::set_ip(SetIpRequest request, Cancellation *cancellation) {
+  unsigned char report[PACKET_INT_LEN];
+  int r = encode_request(request, report);
+  co_return r < 0 ? r : send(report, cancellation);
+}
+
+Task AsyncBoard::set_mac(SetMacRequest request, Cancellation *cancellation) {
+  unsigned char report[PACKET_INT_LEN];
+  int r = encode_request(request, report);
+  co_return r < 0 ? r : send(report, cancellation);
+}
+
+Task AsyncBoard::set_name(SetNameRequest request,
+                          Cancellation *cancellation) {
+  unsigned char report[PACKET_INT_LEN];
+  int r = encode_request(request, report);
+  co_return r < 0 ? r : send(report, cancellation);
+}
+
+Task AsyncBoard::get_autoboot(GetAutobootRequest request,
+                              AutobootAnswer *r_answer,
+                              Cancellation *cancellation) {
+  unsigned char report[PACKET_INT_LEN], answer[PACKET_INT_LEN];
+  int r = encode_request(request, report);
+  if (r == 0) {
+    r = co_await this->request(report, answer, cancellation);
+  }
+  if (r < 0) {
+    co_return r;
+  }
+  decode_answer(answer, r_answer);
+  co_return 0;
+}
+
+Task AsyncBoard::get_ip(IpAnswer *r_answer, Cancellation *cancellation) {
+  unsigned char report[PACKET_INT_LEN] = {0}, answer[PACKET_INT_LEN];
+  report[0] = COMMAND_CFG_GET_IP;
+  int r = co_await request(report, answer, cancellation);
+  if (r < 0) {
+    co_return r;
+  }
+  decode_answer(answer, r_answer);
+  co_return 0;
+}
+
+Task AsyncBoard::get_mac(MacAnswer *r_answer, Cancellation *cancellation) {
+  unsigned char report[PACKET_INT_LEN] = {0}, answer[PACKET_INT_LEN];
+  report[0] = COMMAND_CFG_GET_MAC;
+  int r = co_await request(report, answer, cancellation);
+  if (r < 0) {
+    co_return r;
+  }
+  decode_answer(answer, r_answer);
+  co_return 0;
+}
+
+Task AsyncBoard::get_status(StatusAnswer *r_answer,
+                            Cancellation *cancellation) {
+  unsigned char report[PACKET_INT_LEN] = {0}, answer[PACKET_INT_LEN];
+  report[0] = COMMAND_GET_STATUS;
+  int r = co_await request(report, answer, cancellation);
+  if (r < 0) {
+    co_return r;
+  }
+  decode_answer(answer, r_answer);
+  co_return 0;
+}
+
+Task AsyncBoard::get_name(GetNameRequest request,
+                          NameAnswer *r_answer,
+                          Cancellation *cancellation) {
+  unsigned char report[PACKET_INT_LEN], answer[PACKET_INT_LEN];
+  int r = encode_request(request, report);
+  if (r == 0) {
+    r = co_await this->request(report, answer, cancellation);
+  }
+  if (r < 0) {
+    co_return r;
+  }
+  decode_answer(answer, r_answer);
+  co_return 0;
+}
+
+Task AsyncBoard::get_snapshot(SnapshotAnswer *r_answer,
+                              Cancellation *cancellation) {
+  CapabilitiesAnswer capabilities;
+  int r = co_await get_capabilities(&capabilities, cancellation);
+  if (r < 0) {
+    co_return r;
+  }
+  if (capabilities_known_ &&
+      !capabilities_has_command(capabilities, COMMAND_GET_SNAPSHOT)) {
+    co_return LIBUSB_ERROR_NOT_SUPPORTED;
+  }
+  unsigned char report[PACKET_INT_LEN] = {0}, answer[PACKET_INT_LEN];
+  report[0] = COMMAND_GET_SNAPSHOT;
+  /* Older firmware doesn't answer, don't wait for it for long. */
+  r = co_await RequestAwaiter(executor_,
+                              report,
+                              answer,
+                              capabilities_known_
+                                  ? timeout_ms_
+                                  : std::min(timeout_ms_, PROBE_TIMEOUT),
+                              cancellation);
+  if (r == LIBUSB_ERROR_TIMEOUT && !capabilities_known_) {
+    co_return LIBUSB_ERROR_NOT_SUPPORTED;
+  } else if (r < 0) {
+    co_return r;
+  }
+  decode_answer(answer, r_answer);
+  co_return 0;
+}
+
+Task AsyncBoard::get_capabilities(CapabilitiesAnswer *r_answer,
+                                  Cancellation *cancellation) {
+  if (!capabilities_checked_) {
+    unsigned char report[PACKET_INT_LEN] = {0}, answer[PACKET_INT_LEN];
+    report[0] = COMMAND_GET_CAPABILITIES;
+    int r = co_await RequestAwaiter(executor_,
+                                    report,
+                                    answer,
+                                    std::min(timeout_ms_, PROBE_TIMEOUT),
+                                    cancellation);
+    if (r == 0) {
+      decode_answer(answer, &capabilities_);
+      capabilities_known_ = true;
+    } else if (r == LIBUSB_ERROR_TIMEOUT) {
+      legacy_capabilities(&capabilities_);
+      capabilities_known_ = false;
+    } else {
+      co_return r;
+    }
+    capabilities_checked_ = true;
+  }
+  *r_answer = capabilities_;
+  co_return 0;
+}
+
+void AsyncBoard::enable_events(void) {
+  if (events_checked_) {
+    return;
+  }
+  events_checked_ = true;
+  /* Subscription has no answer, so it's only submitted like the other
+   * commands without one.
+   */
+  events_enabled_ = device_event_fd() >= 0 &&
+                    device_submit_set_events(true) == 0;
+}
+
+Task AsyncBoard::wait_state(int pc, int state) {
+  return wait_state(pc, state, state, WAIT_STATE_TIMEOUT_MS);
+}
+
+Task AsyncBoard::wait_state(int pc,
+                            int mask,
+                            int value,
+                            int timeout_ms,
+                            Cancellation *cancellation) {
+  if (pc < 0 || pc >= NUM_PCS) {
+    co_return LIBUSB_ERROR_INVALID_PARAM;
+  }
+  enable_events();
+  Clock::time_point deadline =
+      Clock::now() + std::chrono::milliseconds(timeout_ms);
+  StatusAnswer status;
+  int r = co_await get_status(&status, cancellation);
+  if (r < 0) {
+    co_return r;
+  }
+  int current = status.status[pc];
+  while ((current & mask) != value) {
+    int remaining_ms = std::chrono::ceil<std::chrono::milliseconds>(
+        deadline - Clock::now()).count();
+    if (remaining_ms <= 0) {
+      co_return LIBUSB_ERROR_TIMEOUT;
+    }
+    /* Status is asked for again every now and then even with events, in
+     * case the event is lost.
+     */
+    int interval_ms = events_enabled_ ? EVENT_STATUS_INTERVAL_MS
+                                      : POLL_STATUS_INTERVAL_MS;
+    r = co_await StatusAwaiter(executor_,
+                               pc,
+                               std::min(remaining_ms, interval_ms),
+                               cancellation);
+    if (r >= 0) {
+      current = r;
+      continue;
+    } else if (r != LIBUSB_ERROR_TIMEOUT) {
+      co_return r;
+    }
+    r = co_await get_status(&status, cancellation);
+    if (r < 0) {
+      co_return r;
+    }
+    current = status.status[pc];
+  }
+  co_return 0;
+}
@@ -0,0 +1,319 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __ASYNC_BOARD_H__
+#define __ASYNC_BOARD_H__
+
+#include <stddef.h>
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <vector>
+
+#include "pcremote.h"
+
+/* Coroutine API of libpcremote, needs C++20.
+ *
+ *   Task boot(AsyncBoard *board) {
+ *     int r = co_await board->press({1, false});
+ *     if (r == 0) {
+ *       r = co_await board->wait_state(1, PC_STATUS_ON);
+ *     }
+ *     co_return r;
+ *   }
+ *
+ *   Executor executor;
+ *   AsyncBoard board(&executor);
+ *   executor.spawn(boot(&board));
+ *   executor.run();
+ *
+ * Any number of flows run concurrently on the thread which calls run(),
+ * requests of all of them are in flight at once.
+ */
+
+class Executor;
+
+/* Coroutine frames come from per-thread free lists, so flows which are
+ * started over and over don't allocate once the lists are warm.
+ */
+void *frame_pool_allocate(size_t size);
+void frame_pool_free(void *ptr, size_t size);
+/* Number of frames the pool of this thread had to take from the heap. */
+int frame_pool_num_heap_allocations(void);
+
+/* Coroutine which returns 0 or a negative libusb error code. It starts
+ * when it's awaited or given to Executor::spawn().
+ */
+class Task {
+ public:
+  struct promise_type;
+  typedef std::coroutine_handle<promise_type> Handle;
+
+  struct FinalAwaiter {
+    bool await_ready(void) noexcept { return false; }
+    std::coroutine_handle<> await_suspend(Handle handle) noexcept;
+    void await_resume(void) noexcept {}
+  };
+
+  struct promise_type {
+    int result = 0;
+    /* Coroutine which awaits this one. */
+    std::coroutine_handle<> continuation;
+    /* Set for the spawned tasks, they're destroyed once finished. */
+    Executor *executor = NULL;
+    int *r_result = NULL;
+
+    Task get_return_object(void) {
+      return Task(Handle::from_promise(*this));
+    }
+    std::suspend_always initial_suspend(void) noexcept { return {}; }
+    FinalAwaiter final_suspend(void) noexcept { return {}; }
+    void return_value(int value) { result = value; }
+    void unhandled_exception(void) { std::terminate(); }
+
+    static void *operator new(size_t size) {
+      return frame_pool_allocate(size);
+    }
+    static void operator delete(void *ptr, size_t size) {
+      frame_pool_free(ptr, size);
+    }
+  };
+
+  explicit Task(Handle handle);
+  Task(Task &&other) noexcept;
+  ~Task();
+
+  Task(const Task &other) = delete;
+  Task &operator=(const Task &other) = delete;
+
+  bool await_ready(void) noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter);
+  int await_resume(void);
+
+  /* Give up the ownership of the coroutine. */
+  Handle release(void);
+
+ protected:
+  Handle handle_;
+};
+
+/* Operations which are given the cancellation finish with
+ * LIBUSB_ERROR_INTERRUPTED once it's cancelled, new ones fail right away.
+ */
+class Cancellation {
+ public:
+  explicit Cancellation(Executor *executor);
+
+  void cancel(void);
+  bool is_cancelled(void) const;
+
+ protected:
+  Executor *executor_;
+  bool cancelled_;
+};
+
+/* Suspended operation, it lives in the frame of the awaiting coroutine. */
+struct Waiter {
+  enum Kind {
+    WAIT_SLEEP,
+    /* Answer to the request. */
+    WAIT_ANSWER,
+    /* Status change event of the computer. */
+    WAIT_STATUS,
+  };
+
+  Kind kind;
+  Waiter *prev;
+  Waiter *next;
+  std::coroutine_handle<> handle;
+  std::chrono::steady_clock::time_point deadline;
+  Cancellation *cancellation;
+  /* Request waits for a free request ID until it's submitted. */
+  bool submitted;
+  int request;
+  /* When the submitted request is sent again unless it's answered. */
+  std::chrono::steady_clock::time_point retry_deadline;
+  unsigned char *report;
+  unsigned char *answer;
+  int pc;
+  int result;
+};
+
+/* Suspends the coroutine until the executor wakes the waiter, result of
+ * co_await is the result it's woken with. Timeout finishes sleeps with 0
+ * and everything else with LIBUSB_ERROR_TIMEOUT.
+ */
+class WaitAwaiter {
+ public:
+  WaitAwaiter(Executor *executor,
+              Waiter::Kind kind,
+              int timeout_ms,
+              Cancellation *cancellation);
+
+  bool await_ready(void);
+  void await_suspend(std::coroutine_handle<> handle);
+  int await_resume(void);
+
+ protected:
+  Executor *executor_;
+  Waiter waiter_;
+};
+
+/* Submits the request, co_await gives 0 once the answer is stored. */
+class RequestAwaiter : public WaitAwaiter {
+ public:
+  RequestAwaiter(Executor *executor,
+                 unsigned char report[PACKET_INT_LEN],
+                 unsigned char answer[PACKET_INT_LEN],
+                 int timeout_ms,
+                 Cancellation *cancellation);
+
+  bool await_ready(void);
+};
+
+/* co_await gives the new PC_STATUS_* bits of the computer once it sends a
+ * status change event.
+ */
+class StatusAwaiter : public WaitAwaiter {
+ public:
+  StatusAwaiter(Executor *executor,
+                int pc,
+                int timeout_ms,
+                Cancellation *cancellation);
+};
+
+/* Runs coroutines on the calling thread and wakes them when their answers,
+ * events or timeouts come.
+ *
+ * Event reports of the device are consumed by the executor while there
+ * are coroutines waiting for status changes.
+ */
+class Executor {
+ public:
+  Executor();
+  ~Executor();
+
+  /* Start the task, it's destroyed once finished. Its result is stored in
+   * r_result when it's given.
+   */
+  void spawn(Task task, int *r_result = NULL);
+
+  /* Run until all spawned tasks are finished or stop() is called, returns
+   * number of unfinished tasks. They're continued by the next run().
+   */
+  int run(void);
+  void stop(void);
+
+  WaitAwaiter sleep(int timeout_ms, Cancellation *cancellation = NULL);
+
+  /* Used by the awaiters. */
+  void schedule(std::coroutine_handle<> handle);
+  void suspend(Waiter *waiter);
+  void wake(Waiter *waiter, int result);
+  void cancel(Cancellation *cancellation);
+  void task_finished(void);
+  /* Submit request of the waiter, returns true when it's done already. */
+  bool start_request(Waiter *waiter);
+
+ protected:
+  void start_queued_requests(void);
+  void wait_device(void);
+  void poll_answers(void);
+  void read_events(void);
+  void expire_waiters(void);
+  bool has_waiters(Waiter::Kind kind);
+
+  std::vector<std::coroutine_handle<> > ready_;
+  /* Coroutines which are being resumed, kept to reuse its storage. */
+  std::vector<std::coroutine_handle<> > running_;
+  /* All suspended operations. */
+  Waiter *waiters_;
+  /* Requests which are submitted and not answered yet. */
+  int num_requests_;
+  int num_tasks_;
+  bool stopped_;
+};
+
+/* Awaitable commands on the opened board, see Device for the details of
+ * every command.
+ */
+class AsyncBoard {
+ public:
+  explicit AsyncBoard(Executor *executor);
+
+  /* How long to wait for the answer to a single request. */
+  void set_timeout(int timeout_ms);
+
+  Task test(Cancellation *cancellation = NULL);
+  Task press(PressRequest request, Cancellation *cancellation = NULL);
+  Task set_autoboot(SetAutobootRequest request,
+                    Cancellation *cancellation = NULL);
+  Task set_ip(SetIpRequest request, Cancellation *cancellation = NULL);
+  Task set_mac(SetMacRequest request, Cancellation *cancellation = NULL);
+  /* The name is not copied, it must be alive until the task finishes. */
+  Task set_name(SetNameRequest request, Cancellation *cancellation = NULL);
+
+  Task get_autoboot(GetAutobootRequest request,
+                    AutobootAnswer *r_answer,
+                    Cancellation *cancellation = NULL);
+  Task get_ip(IpAnswer *r_answer, Cancellation *cancellation = NULL);
+  Task get_mac(MacAnswer *r_answer, Cancellation *cancellation = NULL);
+  Task get_status(StatusAnswer *r_answer, Cancellation *cancellation = NULL);
+  Task get_name(GetNameRequest request,
+                NameAnswer *r_answer,
+                Cancellation *cancellation = NULL);
+  /* LIBUSB_ERROR_NOT_SUPPORTED when the firmware doesn't know it. */
+  Task get_snapshot(SnapshotAnswer *r_answer,
+                    Cancellation *cancellation = NULL);
+  /* Cached like Device::get_capabilities(). */
+  Task get_capabilities(CapabilitiesAnswer *r_answer,
+                        Cancellation *cancellation = NULL);
+
+  /* Wait until status of the computer has all the given PC_STATUS_* bits
+   * set, or until (status & mask) == value. Status change events are used
+   * when the firmware sends them, status is polled otherwise.
+   */
+  Task wait_state(int pc, int state);
+  Task wait_state(int pc,
+                  int mask,
+                  int value,
+                  int timeout_ms,
+                  Cancellation *cancellation = NULL);
+
+  RequestAwaiter request(unsigned char report[PACKET_INT_LEN],
+                         unsigned char answer[PACKET_INT_LEN],
+                         Cancellation *cancellation = NULL);
+
+ protected:
+  int send(unsigned char report[PACKET_INT_LEN], Cancellation *cancellation);
+  void enable_events(void);
+
+  Executor *executor_;
+  int timeout_ms_;
+  bool events_checked_;
+  bool events_enabled_;
+  bool capabilities_checked_;
+  bool capabilities_known_;
+  CapabilitiesAnswer capabilities_;
+};
+
+#endif  /* __ASYNC_BOARD_H__ */
@@ -0,0 +1,317 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "bench.h"
+
+#include <math.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <vector>
+
+#include <libusb.h>
+
+#include "device.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+/* Only commands which don't change anything on the board are measured. */
+struct BenchCommand {
+  const char *name;
+  int command;
+};
+
+const BenchCommand BENCH_COMMANDS[] = {
+  {"test", COMMAND_TEST},
+  {"get_status", COMMAND_GET_STATUS},
+  {"get_autoboot", COMMAND_CFG_GET_AUTOBOOT},
+  {"get_ip", COMMAND_CFG_GET_IP},
+  {"get_mac", COMMAND_CFG_GET_MAC},
+  {"get_pc_name", COMMAND_CFG_GET_PC_NAME},
+  {"get_snapshot", COMMAND_GET_SNAPSHOT},
+};
+
+struct BenchResult {
+  const char *name;
+  bool supported;
+  int num_errors;
+  /* Latency of every successful request in milliseconds. */
+  std::vector<double> latencies;
+  double elapsed_sec;
+  /* Lost answers during the run and the answer timeout after it. */
+  int num_timeouts;
+  int num_retries;
+  double rto_ms;
+};
+
+double elapsed_ms(Clock::time_point start, Clock::time_point end) {
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+/* Nearest-rank percentile of the sorted latencies. */
+double percentile(const std::vector<double> &latencies, double p) {
+  if (latencies.empty()) {
+    return 0.0;
+  }
+  size_t rank = (size_t)ceil(p / 100.0 * latencies.size());
+  return latencies[std::max(rank, (size_t)1) - 1];
+}
+
+void fill_report(int command, unsigned char buffer[PACKET_INT_LEN]) {
+  std::fill(buffer, buffer + PACKET_INT_LEN, 0);
+  buffer[0] = command;
+}
+
+/* Commands without an answer are timed until the report is delivered. */
+void bench_write_command(const BenchOptions &options,
+                         int command,
+                         BenchResult *result) {
+  for (int i = 0; i < options.num_reports; ++i) {
+    unsigned char buffer[PACKET_INT_LEN];
+    fill_report(command, buffer);
+    Clock::time_point start = Clock::now();
+    if (device_send_buffer(buffer) < 0) {
+      ++result->num_errors;
+      continue;
+    }
+    result->latencies.push_back(elapsed_ms(start, Clock::now()));
+  }
+}
+
+/* Keep up to options.depth requests in flight, latency is measured from
+ * submitting the request to receiving its answer.
+ */
+void bench_answer_command(const BenchOptions &options,
+                          int command,
+                          BenchResult *result) {
+  struct InFlight {
+    int request;
+    Clock::time_point start;
+  };
+  std::deque<InFlight> in_flight;
+  int num_submitted = 0;
+  while (num_submitted < options.num_reports || !in_flight.empty()) {
+    while (num_submitted < options.num_reports &&
+           (int)in_flight.size() < options.depth) {
+      unsigned char buffer[PACKET_INT_LEN];
+      fill_report(command, buffer);
+      InFlight request;
+      request.start = Clock::now();
+      request.request = device_submit_request(buffer);
+      ++num_submitted;
+      if (request.request < 0) {
+        ++result->num_errors;
+        break;
+      }
+      in_flight.push_back(request);
+    }
+    if (in_flight.empty()) {
+      continue;
+    }
+    unsigned char answer[PACKET_INT_LEN];
+    InFlight request = in_flight.front();
+    in_flight.pop_front();
+    if (device_wait_answer(request.request, answer) < 0) {
+      ++result->num_errors;
+      continue;
+    }
+    result->latencies.push_back(elapsed_ms(request.start, Clock::now()));
+  }
+}
+
+/* Optional commands are skipped when the firmware doesn't know them. */
+bool is_command_supported(int command) {
+  if (!command_is_optional(command)) {
+    return true;
+  }
+  unsigned char buffer[PACKET_INT_LEN];
+  fill_report(command, buffer);
+  int request = device_submit_request(buffer);
+  return request >= 0 && device_wait_answer(request, buffer) == 0;
+}
+
+/* Open and close the device, the cache is only used when cached is true. */
+void bench_open(const BenchOptions &options, bool cached, BenchResult *result) {
+  device_set_cache_enabled(cached);
+  if (cached) {
+    /* Make sure the location is known. */
+    if (device_open(false) == 0) {
+      device_close();
+    }
+  }
+  for (int i = 0; i < options.num_reports; ++i) {
+    Clock::time_point start = Clock::now();
+    if (device_open(false) < 0) {
+      ++result->num_errors;
+      continue;
+    }
+    result->latencies.push_back(elapsed_ms(start, Clock::now()));
+    device_close();
+  }
+}
+
+void print_text_results(const BenchOptions &options,
+                        const std::vector<BenchResult> &results) {
+  FILE *out = options.output;
+  if (options.open) {
+    fprintf(out, "%d opens per mode\n", options.num_reports);
+  } else {
+    fprintf(out, "%d reports per command, %d in flight\n",
+            options.num_reports, options.depth);
+  }
+  fprintf(out, "%-14s %7s %7s %8s %8s %8s %8s %8s %10s\n",
+          "command", "errors", "retries", "rto ms", "p50 ms", "p90 ms",
+          "p99 ms", "max ms", "cmds/sec");
+  for (size_t i = 0; i < results.size(); ++i) {
+    const BenchResult &result = results[i];
+    if (!result.supported) {
+      fprintf(out, "%-14s not supported by the firmware\n", result.name);
+      continue;
+    }
+    fprintf(out, "%-14s %7d %7d %8.1f %8.3f %8.3f %8.3f %8.3f %10.1f\n",
+            result.name,
+            result.num_errors,
+            result.num_retries,
+            result.rto_ms,
+            percentile(result.latencies, 50),
+            percentile(result.latencies, 90),
+            percentile(result.latencies, 99),
+            percentile(result.latencies, 100),
+            result.latencies.size() / result.elapsed_sec);
+  }
+}
+
+void print_json_results(const BenchOptions &options,
+                        const std::vector<BenchResult> &results) {
+  FILE *out = options.output;
+  fprintf(out,
+          "{\"reports\": %d, \"depth\": %d, \"open\": %s, \"commands\": [",
+          options.num_reports, options.depth, options.open ? "true" : "false");
+  for (size_t i = 0; i < results.size(); ++i) {
+    const BenchResult &result = results[i];
+    fprintf(out, "%s\n  {\"name\": \"%s\", \"supported\": %s",
+            i == 0 ? "" : ",",
+            result.name,
+            result.supported ? "true" : "false");
+    if (result.supported) {
+      fprintf(out,
+              ", \"count\": %d, \"errors\": %d, \"timeouts\": %d, "
+              "\"retries\": %d, \"rto_ms\": %.1f, "
+              "\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, "
+              "\"max_ms\": %.3f, \"per_second\": %.1f",
+              (int)result.latencies.size(),
+              result.num_errors,
+              result.num_timeouts,
+              result.num_retries,
+              result.rto_ms,
+              percentile(result.latencies, 50),
+              percentile(result.latencies, 90),
+              percentile(result.latencies, 99),
+              percentile(result.latencies, 100),
+              result.latencies.size() / result.elapsed_sec);
+    }
+    fprintf(out, "}");
+  }
+  fprintf(out, "\n]}\n");
+}
+
+}  /* namespace */
+
+bool bench_run(const BenchOptions &options) {
+  std::vector<BenchResult> results;
+  if (options.open) {
+    device_close();
+    for (int cached = 0; cached < 2; ++cached) {
+      BenchResult result;
+      result.name = cached ? "open_cached" : "open_cold";
+      result.supported = true;
+      result.num_errors = 0;
+      result.elapsed_sec = 0.0;
+      result.num_timeouts = 0;
+      result.num_retries = 0;
+      result.rto_ms = 0.0;
+      results.push_back(result);
+    }
+  } else {
+    for (size_t i = 0;
+         i < sizeof(BENCH_COMMANDS) / sizeof(*BENCH_COMMANDS);
+         ++i) {
+      BenchResult result;
+      result.name = BENCH_COMMANDS[i].name;
+      result.supported = is_command_supported(BENCH_COMMANDS[i].command);
+      result.num_errors = 0;
+      result.elapsed_sec = 0.0;
+      result.num_timeouts = 0;
+      result.num_retries = 0;
+      result.rto_ms = 0.0;
+      results.push_back(result);
+    }
+  }
+  bool ok = true;
+  for (size_t i = 0; i < results.size(); ++i) {
+    BenchResult *result = &results[i];
+    if (!result->supported) {
+      continue;
+    }
+    CommandStats stats_before, stats_after;
+    if (!options.open) {
+      device_command_stats(BENCH_COMMANDS[i].command, &stats_before);
+    }
+    Clock::time_point start = Clock::now();
+    if (options.open) {
+      bench_open(options, i == 1, result);
+    } else if (command_has_answer(BENCH_COMMANDS[i].command)) {
+      bench_answer_command(options, BENCH_COMMANDS[i].command, result);
+    } else {
+      bench_write_command(options, BENCH_COMMANDS[i].command, result);
+    }
+    result->elapsed_sec = elapsed_ms(start, Clock::now()) / 1000.0;
+    if (!options.open) {
+      device_command_stats(BENCH_COMMANDS[i].command, &stats_after);
+      result->num_timeouts = stats_after.num_timeouts -
+                             stats_before.num_timeouts;
+      result->num_retries = stats_after.num_retries -
+                            stats_before.num_retries;
+      if (command_has_answer(BENCH_COMMANDS[i].command)) {
+        result->rto_ms = stats_after.rto_ms;
+      }
+    }
+    std::sort(result->latencies.begin(), result->latencies.end());
+    if (result->num_errors != 0) {
+      ok = false;
+    }
+  }
+  if (options.open) {
+    /* Leave the device open, as it was. */
+    device_set_cache_enabled(true);
+    device_open(false);
+  }
+  if (options.json) {
+    print_json_results(options, results);
+  } else {
+    print_text_results(options, results);
+  }
+  return ok;
+}
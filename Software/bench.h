@@ -0,0 +1,43 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdio.h>
+
+struct BenchOptions {
+  int num_reports;  /* Reports to send for every command. */
+  int depth;        /* Requests which are in flight at once. */
+  bool json;
+  /* Measure opening the device instead of the commands. */
+  bool open;
+  /* Where the results are printed. */
+  FILE *output;
+};
+
+/* Measure round-trip latency and throughput of the read-only commands on
+ * the opened device and print the results. With options.open the time
+ * device_open() takes is measured, with and without the cached location.
+ */
+bool bench_run(const BenchOptions &options);
+
+#endif  /* __BENCH_H__ */
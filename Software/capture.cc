@@ -0,0 +1,389 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "capture.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+
+#include <libusb.h>
+
+#include "device.h"
+
+namespace {
+
+/* Time, direction, request ID and the number of kept bytes. */
+const int RECORD_HEADER_SIZE = 11;
+/* How long the replay waits for the answers to the last reports. */
+const int REPLAY_ANSWER_TIMEOUT_MS = 1000;
+
+void put_le(unsigned char *buffer, uint64_t value, int size) {
+  for (int i = 0; i < size; ++i) {
+    buffer[i] = (value >> (8 * i)) & 0xff;
+  }
+}
+
+uint64_t get_le(const unsigned char *buffer, int size) {
+  uint64_t value = 0;
+  for (int i = 0; i < size; ++i) {
+    value |= (uint64_t)buffer[i] << (8 * i);
+  }
+  return value;
+}
+
+double elapsed_ms(std::chrono::steady_clock::time_point start_time,
+                  std::chrono::steady_clock::time_point end_time) {
+  return std::chrono::duration<double, std::milli>(
+      end_time - start_time).count();
+}
+
+}  /* namespace */
+
+CaptureWriter::CaptureWriter()
+    : file_(NULL) {
+}
+
+CaptureWriter::~CaptureWriter() {
+  close();
+}
+
+int CaptureWriter::open(const char *path) {
+  close();
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    return -errno;
+  }
+  unsigned char header[sizeof(CAPTURE_MAGIC) + 4];
+  memcpy(header, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+  put_le(header + sizeof(CAPTURE_MAGIC), CAPTURE_VERSION, 4);
+  if (fwrite(header, sizeof(header), 1, file) != 1) {
+    int r = -errno;
+    fclose(file);
+    return r;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  file_ = file;
+  start_time_ = std::chrono::steady_clock::now();
+  return 0;
+}
+
+void CaptureWriter::close(void) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (file_ != NULL) {
+    fclose(file_);
+    file_ = NULL;
+  }
+}
+
+bool CaptureWriter::is_open(void) const {
+  return file_ != NULL;
+}
+
+void CaptureWriter::record(int direction,
+                           const unsigned char report[PACKET_INT_LEN]) {
+  std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  int size = REQUEST_ID_OFFSET;
+  while (size > 0 && report[size - 1] == 0) {
+    --size;
+  }
+  unsigned char buffer[RECORD_HEADER_SIZE + PACKET_INT_LEN];
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (file_ == NULL) {
+    return;
+  }
+  put_le(buffer, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     now - start_time_).count(), 8);
+  buffer[8] = direction;
+  buffer[9] = report[REQUEST_ID_OFFSET];
+  buffer[10] = size;
+  memcpy(buffer + RECORD_HEADER_SIZE, report, size);
+  /* Buffered by stdio, capturing must not slow the traffic down. */
+  fwrite(buffer, RECORD_HEADER_SIZE + size, 1, file_);
+}
+
+CaptureReader::CaptureReader()
+    : file_(NULL) {
+}
+
+CaptureReader::~CaptureReader() {
+  close();
+}
+
+int CaptureReader::open(const char *path) {
+  close();
+  file_ = fopen(path, "rb");
+  if (file_ == NULL) {
+    return -errno;
+  }
+  unsigned char header[sizeof(CAPTURE_MAGIC) + 4];
+  if (fread(header, sizeof(header), 1, file_) != 1 ||
+      memcmp(header, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 ||
+      get_le(header + sizeof(CAPTURE_MAGIC), 4) != CAPTURE_VERSION) {
+    close();
+    return -EPROTO;
+  }
+  return 0;
+}
+
+void CaptureReader::close(void) {
+  if (file_ != NULL) {
+    fclose(file_);
+    file_ = NULL;
+  }
+}
+
+int CaptureReader::read(CaptureRecord *r_record) {
+  unsigned char header[RECORD_HEADER_SIZE];
+  size_t len = fread(header, 1, sizeof(header), file_);
+  if (len == 0 && feof(file_)) {
+    return 0;
+  }
+  if (len != sizeof(header) ||
+      header[8] > CAPTURE_IN ||
+      header[10] > REQUEST_ID_OFFSET) {
+    return ferror(file_) ? -EIO : -EPROTO;
+  }
+  memset(r_record->report, 0, PACKET_INT_LEN);
+  int size = header[10];
+  if (size != 0 && fread(r_record->report, size, 1, file_) != 1) {
+    return ferror(file_) ? -EIO : -EPROTO;
+  }
+  r_record->time_ns = get_le(header, 8);
+  r_record->direction = header[8];
+  r_record->report[REQUEST_ID_OFFSET] = header[9];
+  return 1;
+}
+
+RecordingTransport::RecordingTransport(Transport *transport,
+                                       CaptureSink *sink)
+    : transport_(transport),
+      sink_(sink),
+      report_callback_(NULL),
+      report_callback_data_(NULL) {
+}
+
+RecordingTransport::~RecordingTransport() {
+  delete transport_;
+}
+
+void RecordingTransport::set_report_callback(ReportCallback callback,
+                                             void *user_data) {
+  report_callback_ = callback;
+  report_callback_data_ = user_data;
+  transport_->set_report_callback(report_cb, this);
+}
+
+void RecordingTransport::set_device_gone_callback(
+    DeviceGoneCallback callback,
+    void *user_data) {
+  transport_->set_device_gone_callback(callback, user_data);
+}
+
+int RecordingTransport::start(void) {
+  return transport_->start();
+}
+
+void RecordingTransport::stop(void) {
+  transport_->stop();
+}
+
+int RecordingTransport::submit_report(
+    const unsigned char report[PACKET_INT_LEN],
+    int timeout_ms) {
+  /* Recorded before it's submitted, the emulator answers right away. */
+  sink_->record(CAPTURE_OUT, report);
+  return transport_->submit_report(report, timeout_ms);
+}
+
+int RecordingTransport::send_report(
+    const unsigned char report[PACKET_INT_LEN],
+    int timeout_ms) {
+  sink_->record(CAPTURE_OUT, report);
+  return transport_->send_report(report, timeout_ms);
+}
+
+bool RecordingTransport::is_device_gone(void) {
+  return transport_->is_device_gone();
+}
+
+void RecordingTransport::report_cb(const unsigned char report[PACKET_INT_LEN],
+                                   void *user_data) {
+  RecordingTransport *self = (RecordingTransport *)user_data;
+  self->sink_->record(CAPTURE_IN, report);
+  if (self->report_callback_ != NULL) {
+    self->report_callback_(report, self->report_callback_data_);
+  }
+}
+
+CaptureReplayer::CaptureReplayer(CaptureSink *next_sink)
+    : next_sink_(next_sink),
+      num_pending_(0),
+      answer_ms_sum_(0.0) {
+  memset(&stats_, 0, sizeof(stats_));
+  for (int i = 0; i <= REQUEST_ID_MAX; ++i) {
+    pending_[i].expected = -1;
+  }
+}
+
+int CaptureReplayer::load(const char *path) {
+  CaptureReader reader;
+  int r = reader.open(path);
+  if (r < 0) {
+    return r;
+  }
+  records_.clear();
+  CaptureRecord record;
+  while ((r = reader.read(&record)) == 1) {
+    records_.push_back(record);
+  }
+  if (r < 0) {
+    return r;
+  }
+  /* Answer of the request is the first IN report with its ID. */
+  answers_.assign(records_.size(), -1);
+  int last_request[REQUEST_ID_MAX + 1];
+  for (int i = 0; i <= REQUEST_ID_MAX; ++i) {
+    last_request[i] = -1;
+  }
+  for (size_t i = 0; i < records_.size(); ++i) {
+    int request_id = records_[i].report[REQUEST_ID_OFFSET];
+    if (request_id < REQUEST_ID_MIN || request_id > REQUEST_ID_MAX) {
+      continue;
+    }
+    if (records_[i].direction == CAPTURE_OUT) {
+      last_request[request_id] = i;
+    } else if (last_request[request_id] >= 0) {
+      answers_[last_request[request_id]] = i;
+      last_request[request_id] = -1;
+    }
+  }
+  return 0;
+}
+
+void CaptureReplayer::record(int direction,
+                             const unsigned char report[PACKET_INT_LEN]) {
+  if (next_sink_ != NULL) {
+    next_sink_->record(direction, report);
+  }
+  if (direction != CAPTURE_IN) {
+    return;
+  }
+  Clock::time_point now = Clock::now();
+  std::unique_lock<std::mutex> lock(mutex_);
+  int request_id = report[REQUEST_ID_OFFSET];
+  if (request_id == REQUEST_ID_EVENT) {
+    ++stats_.num_events;
+    return;
+  }
+  if (request_id < REQUEST_ID_MIN || request_id > REQUEST_ID_MAX ||
+      pending_[request_id].expected < 0) {
+    return;
+  }
+  PendingAnswer *pending = &pending_[request_id];
+  if (memcmp(records_[pending->expected].report,
+             report, PACKET_INT_LEN) == 0) {
+    ++stats_.num_matched;
+  } else {
+    ++stats_.num_mismatched;
+  }
+  double answer_ms = elapsed_ms(pending->send_time, now);
+  answer_ms_sum_ += answer_ms;
+  stats_.max_answer_ms = std::max(stats_.max_answer_ms, answer_ms);
+  pending->expected = -1;
+  if (--num_pending_ == 0) {
+    cond_.notify_all();
+  }
+}
+
+int CaptureReplayer::run(double speed, ReplayStats *r_stats) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    memset(&stats_, 0, sizeof(stats_));
+    answer_ms_sum_ = 0.0;
+  }
+  int64_t first_time_ns = records_.empty() ? 0 : records_[0].time_ns;
+  int64_t last_time_ns = records_.empty() ? 0 : records_.back().time_ns;
+  Clock::time_point start_time = Clock::now();
+  int r = 0;
+  for (size_t i = 0; i < records_.size() && r == 0; ++i) {
+    const CaptureRecord &record = records_[i];
+    if (record.direction != CAPTURE_OUT) {
+      continue;
+    }
+    Clock::time_point send_time = start_time;
+    if (speed > 0.0) {
+      send_time += std::chrono::nanoseconds(
+          (int64_t)((record.time_ns - first_time_ns) / speed));
+      std::this_thread::sleep_until(send_time);
+    }
+    Clock::time_point now = Clock::now();
+    int request_id = record.report[REQUEST_ID_OFFSET];
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (speed > 0.0) {
+        stats_.max_lag_ms = std::max(stats_.max_lag_ms,
+                                     elapsed_ms(send_time, now));
+      }
+      ++stats_.num_reports;
+      if (answers_[i] >= 0) {
+        ++stats_.num_answers;
+        /* Request ID which is reused before its answer came. */
+        if (pending_[request_id].expected >= 0) {
+          ++stats_.num_missing;
+          --num_pending_;
+        }
+        pending_[request_id].expected = answers_[i];
+        pending_[request_id].send_time = now;
+        ++num_pending_;
+      }
+    }
+    r = device_submit_raw(record.report);
+  }
+  /* Events and late answers which came at the end of the capture. */
+  if (r == 0 && speed > 0.0) {
+    std::this_thread::sleep_until(
+        start_time + std::chrono::nanoseconds(
+            (int64_t)((last_time_ns - first_time_ns) / speed)));
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait_for(lock,
+                 std::chrono::milliseconds(REPLAY_ANSWER_TIMEOUT_MS),
+                 [this] { return num_pending_ == 0; });
+  for (int i = 0; i <= REQUEST_ID_MAX; ++i) {
+    if (pending_[i].expected >= 0) {
+      ++stats_.num_missing;
+      pending_[i].expected = -1;
+    }
+  }
+  num_pending_ = 0;
+  stats_.recorded_ms = (last_time_ns - first_time_ns) / 1e6;
+  stats_.replay_ms = elapsed_ms(start_time, Clock::now());
+  int num_received = stats_.num_matched + stats_.num_mismatched;
+  stats_.avg_answer_ms = num_received != 0 ? answer_ms_sum_ / num_received
+                                           : 0.0;
+  *r_stats = stats_;
+  return r;
+}
@@ -0,0 +1,203 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "transport.h"
+
+/* Recording of the HID traffic, to reproduce timing issues seen with the
+ * real boards and to measure host changes on real traffic.
+ *
+ * Capture file starts with CAPTURE_MAGIC including its terminator, and 4
+ * bytes of CAPTURE_VERSION. Then there's a record for every report: 8 bytes
+ * of the time in nanoseconds since the start of the capture, direction,
+ * request ID, number N of the report bytes before the request ID which are
+ * kept and those N bytes. Trailing zeros are dropped, most commands only
+ * use a few bytes. Numbers are little-endian.
+ */
+
+#define CAPTURE_MAGIC "PCRCAPT"
+#define CAPTURE_VERSION 1
+
+enum {
+  CAPTURE_OUT = 0,
+  CAPTURE_IN = 1,
+};
+
+struct CaptureRecord {
+  /* Monotonic, since the start of the capture. */
+  int64_t time_ns;
+  int direction;
+  unsigned char report[PACKET_INT_LEN];
+};
+
+/* Receives every report which goes through RecordingTransport. Called
+ * from the transport's threads.
+ */
+class CaptureSink {
+ public:
+  virtual ~CaptureSink() {}
+
+  virtual void record(int direction,
+                      const unsigned char report[PACKET_INT_LEN]) = 0;
+};
+
+class CaptureWriter : public CaptureSink {
+ public:
+  CaptureWriter();
+  ~CaptureWriter();
+
+  /* Returns 0 or negative errno. */
+  int open(const char *path);
+  void close(void);
+  bool is_open(void) const;
+
+  void record(int direction, const unsigned char report[PACKET_INT_LEN]);
+
+ protected:
+  std::mutex mutex_;
+  FILE *file_;
+  std::chrono::steady_clock::time_point start_time_;
+};
+
+class CaptureReader {
+ public:
+  CaptureReader();
+  ~CaptureReader();
+
+  /* Returns 0 or negative errno, -EPROTO when it's not a capture. */
+  int open(const char *path);
+  void close(void);
+
+  /* Returns 1 and the record, 0 at the end of the file or negative
+   * errno.
+   */
+  int read(CaptureRecord *r_record);
+
+ protected:
+  FILE *file_;
+};
+
+/* Passes everything to the wrapped transport and shows every OUT report
+ * as it's submitted, and every IN report as it's delivered, to the sink.
+ */
+class RecordingTransport : public Transport {
+ public:
+  /* Takes ownership of the transport, the sink has to outlive it. */
+  RecordingTransport(Transport *transport, CaptureSink *sink);
+  ~RecordingTransport();
+
+  void set_report_callback(ReportCallback callback, void *user_data);
+  void set_device_gone_callback(DeviceGoneCallback callback, void *user_data);
+
+  int start(void);
+  void stop(void);
+
+  int submit_report(const unsigned char report[PACKET_INT_LEN],
+                    int timeout_ms);
+  int send_report(const unsigned char report[PACKET_INT_LEN], int timeout_ms);
+
+  bool is_device_gone(void);
+
+ protected:
+  static void report_cb(const unsigned char report[PACKET_INT_LEN],
+                        void *user_data);
+
+  Transport *transport_;
+  CaptureSink *sink_;
+  ReportCallback report_callback_;
+  void *report_callback_data_;
+};
+
+struct ReplayStats {
+  int num_reports;
+  /* Answers which came during the capture, and how they compare to the
+   * ones which came now. Answers are only matched by the request ID, so
+   * state which changed since the capture shows up as a mismatch.
+   */
+  int num_answers;
+  int num_matched;
+  int num_mismatched;
+  int num_missing;
+  int num_events;
+  double recorded_ms;
+  double replay_ms;
+  /* How much later than scheduled a report was sent, zero when the
+   * pacing is not kept.
+   */
+  double max_lag_ms;
+  double avg_answer_ms;
+  double max_answer_ms;
+};
+
+/* Sends OUT reports of a capture to the opened device exactly as they
+ * were recorded, request IDs included, see device_submit_raw(). It has to
+ * be the capture sink of the device to see the answers, see
+ * device_set_capture(), and nothing else should talk to the device while
+ * it runs.
+ */
+class CaptureReplayer : public CaptureSink {
+ public:
+  /* Reports are passed to the next sink too when it's not NULL. */
+  CaptureReplayer(CaptureSink *next_sink);
+
+  /* Returns 0 or negative errno, see CaptureReader. */
+  int load(const char *path);
+
+  /* Keep the recorded pacing, speed times faster. Zero speed sends the
+   * reports back to back. Returns 0 or a libusb error.
+   */
+  int run(double speed, ReplayStats *r_stats);
+
+  void record(int direction, const unsigned char report[PACKET_INT_LEN]);
+
+ protected:
+  typedef std::chrono::steady_clock Clock;
+
+  struct PendingAnswer {
+    /* Index of the recorded answer, -1 when nothing is expected. */
+    int expected;
+    Clock::time_point send_time;
+  };
+
+  CaptureSink *next_sink_;
+  std::vector<CaptureRecord> records_;
+  /* Recorded answer of every OUT record, -1 when there was none. */
+  std::vector<int> answers_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  PendingAnswer pending_[REQUEST_ID_MAX + 1];
+  int num_pending_;
+  ReplayStats stats_;
+  double answer_ms_sum_;
+};
+
+#endif  /* __CAPTURE_H__ */
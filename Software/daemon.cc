@@ -0,0 +1,796 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "daemon.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <libusb.h>
+
+#include "device.h"
+#include "frame.h"
+#include "metrics.h"
+#include "status_cache.h"
+
+namespace {
+
+const char *DEFAULT_SOCKET_PATH = "/tmp/pcremotecontrol.sock";
+const int MAX_CLIENTS = 64;
+/* How long to wait for the unplugged device before serving the clients,
+ * their requests fail until the device is back.
+ */
+const int RECONNECT_INTERVAL_MS = 100;
+/* Events keep the published status up to date, it's only read from the
+ * device once in a while in case some change was missed, and after the
+ * configuration was changed.
+ */
+const int STATUS_REFRESH_INTERVAL_MS = 5000;
+
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_stop_signal(int /*signum*/) {
+  stop_requested = 1;
+}
+
+int fill_socket_address(const char *socket_path, sockaddr_un *address) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address->sun_path)) {
+    return -ENAMETOOLONG;
+  }
+  strcpy(address->sun_path, socket_path);
+  return 0;
+}
+
+int create_listen_socket(const char *socket_path) {
+  sockaddr_un address;
+  int r = fill_socket_address(socket_path, &address);
+  if (r < 0) {
+    return r;
+  }
+  /* Socket might be left behind by a daemon which didn't exit cleanly,
+   * only remove it if nobody is listening on it.
+   */
+  int fd = daemon_client_connect(socket_path);
+  if (fd >= 0) {
+    close(fd);
+    return -EADDRINUSE;
+  }
+  unlink(socket_path);
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -errno;
+  }
+  if (bind(fd, (sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(fd, MAX_CLIENTS) < 0) {
+    r = -errno;
+    close(fd);
+    return r;
+  }
+  return fd;
+}
+
+/* Request from the client which waits for the answer from the device,
+ * requests of the daemon itself have no client descriptor.
+ */
+struct PendingRequest {
+  int fd;
+  int request;
+  unsigned char report[PACKET_INT_LEN];
+  /* When the request is sent again if its answer didn't come. */
+  std::chrono::steady_clock::time_point retry_deadline;
+};
+
+/* Clients which enabled event reports. */
+std::set<int> event_subscribers;
+
+/* Status shared with the local readers and exported as metrics. */
+StatusCacheWriter status_cache;
+CachedStatus cached_status;
+bool tracking_status = false;
+std::chrono::steady_clock::time_point next_status_refresh;
+DaemonCounters daemon_counters;
+
+/* Status refresh in flight, it's requests are pending along with the ones
+ * of the clients.
+ */
+int num_refresh_requests = 0;
+bool refresh_failed = false;
+SnapshotAnswer refresh_snapshot;
+/* Firmware answered the snapshot, a lost answer is no reason to retrieve
+ * the status field by field then.
+ */
+bool snapshot_supported = false;
+
+bool events_wanted(void) {
+  return tracking_status || !event_subscribers.empty();
+}
+
+void publish_status(void) {
+  if (status_cache.is_open()) {
+    status_cache.publish(&cached_status);
+  } else {
+    ++cached_status.num_updates;
+    cached_status.update_time_ns = status_cache_now_ns();
+  }
+}
+
+/* Submit request with an answer, which is then waited for by the poll
+ * loop. fd is the client to reply to, -1 for the daemon's own requests.
+ */
+int submit_pending_request(int fd,
+                           const unsigned char report[PACKET_INT_LEN],
+                           std::vector<PendingRequest> *pending) {
+  PendingRequest pending_request;
+  memcpy(pending_request.report, report, PACKET_INT_LEN);
+  int request = device_submit_request(pending_request.report);
+  if (request < 0) {
+    return request;
+  }
+  pending_request.fd = fd;
+  pending_request.request = request;
+  pending_request.retry_deadline =
+      std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(device_request_timeout(request));
+  pending->push_back(pending_request);
+  return 0;
+}
+
+void submit_refresh_request(int command,
+                            int pc,
+                            std::vector<PendingRequest> *pending) {
+  unsigned char report[PACKET_INT_LEN] = {0};
+  report[0] = command;
+  if (command == COMMAND_CFG_GET_PC_NAME) {
+    GetNameRequest request = {pc};
+    encode_request(request, report);
+  }
+  if (submit_pending_request(-1, report, pending) < 0) {
+    refresh_failed = true;
+  } else {
+    ++num_refresh_requests;
+  }
+}
+
+/* Read the status from the device without waiting for it, the answers
+ * are handled by handle_refresh_answer().
+ */
+void refresh_status(std::vector<PendingRequest> *pending) {
+  if (!tracking_status || num_refresh_requests != 0) {
+    return;
+  }
+  next_status_refresh = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(STATUS_REFRESH_INTERVAL_MS);
+  refresh_failed = false;
+  memset(&refresh_snapshot, 0, sizeof(refresh_snapshot));
+  submit_refresh_request(COMMAND_GET_SNAPSHOT, 0, pending);
+}
+
+void handle_refresh_answer(const PendingRequest &pending_request,
+                           int result,
+                           const unsigned char answer[PACKET_INT_LEN],
+                           std::vector<PendingRequest> *pending) {
+  --num_refresh_requests;
+  int command = pending_request.report[0];
+  if (command == COMMAND_GET_SNAPSHOT && result == LIBUSB_ERROR_TIMEOUT &&
+      !snapshot_supported) {
+    /* Firmware doesn't know the snapshot, retrieve status field by
+     * field.
+     */
+    submit_refresh_request(COMMAND_CFG_GET_IP, 0, pending);
+    submit_refresh_request(COMMAND_CFG_GET_MAC, 0, pending);
+    submit_refresh_request(COMMAND_GET_STATUS, 0, pending);
+  } else if (result < 0) {
+    refresh_failed = true;
+  } else if (command == COMMAND_GET_SNAPSHOT) {
+    snapshot_supported = true;
+    decode_answer(answer, &refresh_snapshot);
+  } else if (command == COMMAND_CFG_GET_IP) {
+    IpAnswer ip;
+    decode_answer(answer, &ip);
+    memcpy(refresh_snapshot.ip, ip.ip, 4);
+  } else if (command == COMMAND_CFG_GET_MAC) {
+    MacAnswer mac;
+    decode_answer(answer, &mac);
+    memcpy(refresh_snapshot.mac, mac.mac, 6);
+  } else if (command == COMMAND_GET_STATUS) {
+    StatusAnswer status;
+    decode_answer(answer, &status);
+    refresh_snapshot.num_pcs = status.num_pcs;
+    for (int i = 0; i < status.num_pcs; ++i) {
+      refresh_snapshot.pcs[i].status = status.status[i];
+      submit_refresh_request(COMMAND_CFG_GET_PC_NAME, i, pending);
+    }
+  } else if (command == COMMAND_CFG_GET_PC_NAME) {
+    NameAnswer name;
+    decode_answer(answer, &name);
+    int pc = pending_request.report[1];
+    if (pc < NUM_PCS) {
+      memcpy(refresh_snapshot.pcs[pc].name, name.name, sizeof(name.name));
+    }
+  }
+  if (num_refresh_requests == 0 && !refresh_failed) {
+    cached_status.snapshot = refresh_snapshot;
+    cached_status.connected = true;
+    publish_status();
+  }
+}
+
+void publish_connected(bool connected) {
+  if (tracking_status) {
+    cached_status.connected = connected;
+    publish_status();
+  }
+}
+
+/* Answers which clients asked for anyway are used to update the status. */
+void update_status_from_answer(int command,
+                               const unsigned char answer[PACKET_INT_LEN]) {
+  if (!tracking_status) {
+    return;
+  }
+  SnapshotAnswer *snapshot = &cached_status.snapshot;
+  if (command == COMMAND_GET_STATUS) {
+    StatusAnswer status;
+    decode_answer(answer, &status);
+    snapshot->num_pcs = status.num_pcs;
+    for (int i = 0; i < status.num_pcs; ++i) {
+      snapshot->pcs[i].status = status.status[i];
+    }
+  } else if (command == COMMAND_GET_SNAPSHOT) {
+    decode_answer(answer, snapshot);
+  } else if (command == COMMAND_FRAME) {
+    /* Might have changed the configuration. */
+    next_status_refresh = std::chrono::steady_clock::now();
+    return;
+  } else {
+    return;
+  }
+  publish_status();
+}
+
+void update_status_from_event(const unsigned char event[PACKET_INT_LEN]) {
+  if (!tracking_status || event[0] != EVENT_STATUS_CHANGED) {
+    return;
+  }
+  SnapshotAnswer *snapshot = &cached_status.snapshot;
+  int num_pcs = std::min((int)event[EVENT_NUM_PCS_OFFSET], NUM_PCS);
+  for (int i = 0; i < num_pcs; ++i) {
+    snapshot->pcs[i].status = event[EVENT_STATUS_OFFSET + i];
+  }
+  publish_status();
+}
+
+/* Milliseconds until the status is to be refreshed, -1 to wait forever. */
+int status_refresh_timeout(void) {
+  if (!tracking_status) {
+    return -1;
+  }
+  std::chrono::steady_clock::duration left =
+      next_status_refresh - std::chrono::steady_clock::now();
+  return std::max(
+      (int)std::chrono::ceil<std::chrono::milliseconds>(left).count(), 0);
+}
+
+void count_press(int pc) {
+  if (pc < NUM_PCS) {
+    ++daemon_counters.num_presses[pc];
+  }
+}
+
+/* Count presses which the firmware executed from the frame. */
+void count_frame_presses(const unsigned char report[PACKET_INT_LEN],
+                         const unsigned char answer[PACKET_INT_LEN]) {
+  FrameResult results[PACKET_INT_LEN];
+  int num_results = frame_parse_answer(answer, results, PACKET_INT_LEN);
+  int pos = 1;
+  for (int i = 0;
+       i < num_results && pos + FRAME_RECORD_HEADER_SIZE < FRAME_MAX_SIZE;
+       ++i) {
+    if (report[pos] == COMMAND_SWITCH_PRESS &&
+        results[i].status == COMMAND_STATUS_OK) {
+      count_press(report[pos + FRAME_RECORD_HEADER_SIZE]);
+    }
+    pos += FRAME_RECORD_HEADER_SIZE + report[pos + 1];
+  }
+}
+
+/* Client sockets are non-blocking, a client which doesn't read its
+ * replies fails here and is disconnected instead of stalling the daemon.
+ */
+bool send_reply(int fd, const DaemonReply &reply) {
+  return send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) == sizeof(reply);
+}
+
+/* Events are enabled on the device while there's at least one subscriber.
+ * Enabling them again makes the device send the full status, which is what
+ * a new subscriber starts with.
+ */
+int update_event_subscription(int fd, bool enabled) {
+  bool was_enabled = events_wanted();
+  if (enabled) {
+    event_subscribers.insert(fd);
+  } else {
+    event_subscribers.erase(fd);
+  }
+  if (enabled || was_enabled != events_wanted()) {
+    return device_set_events(enabled || events_wanted());
+  }
+  return 0;
+}
+
+/* Read request from the client and send it to the device. Commands with an
+ * answer are only submitted, so requests of all clients are in flight
+ * together. Returns false if the client is to be disconnected.
+ */
+bool handle_client_request(int fd, std::vector<PendingRequest> *pending) {
+  unsigned char buffer[PACKET_INT_LEN] = {0};
+  ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+  if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return true;
+  } else if (len <= 0) {
+    return false;
+  }
+  DaemonReply reply;
+  memset(&reply, 0, sizeof(reply));
+  if (buffer[0] == COMMAND_SET_EVENTS) {
+    reply.result = update_event_subscription(fd, buffer[1] != 0);
+  } else if (command_has_answer(buffer[0])) {
+    reply.result = submit_pending_request(fd, buffer, pending);
+    if (reply.result == 0) {
+      return true;
+    }
+  } else {
+    /* Like the requests, it's not waited for the report to be delivered,
+     * the client gets the result of the submission.
+     */
+    reply.result = device_submit_buffer(buffer);
+    if (buffer[0] == COMMAND_SWITCH_PRESS && reply.result == 0) {
+      count_press(buffer[1]);
+    }
+    if (buffer[0] != COMMAND_TEST && buffer[0] != COMMAND_SWITCH_PRESS) {
+      /* Configuration changed. */
+      next_status_refresh = std::chrono::steady_clock::now();
+    }
+  }
+  return send_reply(fd, reply);
+}
+
+/* Reply to the requests whose answers came and send the late ones again,
+ * so no client waits for the answers to the others. Clients which can't
+ * take their reply are stored in closed_fds to be disconnected.
+ */
+void reply_to_pending_requests(std::vector<PendingRequest> *pending,
+                               std::vector<int> *closed_fds) {
+  std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  for (size_t i = 0; i < pending->size();) {
+    PendingRequest *pending_request = &(*pending)[i];
+    DaemonReply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.result = device_poll_answer(pending_request->request, reply.answer);
+    if (reply.result == LIBUSB_ERROR_TIMEOUT) {
+      if (pending_request->retry_deadline > now) {
+        ++i;
+        continue;
+      }
+      reply.result = device_retry_request(pending_request->request);
+      if (reply.result == 0) {
+        pending_request->retry_deadline =
+            now + std::chrono::milliseconds(
+                      device_request_timeout(pending_request->request));
+        ++i;
+        continue;
+      }
+      /* Request is ended already. */
+    }
+    PendingRequest answered = *pending_request;
+    pending->erase(pending->begin() + i);
+    if (answered.fd < 0) {
+      handle_refresh_answer(answered, reply.result, reply.answer, pending);
+      continue;
+    }
+    if (reply.result == 0) {
+      update_status_from_answer(answered.report[0], reply.answer);
+      if (answered.report[0] == COMMAND_FRAME) {
+        count_frame_presses(answered.report, reply.answer);
+      }
+    }
+    if (!send_reply(answered.fd, reply)) {
+      closed_fds->push_back(answered.fd);
+    }
+  }
+}
+
+/* Milliseconds until the first late request is to be sent again, -1 when
+ * there's none.
+ */
+int pending_requests_timeout(const std::vector<PendingRequest> &pending) {
+  if (pending.empty()) {
+    return -1;
+  }
+  std::chrono::steady_clock::time_point deadline = pending[0].retry_deadline;
+  for (size_t i = 1; i < pending.size(); ++i) {
+    deadline = std::min(deadline, pending[i].retry_deadline);
+  }
+  std::chrono::steady_clock::duration left =
+      deadline - std::chrono::steady_clock::now();
+  return std::max(
+      (int)std::chrono::ceil<std::chrono::milliseconds>(left).count(), 0);
+}
+
+/* Milliseconds until the first scrape is dropped, -1 when there's none. */
+int scrapes_timeout(const std::map<int, MetricsScrape> &scrapes) {
+  if (scrapes.empty()) {
+    return -1;
+  }
+  std::chrono::steady_clock::time_point deadline =
+      scrapes.begin()->second.deadline;
+  for (std::map<int, MetricsScrape>::const_iterator it = scrapes.begin();
+       it != scrapes.end();
+       ++it) {
+    deadline = std::min(deadline, it->second.deadline);
+  }
+  std::chrono::steady_clock::duration left =
+      deadline - std::chrono::steady_clock::now();
+  return std::max(
+      (int)std::chrono::ceil<std::chrono::milliseconds>(left).count(), 0);
+}
+
+/* Shorter of the poll() timeouts, -1 is no timeout. */
+int min_timeout(int timeout_ms, int other_timeout_ms) {
+  if (timeout_ms < 0) {
+    return other_timeout_ms;
+  } else if (other_timeout_ms < 0) {
+    return timeout_ms;
+  }
+  return std::min(timeout_ms, other_timeout_ms);
+}
+
+std::string format_metrics(void * /*user_data*/) {
+  return metrics_format(device_opened_id(), cached_status, daemon_counters);
+}
+
+/* Forward all queued events to the subscribers. Subscribers which don't
+ * keep up with the events are stored in slow_fds to be disconnected.
+ */
+void forward_events(std::vector<int> *slow_fds) {
+  DaemonReply reply;
+  memset(&reply, 0, sizeof(reply));
+  while (device_wait_event(reply.answer, 0) == 0) {
+    update_status_from_event(reply.answer);
+    for (std::set<int>::iterator it = event_subscribers.begin();
+         it != event_subscribers.end();
+         ++it) {
+      if (std::find(slow_fds->begin(), slow_fds->end(), *it) ==
+              slow_fds->end() &&
+          !send_reply(*it, reply)) {
+        slow_fds->push_back(*it);
+      }
+    }
+  }
+}
+
+}  /* namespace */
+
+const char *daemon_socket_path(void) {
+  const char *socket_path = getenv("PCREMOTECONTROL_SOCKET");
+  if (socket_path != NULL && socket_path[0] != '\0') {
+    return socket_path;
+  }
+  return DEFAULT_SOCKET_PATH;
+}
+
+int daemon_run(const char *socket_path,
+               const char *metrics_address,
+               Device * /*board*/) {
+  int listen_fd = create_listen_socket(socket_path);
+  if (listen_fd < 0) {
+    fprintf(stderr, "Failed to listen on %s: %s\n",
+            socket_path, strerror(-listen_fd));
+    return listen_fd;
+  }
+  int metrics_fd = -1;
+  if (metrics_address != NULL) {
+    metrics_fd = metrics_listen(metrics_address);
+    if (metrics_fd < 0) {
+      fprintf(stderr, "Failed to serve metrics on %s: %s\n",
+              metrics_address, strerror(-metrics_fd));
+      close(listen_fd);
+      unlink(socket_path);
+      return metrics_fd;
+    }
+  }
+
+  memset(&cached_status, 0, sizeof(cached_status));
+  memset(&daemon_counters, 0, sizeof(daemon_counters));
+  int r = status_cache.open(status_cache_path());
+  if (r < 0) {
+    /* Clients are served either way. */
+    fprintf(stderr, "Failed to publish status to %s: %s\n",
+            status_cache_path(), strerror(-r));
+  }
+  tracking_status = status_cache.is_open() || metrics_fd >= 0;
+  /* Requests of the daemon are answered in the loop too. */
+  std::vector<PendingRequest> pending;
+  if (tracking_status) {
+    device_set_events(true);
+    refresh_status(&pending);
+  }
+
+  /* Don't use SA_RESTART, so poll() is interrupted by the signal. */
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_stop_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  printf("Listening on %s\n", socket_path);
+  if (metrics_fd >= 0) {
+    printf("Serving metrics on %s\n", metrics_address);
+  }
+
+  /* First descriptor is always the listening socket, second one is for
+   * the device events, third one for the metrics scrapes, fourth one for
+   * the answers, the rest are clients and scrape connections.
+   * Requests of all clients are in flight together, every client gets its
+   * reply as soon as the answer to its request comes. Answers are matched
+   * to the requests by their IDs.
+   */
+  const size_t FIRST_CLIENT = 4;
+  std::vector<pollfd> fds;
+  fds.push_back((pollfd){listen_fd, POLLIN, 0});
+  fds.push_back((pollfd){device_event_fd(), POLLIN, 0});
+  /* Negative descriptor is ignored by poll(). */
+  fds.push_back((pollfd){metrics_fd, POLLIN, 0});
+  fds.push_back((pollfd){device_answer_fd(), POLLIN, 0});
+  std::map<int, MetricsScrape> scrapes;
+  r = 0;
+  bool connected = true;
+  while (!stop_requested) {
+    if (connected && !device_is_connected()) {
+      printf("Device is gone, waiting for it to come back\n");
+      connected = false;
+      publish_connected(false);
+    }
+    if (!connected) {
+      double latency_ms;
+      if (device_reconnect(RECONNECT_INTERVAL_MS, &latency_ms) == 0) {
+        printf("Device reconnected in %.1f ms\n", latency_ms);
+        connected = true;
+        ++daemon_counters.num_reconnects;
+        refresh_status(&pending);
+      }
+    }
+    if (connected && status_refresh_timeout() == 0) {
+      refresh_status(&pending);
+    }
+    /* Event descriptor stays readable while the device is gone. */
+    fds[1].events = connected ? POLLIN : 0;
+    int timeout_ms = connected ? status_refresh_timeout() : 0;
+    timeout_ms = min_timeout(timeout_ms, pending_requests_timeout(pending));
+    timeout_ms = min_timeout(timeout_ms, scrapes_timeout(scrapes));
+    if (poll(&fds[0], fds.size(), timeout_ms) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      r = -errno;
+      fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+      break;
+    }
+    std::vector<int> closed_fds;
+    for (size_t i = FIRST_CLIENT; i < fds.size(); ++i) {
+      if (fds[i].revents == 0) {
+        continue;
+      }
+      std::map<int, MetricsScrape>::iterator scrape = scrapes.find(fds[i].fd);
+      if (scrape != scrapes.end()) {
+        if (metrics_scrape_handle(&scrape->second, format_metrics, NULL)) {
+          closed_fds.push_back(fds[i].fd);
+        } else {
+          fds[i].events = metrics_scrape_events(scrape->second);
+        }
+        continue;
+      }
+      if ((fds[i].revents & POLLIN) == 0 ||
+          !handle_client_request(fds[i].fd, &pending)) {
+        closed_fds.push_back(fds[i].fd);
+      }
+    }
+    if (fds[3].revents & POLLIN) {
+      uint64_t value;
+      if (read(fds[3].fd, &value, sizeof(value)) < 0) {
+        /* Counter is reset already. */
+      }
+    }
+    reply_to_pending_requests(&pending, &closed_fds);
+    if (fds[1].revents & POLLIN) {
+      forward_events(&closed_fds);
+    }
+    std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    for (std::map<int, MetricsScrape>::iterator it = scrapes.begin();
+         it != scrapes.end();
+         ++it) {
+      if (it->second.deadline <= now &&
+          std::find(closed_fds.begin(), closed_fds.end(), it->first) ==
+              closed_fds.end()) {
+        closed_fds.push_back(it->first);
+      }
+    }
+    for (size_t i = fds.size() - 1; i >= FIRST_CLIENT; --i) {
+      int fd = fds[i].fd;
+      if (std::find(closed_fds.begin(), closed_fds.end(), fd) ==
+          closed_fds.end()) {
+        continue;
+      }
+      if (event_subscribers.count(fd)) {
+        update_event_subscription(fd, false);
+      }
+      for (size_t j = pending.size(); j-- > 0;) {
+        if (pending[j].fd == fd) {
+          device_cancel_request(pending[j].request);
+          pending.erase(pending.begin() + j);
+        }
+      }
+      scrapes.erase(fd);
+      close(fd);
+      fds.erase(fds.begin() + i);
+    }
+    if (fds[2].revents & POLLIN) {
+      MetricsScrape scrape;
+      if (metrics_accept(metrics_fd, &scrape) == 0) {
+        scrapes[scrape.fd] = scrape;
+        fds.push_back((pollfd){scrape.fd, metrics_scrape_events(scrape), 0});
+      }
+    }
+    if (fds[0].revents & POLLIN) {
+      int client_fd = accept4(listen_fd,
+                              NULL,
+                              NULL,
+                              SOCK_CLOEXEC | SOCK_NONBLOCK);
+      if (client_fd >= 0) {
+        fds.push_back((pollfd){client_fd, POLLIN, 0});
+      }
+    }
+  }
+
+  for (size_t i = 0; i < pending.size(); ++i) {
+    device_cancel_request(pending[i].request);
+  }
+  if (events_wanted()) {
+    device_set_events(false);
+  }
+  if (status_cache.is_open()) {
+    publish_connected(false);
+    status_cache.close();
+  }
+  tracking_status = false;
+  if (metrics_fd >= 0) {
+    close(metrics_fd);
+  }
+  close(listen_fd);
+  for (size_t i = FIRST_CLIENT; i < fds.size(); ++i) {
+    close(fds[i].fd);
+  }
+  unlink(socket_path);
+  return r;
+}
+
+int daemon_client_connect(const char *socket_path) {
+  sockaddr_un address;
+  int r = fill_socket_address(socket_path, &address);
+  if (r < 0) {
+    return r;
+  }
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -errno;
+  }
+  if (connect(fd, (sockaddr *)&address, sizeof(address)) < 0) {
+    r = -errno;
+    close(fd);
+    return r;
+  }
+  return fd;
+}
+
+namespace {
+
+/* Receive reply or event from the daemon, events are queued. */
+int daemon_client_receive(int fd,
+                          DaemonReply *reply,
+                          DaemonEventQueue *events,
+                          bool *r_is_event) {
+  ssize_t len = recv(fd, reply, sizeof(*reply), 0);
+  if (len < 0) {
+    return -errno;
+  }
+  if (len != sizeof(*reply)) {
+    return -EPROTO;
+  }
+  *r_is_event = reply->answer[REQUEST_ID_OFFSET] == REQUEST_ID_EVENT;
+  if (*r_is_event) {
+    events->push_back(std::vector<unsigned char>(
+        reply->answer, reply->answer + PACKET_INT_LEN));
+  }
+  return 0;
+}
+
+}  /* namespace */
+
+int daemon_client_transact(int fd,
+                           const unsigned char buffer[PACKET_INT_LEN],
+                           DaemonReply *reply,
+                           DaemonEventQueue *events) {
+  if (send(fd, buffer, PACKET_INT_LEN, MSG_NOSIGNAL) != PACKET_INT_LEN) {
+    return -errno;
+  }
+  bool is_event = true;
+  while (is_event) {
+    int r = daemon_client_receive(fd, reply, events, &is_event);
+    if (r < 0) {
+      return r;
+    }
+  }
+  return 0;
+}
+
+int daemon_client_wait_event(int fd,
+                             DaemonEventQueue *events,
+                             unsigned char event[PACKET_INT_LEN],
+                             int timeout_ms) {
+  while (events->empty()) {
+    pollfd pfd = {fd, POLLIN, 0};
+    int r = poll(&pfd, 1, timeout_ms);
+    if (r < 0 && errno != EINTR) {
+      return -errno;
+    }
+    if (r <= 0) {
+      /* Interrupted by a signal, the caller checks whether to stop. */
+      return -ETIMEDOUT;
+    }
+    DaemonReply reply;
+    bool is_event;
+    r = daemon_client_receive(fd, &reply, events, &is_event);
+    if (r < 0) {
+      return r;
+    }
+  }
+  memcpy(event, &events->front()[0], PACKET_INT_LEN);
+  events->pop_front();
+  return 0;
+}
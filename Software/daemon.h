@@ -0,0 +1,71 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include <deque>
+#include <vector>
+
+#include "pcremote.h"
+#include "protocol.h"
+
+/* Reply of the daemon to a single OUT report.
+ *
+ * Clients which enabled events also get unsolicited replies with the event
+ * report as an answer, their REQUEST_ID_OFFSET byte is REQUEST_ID_EVENT.
+ */
+struct DaemonReply {
+  int result;  /* 0 on success, libusb error code otherwise. */
+  unsigned char answer[PACKET_INT_LEN];  /* IN report, if command has one. */
+};
+
+/* Events which came from the daemon while client waited for a reply. */
+typedef std::deque<std::vector<unsigned char> > DaemonEventQueue;
+
+/* Socket path, PCREMOTECONTROL_SOCKET overrides the default one. */
+const char *daemon_socket_path(void);
+
+/* Serve requests from local clients until SIGINT/SIGTERM.
+ * Device is expected to be opened already.
+ *
+ * Status of the board is published to status_cache_path() as well, it's
+ * kept up to date from the status change events and from the answers the
+ * clients get. When metrics_address is not NULL, Prometheus metrics are
+ * served from the cached state at http://<metrics_address>/metrics, see
+ * metrics_listen().
+ */
+int daemon_run(const char *socket_path,
+               const char *metrics_address,
+               Device *board);
+
+/* Returns connected socket or negative value when no daemon is running. */
+int daemon_client_connect(const char *socket_path);
+int daemon_client_transact(int fd,
+                           const unsigned char buffer[PACKET_INT_LEN],
+                           DaemonReply *reply,
+                           DaemonEventQueue *events);
+int daemon_client_wait_event(int fd,
+                             DaemonEventQueue *events,
+                             unsigned char event[PACKET_INT_LEN],
+                             int timeout_ms);
+
+#endif  /* __DAEMON_H__ */
@@ -0,0 +1,985 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "device.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+
+#include <libusb.h>
+
+#include "capture.h"
+#include "daemon.h"
+#include "device_cache.h"
+#include "dispatcher.h"
+#include "emulator.h"
+#include "hidraw.h"
+#include "retry_policy.h"
+#include "usb_async.h"
+
+namespace {
+
+libusb_device_handle *devh = NULL;
+libusb_context *ctx = NULL;
+/* Descriptor of the cached device node which devh wraps, the context
+ * doesn't know about any other device then.
+ */
+int wrapped_fd = -1;
+Transport *transport = NULL;
+RequestDispatcher *dispatcher = NULL;
+/* Every outstanding request, kept so it might be sent again. */
+struct RequestState {
+  unsigned char report[PACKET_INT_LEN];
+  /* When the first and the last attempt were sent. */
+  std::chrono::steady_clock::time_point submit_time;
+  std::chrono::steady_clock::time_point start_time;
+  int num_attempts;
+};
+RequestState request_states[REQUEST_ID_MAX + 1];
+
+/* Answer timeouts of the directly opened device. */
+RetryPolicy retry_policy;
+
+/* Socket of the daemon, when requests are forwarded to it. */
+int daemon_fd = -1;
+/* Daemon sends the report and reads the answer in one go, its replies are
+ * kept around until they're asked for.
+ */
+struct DaemonRequest {
+  int command;
+  DaemonReply reply;
+};
+std::map<int, DaemonRequest> daemon_requests;
+int next_daemon_request = 0;
+DaemonEventQueue daemon_events;
+
+/* Backend asked for by the user, and the one which opened the device. */
+DeviceBackend requested_backend = DEVICE_BACKEND_AUTO;
+DeviceBackend active_backend = DEVICE_BACKEND_AUTO;
+const char *EMULATOR_ID = "emulator";
+
+/* Identifier of the board to open, empty to open the first one found. */
+std::string selected_device;
+/* Identifier of the board which was opened. */
+std::string opened_device;
+
+/* Open the board where it was found the last time. */
+bool cache_enabled = true;
+
+/* Reports of the transport are shown to it when it's set. */
+CaptureSink *capture_sink = NULL;
+
+/* Request which device_read_answer() waits for. */
+int last_request = -1;
+
+/* State which is restored after the device is plugged back. */
+bool events_enabled = false;
+
+/* Reconnection after the device is unplugged. */
+bool hotplug_registered = false;
+libusb_hotplug_callback_handle hotplug_handle;
+/* Set from the hotplug callback, it's only cleared once the device is
+ * claimed, so the failed attempts are retried.
+ */
+std::atomic<bool> device_arrived(false);
+std::chrono::steady_clock::time_point disconnect_time;
+
+/* Diagnostics are printed unless the application turned them off. */
+bool log_enabled = false;
+
+void log_message(FILE *stream, const char *format, ...) {
+  if (!log_enabled) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  vfprintf(stream, format, args);
+  va_end(args);
+}
+
+void print_read_error(int command, int r) {
+  /* Unsupported optional commands are expected to time out. */
+  if (r == LIBUSB_ERROR_TIMEOUT && command_is_optional(command)) {
+    return;
+  }
+  log_message(stderr, "Interrupt read error %s\n", libusb_error_name(r));
+}
+
+void dispatch_report_cb(const unsigned char report[PACKET_INT_LEN],
+                        void * /*user_data*/) {
+  dispatcher->dispatch_report(report);
+}
+
+void device_gone_cb(void * /*user_data*/) {
+  disconnect_time = std::chrono::steady_clock::now();
+  dispatcher->set_device_gone(true);
+}
+
+int LIBUSB_CALL hotplug_cb(libusb_context * /*ctx*/,
+                           libusb_device * /*device*/,
+                           libusb_hotplug_event /*event*/,
+                           void * /*user_data*/) {
+  device_arrived = true;
+  /* Keep the callback registered. */
+  return 0;
+}
+
+bool is_board(libusb_device *device, libusb_device_descriptor *desc) {
+  return libusb_get_device_descriptor(device, desc) == 0 &&
+         desc->idVendor == VENDOR_ID &&
+         desc->idProduct == PRODUCT_ID;
+}
+
+/* Identifier of the board, see device_list(). Serial number is read with
+ * the handle when it's not NULL.
+ */
+std::string read_board_id(libusb_device *device,
+                          const libusb_device_descriptor &desc,
+                          libusb_device_handle *handle) {
+  char id[64] = {0};
+  if (desc.iSerialNumber != 0 && handle != NULL) {
+    int r = libusb_get_string_descriptor_ascii(handle,
+                                               desc.iSerialNumber,
+                                               (unsigned char *)id,
+                                               sizeof(id) - 1);
+    if (r < 0) {
+      id[0] = '\0';
+    }
+  }
+  if (id[0] == '\0') {
+    uint8_t ports[7];
+    int num_ports = libusb_get_port_numbers(device, ports, sizeof(ports));
+    int len = snprintf(id, sizeof(id), "%d", libusb_get_bus_number(device));
+    for (int i = 0; i < num_ports; ++i) {
+      len += snprintf(id + len, sizeof(id) - len,
+                      i == 0 ? "-%d" : ".%d", ports[i]);
+    }
+  }
+  return id;
+}
+
+/* Board is opened to read its serial number, the handle is stored in
+ * r_devh when it's not NULL.
+ */
+std::string get_board_id(libusb_device *device,
+                         const libusb_device_descriptor &desc,
+                         libusb_device_handle **r_devh) {
+  libusb_device_handle *handle = NULL;
+  if (desc.iSerialNumber != 0 && libusb_open(device, &handle) < 0) {
+    handle = NULL;
+  }
+  std::string id = read_board_id(device, desc, handle);
+  if (r_devh != NULL) {
+    *r_devh = handle;
+  } else if (handle != NULL) {
+    libusb_close(handle);
+  }
+  return id;
+}
+
+int find_lvr_hidusb(void) {
+  if (selected_device.empty()) {
+    devh = libusb_open_device_with_vid_pid(ctx, VENDOR_ID, PRODUCT_ID);
+    return devh ? 0 : -EIO;
+  }
+  libusb_device **list;
+  ssize_t num_devices = libusb_get_device_list(ctx, &list);
+  if (num_devices < 0) {
+    return num_devices;
+  }
+  for (ssize_t i = 0; i < num_devices && devh == NULL; ++i) {
+    libusb_device_descriptor desc;
+    if (!is_board(list[i], &desc)) {
+      continue;
+    }
+    libusb_device_handle *handle;
+    if (get_board_id(list[i], desc, &handle) != selected_device) {
+      if (handle != NULL) {
+        libusb_close(handle);
+      }
+      continue;
+    }
+    if (handle == NULL && libusb_open(list[i], &handle) < 0) {
+      break;
+    }
+    devh = handle;
+  }
+  libusb_free_device_list(list, 1);
+  return devh ? 0 : -EIO;
+}
+
+/* Take ownership of the transport and start it. */
+int start_transport(Transport *new_transport) {
+  if (capture_sink != NULL) {
+    new_transport = new RecordingTransport(new_transport, capture_sink);
+  }
+  new_transport->set_report_callback(dispatch_report_cb, NULL);
+  new_transport->set_device_gone_callback(device_gone_cb, NULL);
+  int r = new_transport->start();
+  if (r < 0) {
+    log_message(stderr, "Failed to start transport %s\n",
+                libusb_error_name(r));
+    delete new_transport;
+    return r;
+  }
+  transport = new_transport;
+  return 0;
+}
+
+/* Claim the interface of the opened device and start transfers. */
+int claim_device(void) {
+  libusb_detach_kernel_driver(devh, 0);
+
+#if 0
+  r = libusb_set_configuration(devh, 1);
+  if (r < 0) {
+    log_message(stderr, "libusb_set_configuration error %d\n", r);
+    goto out;
+  }
+
+  log_message(stdout, "Successfully set usb configuration 1\n");
+#endif
+
+  int r = libusb_claim_interface(devh, INTERFACE);
+  if (r < 0) {
+    log_message(stderr, "libusb_claim_interface error %d\n", r);
+    libusb_close(devh);
+    devh = NULL;
+    return r;
+  }
+
+  log_message(stdout, "Successfully claimed interface\n");
+
+  r = start_transport(new UsbAsyncEngine(ctx, devh));
+  if (r < 0) {
+    libusb_release_interface(devh, INTERFACE);
+    libusb_close(devh);
+    devh = NULL;
+    return r;
+  }
+  return 0;
+}
+
+/* Stop transfers and close the handle of the unplugged device. */
+void release_device(void) {
+  if (transport != NULL) {
+    delete transport;
+    transport = NULL;
+  }
+  if (devh != NULL) {
+    libusb_release_interface(devh, INTERFACE);
+    /* libusb_reset_device(devh); */
+    libusb_close(devh);
+    devh = NULL;
+  }
+  /* libusb doesn't close descriptors it was given. */
+  if (wrapped_fd >= 0) {
+    close(wrapped_fd);
+    wrapped_fd = -1;
+  }
+}
+
+/* Create libusb context, without enumerating devices when the cached
+ * device node is going to be wrapped.
+ */
+int init_usb_context(bool discover_devices) {
+  int r;
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x0100010A
+  libusb_init_option option;
+  memset(&option, 0, sizeof(option));
+  option.option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY;
+  r = libusb_init_context(&ctx, &option, discover_devices ? 0 : 1);
+#else
+  /* Older libusb only has a process-wide switch, which would break the
+   * fallback to the full enumeration.
+   */
+  (void)discover_devices;
+  r = libusb_init(&ctx);
+#endif
+  if (r < 0) {
+    log_message(stderr, "Failed to initialise libusb\n");
+    ctx = NULL;
+    return r;
+  }
+
+  /* libusb is as quiet as the rest of the library. */
+  if (log_enabled) {
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000106
+    libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO);
+#else
+    libusb_set_debug(ctx, LIBUSB_LOG_LEVEL_INFO);
+#endif
+  }
+  return 0;
+}
+
+/* Remember the identifier of the opened board and, when the cache is
+ * enabled, its location.
+ */
+void store_usb_device_location(void) {
+  libusb_device *device = libusb_get_device(devh);
+  libusb_device_descriptor desc;
+  if (libusb_get_device_descriptor(device, &desc) < 0) {
+    return;
+  }
+  opened_device = get_board_id(device, desc, NULL);
+  if (!cache_enabled) {
+    return;
+  }
+  char path[32];
+  snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d",
+           libusb_get_bus_number(device),
+           libusb_get_device_address(device));
+  DeviceCacheEntry entry;
+  entry.backend = "libusb";
+  entry.path = path;
+  entry.id = opened_device;
+  device_cache_store(selected_device, entry);
+}
+
+int open_hidraw_device(void) {
+  DeviceCacheEntry entry;
+  int fd = hidraw_open_device(selected_device, &entry.path, &entry.id);
+  if (fd < 0) {
+    return fd;
+  }
+  int r = start_transport(new HidrawTransport(fd));
+  if (r == 0) {
+    opened_device = entry.id;
+  }
+  if (r == 0 && cache_enabled) {
+    entry.backend = "hidraw";
+    device_cache_store(selected_device, entry);
+  }
+  return r;
+}
+
+/* Wrap the cached /dev/bus/usb node, libusb doesn't need to look through
+ * all the devices then. Fails when it's not the board with the identifier
+ * anymore.
+ */
+int open_wrapped_usb_device(const char *path, const std::string &id) {
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+  int r = init_usb_context(false);
+  if (r == 0) {
+    r = libusb_wrap_sys_device(ctx, (intptr_t)fd, &devh);
+  }
+  libusb_device_descriptor desc;
+  if (r == 0 &&
+      (libusb_get_device_descriptor(libusb_get_device(devh), &desc) < 0 ||
+       desc.idVendor != VENDOR_ID ||
+       desc.idProduct != PRODUCT_ID ||
+       read_board_id(libusb_get_device(devh), desc, devh) != id)) {
+    /* Address was given to some other device. */
+    libusb_close(devh);
+    devh = NULL;
+    r = -ENODEV;
+  }
+  if (r == 0) {
+    wrapped_fd = fd;
+    r = claim_device();
+  }
+  if (r < 0) {
+    if (ctx != NULL) {
+      libusb_exit(ctx);
+      ctx = NULL;
+    }
+    wrapped_fd = -1;
+    close(fd);
+  }
+  return r;
+}
+
+/* Open the board where it was found the last time, so nothing has to be
+ * enumerated. Fails when the location is stale.
+ */
+int open_cached_device(void) {
+  DeviceCacheEntry entry;
+  if (!cache_enabled || !device_cache_load(selected_device, &entry)) {
+    return -ENOENT;
+  }
+  if (!selected_device.empty() && entry.id != selected_device) {
+    return -ENOENT;
+  }
+  if (entry.backend == "hidraw" &&
+      requested_backend != DEVICE_BACKEND_LIBUSB) {
+    int fd = hidraw_open_path(entry.path.c_str(), entry.id);
+    if (fd < 0) {
+      return fd;
+    }
+    active_backend = DEVICE_BACKEND_HIDRAW;
+    opened_device = entry.id;
+    return start_transport(new HidrawTransport(fd));
+  }
+  if (entry.backend == "libusb" &&
+      requested_backend != DEVICE_BACKEND_HIDRAW) {
+    active_backend = DEVICE_BACKEND_LIBUSB;
+    opened_device = entry.id;
+    return open_wrapped_usb_device(entry.path.c_str(), entry.id);
+  }
+  return -ENOENT;
+}
+
+/* Open the unplugged device again and start the transport. With libusb it's
+ * only opened once the hotplug callback reported it, or every time when
+ * hotplug is not supported.
+ */
+int reopen_device(void) {
+  if (active_backend == DEVICE_BACKEND_HIDRAW) {
+    return open_hidraw_device();
+  }
+  if (hotplug_registered && !device_arrived) {
+    return -EIO;
+  }
+  int r = find_lvr_hidusb();
+  if (r < 0) {
+    return r;
+  }
+  r = claim_device();
+  if (r == 0) {
+    device_arrived = false;
+  }
+  return r;
+}
+
+int open_usb_device(void) {
+  int r = init_usb_context(true);
+  if (r < 0) {
+    device_close();
+    return r;
+  }
+
+  r = find_lvr_hidusb();
+  if (r < 0) {
+    log_message(stderr, "Could not find/open LVR Generic HID device\n");
+    device_close();
+    return r;
+  }
+
+  log_message(stdout, "Successfully find the LVR Generic HID device\n");
+
+  r = claim_device();
+  if (r < 0) {
+    device_close();
+    return r;
+  }
+  store_usb_device_location();
+  return 0;
+}
+
+/* Sample round trip time of the answered request. */
+void record_answer(int request) {
+  RequestState *state = &request_states[request];
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::milli> rtt = now - state->start_time;
+  std::chrono::duration<double, std::milli> latency = now - state->submit_time;
+  retry_policy.record_answer(state->report[0],
+                             rtt.count(),
+                             latency.count(),
+                             state->num_attempts > 1);
+}
+
+/* Send report of a command which has no answer, optionally waiting for it
+ * to be delivered.
+ */
+int write_report(unsigned char buffer[PACKET_INT_LEN], bool wait) {
+  int r;
+  if (daemon_fd >= 0) {
+    DaemonReply reply;
+    r = daemon_client_transact(daemon_fd, buffer, &reply, &daemon_events);
+    if (r < 0) {
+      log_message(stderr, "Daemon communication error %s\n", strerror(-r));
+      return r;
+    }
+    r = reply.result;
+  } else if (transport == NULL) {
+    /* Device is unplugged and not reconnected yet. */
+    r = LIBUSB_ERROR_NO_DEVICE;
+  } else {
+    buffer[REQUEST_ID_OFFSET] = REQUEST_ID_NONE;
+    r = wait ? transport->send_report(buffer, TIMEOUT)
+             : transport->submit_report(buffer, TIMEOUT);
+  }
+  if (r < 0) {
+    log_message(stderr, "Interrupt write error %s\n", libusb_error_name(r));
+    return r;
+  }
+  return 0;
+}
+
+int set_events(bool enabled, bool wait) {
+  unsigned char buffer[PACKET_INT_LEN] = {0};
+  buffer[0] = COMMAND_SET_EVENTS;
+  buffer[1] = enabled ? 1 : 0;
+  int r = write_report(buffer, wait);
+  if (r == 0) {
+    events_enabled = enabled;
+  }
+  return r;
+}
+
+}  /* namespace */
+
+int device_list(std::vector<std::string> *r_ids) {
+  if (requested_backend == DEVICE_BACKEND_EMULATOR) {
+    r_ids->assign(1, EMULATOR_ID);
+    return 0;
+  }
+  libusb_context *list_ctx;
+  int r = libusb_init(&list_ctx);
+  if (r < 0) {
+    log_message(stderr, "Failed to initialise libusb\n");
+    return r;
+  }
+  libusb_device **list;
+  ssize_t num_devices = libusb_get_device_list(list_ctx, &list);
+  if (num_devices < 0) {
+    libusb_exit(list_ctx);
+    return num_devices;
+  }
+  r_ids->clear();
+  for (ssize_t i = 0; i < num_devices; ++i) {
+    libusb_device_descriptor desc;
+    if (is_board(list[i], &desc)) {
+      r_ids->push_back(get_board_id(list[i], desc, NULL));
+    }
+  }
+  libusb_free_device_list(list, 1);
+  libusb_exit(list_ctx);
+  std::sort(r_ids->begin(), r_ids->end());
+  return 0;
+}
+
+void device_select(const char *id) {
+  selected_device = id != NULL ? id : "";
+}
+
+const std::string &device_selected(void) {
+  return selected_device;
+}
+
+void device_set_log_enabled(bool enabled) {
+  log_enabled = enabled;
+}
+
+void device_set_backend(DeviceBackend backend) {
+  requested_backend = backend;
+}
+
+void device_set_cache_enabled(bool enabled) {
+  cache_enabled = enabled;
+}
+
+void device_set_capture(CaptureSink *sink) {
+  capture_sink = sink;
+}
+
+int device_open(bool allow_daemon) {
+  if (requested_backend == DEVICE_BACKEND_EMULATOR) {
+    active_backend = DEVICE_BACKEND_EMULATOR;
+    opened_device = EMULATOR_ID;
+    dispatcher = new RequestDispatcher();
+    int r = start_transport(new EmulatedTransport());
+    if (r < 0) {
+      device_close();
+    }
+    return r;
+  }
+  /* Daemon serves the first board only. Reports can only be captured
+   * when the board is opened here.
+   */
+  if (allow_daemon && selected_device.empty() && capture_sink == NULL) {
+    daemon_fd = daemon_client_connect(daemon_socket_path());
+    if (daemon_fd >= 0) {
+      return 0;
+    }
+  }
+  dispatcher = new RequestDispatcher();
+  if (open_cached_device() == 0) {
+    return 0;
+  }
+  /* hidraw needs neither libusb nor detaching the kernel driver, libusb is
+   * used when there's no accessible node.
+   */
+  if (requested_backend != DEVICE_BACKEND_LIBUSB) {
+    active_backend = DEVICE_BACKEND_HIDRAW;
+    int r = open_hidraw_device();
+    if (r == 0 || requested_backend == DEVICE_BACKEND_HIDRAW) {
+      if (r < 0) {
+        log_message(stderr,
+                    "Could not open hidraw node of the device: %s\n",
+                    strerror(-r));
+        device_close();
+      }
+      return r;
+    }
+  }
+  active_backend = DEVICE_BACKEND_LIBUSB;
+  return open_usb_device();
+}
+
+void device_close(void) {
+  opened_device.clear();
+  if (daemon_fd >= 0) {
+    close(daemon_fd);
+    daemon_fd = -1;
+    return;
+  }
+  release_device();
+  if (dispatcher != NULL) {
+    delete dispatcher;
+    dispatcher = NULL;
+  }
+  if (hotplug_registered) {
+    libusb_hotplug_deregister_callback(ctx, hotplug_handle);
+    hotplug_registered = false;
+  }
+  device_arrived = false;
+  events_enabled = false;
+  if (ctx != NULL) {
+    libusb_exit(ctx);
+    ctx = NULL;
+  }
+}
+
+const std::string &device_opened_id(void) {
+  return opened_device;
+}
+
+bool device_is_daemon_client(void) {
+  return daemon_fd >= 0;
+}
+
+int device_submit_request(unsigned char buffer[PACKET_INT_LEN]) {
+  int command = buffer[0];
+  if (daemon_fd >= 0) {
+    DaemonRequest request;
+    request.command = command;
+    int r = daemon_client_transact(daemon_fd,
+                                   buffer,
+                                   &request.reply,
+                                   &daemon_events);
+    if (r < 0) {
+      log_message(stderr, "Daemon communication error %s\n", strerror(-r));
+      return r;
+    }
+    daemon_requests[next_daemon_request] = request;
+    return next_daemon_request++;
+  }
+  int request = dispatcher->begin_request(buffer, true);
+  if (request == LIBUSB_ERROR_BUSY) {
+    log_message(stderr, "Too many outstanding requests\n");
+    return request;
+  } else if (request < 0) {
+    log_message(stderr, "Interrupt write error %s\n",
+                libusb_error_name(request));
+    return request;
+  }
+  RequestState *state = &request_states[request];
+  memcpy(state->report, buffer, PACKET_INT_LEN);
+  state->submit_time = std::chrono::steady_clock::now();
+  state->start_time = state->submit_time;
+  state->num_attempts = 1;
+  retry_policy.record_request(command);
+  int r = transport->submit_report(buffer, TIMEOUT);
+  if (r < 0) {
+    dispatcher->end_request(request);
+    log_message(stderr, "Interrupt write error %s\n", libusb_error_name(r));
+    return r;
+  }
+  return request;
+}
+
+int device_wait_answer(int request, unsigned char answer[PACKET_INT_LEN]) {
+  if (daemon_fd >= 0) {
+    std::map<int, DaemonRequest>::iterator it = daemon_requests.find(request);
+    if (it == daemon_requests.end()) {
+      log_message(stderr, "No answer received from the daemon\n");
+      return LIBUSB_ERROR_IO;
+    }
+    DaemonRequest daemon_request = it->second;
+    daemon_requests.erase(it);
+    if (daemon_request.reply.result < 0) {
+      print_read_error(daemon_request.command, daemon_request.reply.result);
+      return daemon_request.reply.result;
+    }
+    memcpy(answer, daemon_request.reply.answer, PACKET_INT_LEN);
+    return 0;
+  }
+  int command = request_states[request].report[0];
+  int r;
+  for (;;) {
+    r = dispatcher->wait_answer(request,
+                                answer,
+                                device_request_timeout(request));
+    if (r != LIBUSB_ERROR_TIMEOUT) {
+      break;
+    }
+    r = device_retry_request(request);
+    if (r < 0) {
+      break;
+    }
+  }
+  if (r < 0) {
+    print_read_error(command, r);
+    return r;
+  }
+  record_answer(request);
+  return 0;
+}
+
+int device_poll_answer(int request, unsigned char answer[PACKET_INT_LEN]) {
+  if (daemon_fd >= 0) {
+    /* Daemon answers right away. */
+    return device_wait_answer(request, answer);
+  }
+  int r = dispatcher->poll_answer(request, answer);
+  if (r == 0) {
+    record_answer(request);
+  } else if (r != LIBUSB_ERROR_TIMEOUT) {
+    print_read_error(request_states[request].report[0], r);
+  }
+  return r;
+}
+
+int device_request_timeout(int request) {
+  if (daemon_fd >= 0) {
+    return TIMEOUT;
+  }
+  RequestState *state = &request_states[request];
+  std::chrono::duration<double, std::milli> elapsed =
+      state->start_time - state->submit_time;
+  return retry_policy.timeout_ms(state->report[0], elapsed.count());
+}
+
+int device_retry_request(int request) {
+  if (daemon_fd >= 0) {
+    /* Daemon retries on its own. */
+    daemon_requests.erase(request);
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+  RequestState *state = &request_states[request];
+  int command = state->report[0];
+  retry_policy.record_timeout(command);
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - state->submit_time;
+  if (!retry_policy.should_retry(command, elapsed.count())) {
+    dispatcher->end_request(request);
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+  retry_policy.record_retry(command);
+  ++state->num_attempts;
+  state->start_time = std::chrono::steady_clock::now();
+  /* Same request ID, whichever attempt is answered first completes it. */
+  int r = transport->submit_report(state->report, TIMEOUT);
+  if (r < 0) {
+    dispatcher->end_request(request);
+    log_message(stderr, "Interrupt write error %s\n", libusb_error_name(r));
+  }
+  return r;
+}
+
+int device_wait_answer_for(int request,
+                           unsigned char answer[PACKET_INT_LEN],
+                           int timeout_ms) {
+  if (daemon_fd >= 0) {
+    return device_wait_answer(request, answer);
+  }
+  int r = dispatcher->wait_answer(request, answer, timeout_ms);
+  if (r == LIBUSB_ERROR_TIMEOUT) {
+    dispatcher->end_request(request);
+    return r;
+  }
+  if (r < 0) {
+    print_read_error(request_states[request].report[0], r);
+    return r;
+  }
+  record_answer(request);
+  return 0;
+}
+
+void device_command_stats(int command, CommandStats *r_stats) {
+  retry_policy.get_stats(command, r_stats);
+}
+
+void device_cancel_request(int request) {
+  if (daemon_fd >= 0) {
+    daemon_requests.erase(request);
+  } else {
+    dispatcher->end_request(request);
+  }
+}
+
+int device_answer_fd(void) {
+  return dispatcher != NULL ? dispatcher->answer_fd() : -1;
+}
+
+int device_send_buffer(unsigned char buffer[PACKET_INT_LEN]) {
+  if (command_has_answer(buffer[0])) {
+    last_request = device_submit_request(buffer);
+    return last_request < 0 ? last_request : 0;
+  }
+  return write_report(buffer, true);
+}
+
+int device_submit_buffer(unsigned char buffer[PACKET_INT_LEN]) {
+  return write_report(buffer, false);
+}
+
+int device_submit_raw(const unsigned char report[PACKET_INT_LEN]) {
+  if (daemon_fd >= 0) {
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+  }
+  if (transport == NULL) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  return transport->submit_report(report, TIMEOUT);
+}
+
+int device_read_answer(unsigned char buffer[PACKET_INT_LEN]) {
+  if (last_request < 0) {
+    log_message(stderr, "No request to read answer for\n");
+    return LIBUSB_ERROR_IO;
+  }
+  int request = last_request;
+  last_request = -1;
+  return device_wait_answer(request, buffer);
+}
+
+int device_set_events(bool enabled) {
+  return set_events(enabled, true);
+}
+
+int device_submit_set_events(bool enabled) {
+  return set_events(enabled, false);
+}
+
+int device_wait_event(unsigned char event[PACKET_INT_LEN], int timeout_ms) {
+  if (daemon_fd >= 0) {
+    int r = daemon_client_wait_event(daemon_fd,
+                                     &daemon_events,
+                                     event,
+                                     timeout_ms);
+    if (r == -ETIMEDOUT) {
+      return LIBUSB_ERROR_TIMEOUT;
+    }
+    return r < 0 ? LIBUSB_ERROR_IO : 0;
+  }
+  return dispatcher->wait_event(event, timeout_ms);
+}
+
+int device_event_fd(void) {
+  if (daemon_fd >= 0) {
+    /* Only events come outside of the transactions. */
+    return daemon_fd;
+  }
+  return dispatcher != NULL ? dispatcher->event_fd() : -1;
+}
+
+bool device_is_connected(void) {
+  if (daemon_fd >= 0) {
+    return true;
+  }
+  return transport != NULL && !transport->is_device_gone();
+}
+
+int device_reconnect(int timeout_ms, double *r_latency_ms) {
+  if (daemon_fd >= 0 || device_is_connected()) {
+    return 0;
+  }
+  if (transport != NULL) {
+    /* First attempt since the device is gone. */
+    bool was_wrapped = wrapped_fd >= 0;
+    release_device();
+    if (was_wrapped) {
+      /* Context of the wrapped node can't find the device again. */
+      libusb_exit(ctx);
+      ctx = NULL;
+      int r = init_usb_context(true);
+      if (r < 0) {
+        return r;
+      }
+    }
+    if (active_backend == DEVICE_BACKEND_LIBUSB &&
+        !hotplug_registered &&
+        libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+      /* Enumerate flag reports the device if it's already back. */
+      int r = libusb_hotplug_register_callback(
+          ctx,
+          LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+          LIBUSB_HOTPLUG_ENUMERATE,
+          VENDOR_ID,
+          PRODUCT_ID,
+          LIBUSB_HOTPLUG_MATCH_ANY,
+          hotplug_cb,
+          NULL,
+          &hotplug_handle);
+      hotplug_registered = (r == 0);
+    }
+  }
+  /* Without hotplug support the device is polled for. */
+  const int POLL_INTERVAL_MS = 100;
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(timeout_ms);
+  for (;;) {
+    if (reopen_device() == 0) {
+      break;
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      return LIBUSB_ERROR_TIMEOUT;
+    }
+    if (hotplug_registered) {
+      /* Hotplug callbacks are invoked from the event handling, nobody else
+       * handles events while the device is gone.
+       */
+      timeval tv = {0, POLL_INTERVAL_MS * 1000};
+      libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    } else {
+      usleep(POLL_INTERVAL_MS * 1000);
+    }
+  }
+  dispatcher->set_device_gone(false);
+  if (events_enabled) {
+    int r = device_set_events(true);
+    if (r < 0) {
+      return r;
+    }
+  }
+  if (r_latency_ms != NULL) {
+    std::chrono::duration<double, std::milli> latency =
+        std::chrono::steady_clock::now() - disconnect_time;
+    *r_latency_ms = latency.count();
+  }
+  return 0;
+}
@@ -0,0 +1,182 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __DEVICE_H__
+#define __DEVICE_H__
+
+#include <string>
+#include <vector>
+
+#include "protocol.h"
+#include "retry_policy.h"
+
+/* Identifiers of all attached boards, sorted. Serial number is used when
+ * the board has one, otherwise it's the "<bus>-<port>[.<port>...]" path.
+ */
+int device_list(std::vector<std::string> *r_ids);
+
+/* Make device_open() open the board with the given identifier instead of
+ * the first one found, NULL to go back to the first one.
+ */
+void device_select(const char *id);
+/* Identifier given to device_select(), empty for the first board. */
+const std::string &device_selected(void);
+
+enum DeviceBackend {
+  /* hidraw node when there's one, libusb otherwise. */
+  DEVICE_BACKEND_AUTO,
+  DEVICE_BACKEND_LIBUSB,
+  DEVICE_BACKEND_HIDRAW,
+  /* In-process emulator which runs the firmware's command handling on
+   * simulated computers.
+   */
+  DEVICE_BACKEND_EMULATOR,
+};
+
+/* Print diagnostics about failed transfers and device lookup, disabled by
+ * default so the library stays quiet. Errors are returned either way.
+ */
+void device_set_log_enabled(bool enabled);
+
+/* Choose how device_open() talks to the board. */
+void device_set_backend(DeviceBackend backend);
+
+/* device_open() remembers where the board was found and opens it right
+ * there the next time, falling back to the full search when the location
+ * is stale. Enabled by default.
+ */
+void device_set_cache_enabled(bool enabled);
+
+class CaptureSink;
+
+/* Show every report of the directly opened device to the sink, see
+ * RecordingTransport. Applies to the devices opened after the call, NULL
+ * stops capturing. Device is never opened through the daemon while
+ * capturing.
+ */
+void device_set_capture(CaptureSink *sink);
+
+/* Open the board.
+ *
+ * When allow_daemon is true and a daemon is listening on its socket the
+ * requests are forwarded to it, otherwise the device is opened and its
+ * interface is claimed directly.
+ */
+int device_open(bool allow_daemon);
+void device_close(void);
+
+/* Identifier of the opened board, see device_list(). Empty when requests
+ * are forwarded to the daemon.
+ */
+const std::string &device_opened_id(void);
+
+/* True when requests are forwarded to the daemon. */
+bool device_is_daemon_client(void);
+
+/* Send report and, if the command has an answer, wait for it with
+ * device_read_answer().
+ */
+int device_send_buffer(unsigned char buffer[PACKET_INT_LEN]);
+int device_read_answer(unsigned char buffer[PACKET_INT_LEN]);
+
+/* Pipelined requests: send report of a command which has an answer without
+ * waiting for it. Returns request to pass to device_wait_answer(), answers
+ * might be waited for in any order.
+ */
+int device_submit_request(unsigned char buffer[PACKET_INT_LEN]);
+int device_wait_answer(int request, unsigned char answer[PACKET_INT_LEN]);
+
+/* Non-blocking device_wait_answer() for event loops. Returns
+ * LIBUSB_ERROR_TIMEOUT while the answer didn't come yet, the request stays
+ * outstanding then until it's polled again or cancelled.
+ */
+int device_poll_answer(int request, unsigned char answer[PACKET_INT_LEN]);
+
+/* How long to wait for the answer to the request before calling
+ * device_retry_request(), derived from the round trip times seen so far.
+ */
+int device_request_timeout(int request);
+
+/* Send the request again after its answer didn't come in time. Returns
+ * LIBUSB_ERROR_TIMEOUT and ends the request when it's not retried.
+ */
+int device_retry_request(int request);
+
+/* device_wait_answer() with a fixed timeout and without retries, for probing
+ * whether the firmware supports a command at all. The request is ended when
+ * the answer doesn't come in time. The daemon waits with its own timeout.
+ */
+int device_wait_answer_for(int request,
+                           unsigned char answer[PACKET_INT_LEN],
+                           int timeout_ms);
+
+/* Round trip times, timeouts and retries of the command. */
+void device_command_stats(int command, CommandStats *r_stats);
+
+/* Forget the outstanding request, its answer is dropped if it comes. */
+void device_cancel_request(int request);
+
+/* Descriptor which is readable when answers might be ready for
+ * device_poll_answer(), it's reset by reading it. -1 when requests are
+ * forwarded to the daemon, their answers are ready right away then.
+ */
+int device_answer_fd(void);
+
+/* Send report of a command which has no answer without waiting for it to
+ * be delivered.
+ */
+int device_submit_buffer(unsigned char buffer[PACKET_INT_LEN]);
+
+/* Submit the report as it is, request ID included, for replaying captured
+ * traffic. Its answer is not waited for. Not supported when requests are
+ * forwarded to the daemon.
+ */
+int device_submit_raw(const unsigned char report[PACKET_INT_LEN]);
+
+/* Enable or disable unsolicited event reports from the device. */
+int device_set_events(bool enabled);
+
+/* device_set_events() without waiting for the report to be delivered. */
+int device_submit_set_events(bool enabled);
+
+/* Wait for the next event report. */
+int device_wait_event(unsigned char event[PACKET_INT_LEN], int timeout_ms);
+
+/* Descriptor which is readable while there are event reports to be read.
+ * When requests are forwarded to the daemon it's the daemon socket, events
+ * which came along with the replies are queued already and are read by
+ * device_wait_event() without it being readable.
+ */
+int device_event_fd(void);
+
+/* False once the directly opened device is unplugged, requests fail with
+ * LIBUSB_ERROR_NO_DEVICE until device_reconnect() succeeds.
+ */
+bool device_is_connected(void);
+
+/* Wait up to timeout_ms for the unplugged device to come back, claim it
+ * again and restore the event subscription. Returns LIBUSB_ERROR_TIMEOUT
+ * when it's not back yet, the call might be repeated. Time since the device
+ * was found gone is stored in r_latency_ms.
+ */
+int device_reconnect(int timeout_ms, double *r_latency_ms);
+
+#endif  /* __DEVICE_H__ */
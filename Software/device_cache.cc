@@ -0,0 +1,117 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "device_cache.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char *CACHE_FILE_NAME = "pcremotecontrol-device";
+
+}  /* namespace */
+
+const char *device_cache_path(void) {
+  static std::string path;
+  if (!path.empty()) {
+    return path.c_str();
+  }
+  const char *cache_path = getenv("PCREMOTECONTROL_CACHE");
+  const char *cache_dir = getenv("XDG_CACHE_HOME");
+  const char *home_dir = getenv("HOME");
+  if (cache_path != NULL && cache_path[0] != '\0') {
+    path = cache_path;
+  } else if (cache_dir != NULL && cache_dir[0] != '\0') {
+    path = std::string(cache_dir) + "/" + CACHE_FILE_NAME;
+  } else if (home_dir != NULL && home_dir[0] != '\0') {
+    path = std::string(home_dir) + "/.cache/" + CACHE_FILE_NAME;
+  } else {
+    return NULL;
+  }
+  return path.c_str();
+}
+
+std::string device_cache_board_path(const std::string &id) {
+  const char *path = device_cache_path();
+  if (path == NULL) {
+    return "";
+  }
+  if (id.empty()) {
+    return path;
+  }
+  std::string board_path = std::string(path) + "-";
+  for (size_t i = 0; i < id.size(); ++i) {
+    board_path += isalnum((unsigned char)id[i]) || id[i] == '-' ||
+                  id[i] == '.' ? id[i] : '_';
+  }
+  return board_path;
+}
+
+bool device_cache_load(const std::string &id, DeviceCacheEntry *r_entry) {
+  std::string path = device_cache_board_path(id);
+  if (path.empty()) {
+    return false;
+  }
+  FILE *file = fopen(path.c_str(), "r");
+  if (file == NULL) {
+    return false;
+  }
+  char backend[16], device_path[256], board_id[64];
+  int n = fscanf(file, "%15s %255s %63s", backend, device_path, board_id);
+  fclose(file);
+  if (n != 3) {
+    return false;
+  }
+  r_entry->backend = backend;
+  r_entry->path = device_path;
+  r_entry->id = board_id;
+  return true;
+}
+
+void device_cache_store(const std::string &id, const DeviceCacheEntry &entry) {
+  std::string path = device_cache_board_path(id);
+  if (path.empty()) {
+    return;
+  }
+  /* Default cache directory might not exist yet. */
+  size_t slash = path.rfind('/');
+  if (slash != std::string::npos && slash != 0) {
+    mkdir(path.substr(0, slash).c_str(), 0700);
+  }
+  /* Readers never see a partially written entry. */
+  char temp_path[PATH_MAX];
+  snprintf(temp_path, sizeof(temp_path), "%s.%d", path.c_str(), getpid());
+  FILE *file = fopen(temp_path, "w");
+  if (file == NULL) {
+    return;
+  }
+  fprintf(file, "%s %s %s\n",
+          entry.backend.c_str(), entry.path.c_str(), entry.id.c_str());
+  if (fclose(file) != 0 || rename(temp_path, path.c_str()) < 0) {
+    unlink(temp_path);
+  }
+}
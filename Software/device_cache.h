@@ -0,0 +1,48 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __DEVICE_CACHE_H__
+#define __DEVICE_CACHE_H__
+
+#include <string>
+
+/* Where the board was opened the last time, so the next run can open it
+ * right away instead of looking through all the devices.
+ */
+struct DeviceCacheEntry {
+  std::string backend;  /* "hidraw" or "libusb". */
+  std::string path;     /* /dev/hidrawN or /dev/bus/usb/BBB/DDD. */
+  std::string id;       /* Board identifier, see device_list(). */
+};
+
+/* PCREMOTECONTROL_CACHE overrides the default file in the user's cache
+ * directory, NULL when there's no place for the cache. Every board selected
+ * by its identifier has its own file next to it, so processes opening
+ * different boards don't overwrite each other's entries. Empty id is the
+ * board opened without selecting one.
+ */
+const char *device_cache_path(void);
+std::string device_cache_board_path(const std::string &id);
+
+bool device_cache_load(const std::string &id, DeviceCacheEntry *r_entry);
+void device_cache_store(const std::string &id, const DeviceCacheEntry &entry);
+
+#endif  /* __DEVICE_CACHE_H__ */
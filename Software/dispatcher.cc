@@ -0,0 +1,235 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "dispatcher.h"
+
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include <libusb.h>
+
+namespace {
+
+/* Maximum number of event reports which are waiting to be read. */
+const size_t MAX_QUEUED_EVENTS = 64;
+
+}  /* namespace */
+
+RequestDispatcher::RequestDispatcher()
+    : next_request_id_(REQUEST_ID_MIN),
+      num_dropped_answers_(0),
+      device_gone_(false) {
+  memset(requests_, 0, sizeof(requests_));
+  event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  answer_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+RequestDispatcher::~RequestDispatcher() {
+  if (event_fd_ >= 0) {
+    close(event_fd_);
+  }
+  if (answer_fd_ >= 0) {
+    close(answer_fd_);
+  }
+}
+
+int RequestDispatcher::begin_request(unsigned char report[PACKET_INT_LEN],
+                                     bool expects_answer) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (device_gone_) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  /* IDs are handed out round-robin, so a late answer is unlikely to meet
+   * a new request with the same ID.
+   */
+  for (int i = REQUEST_ID_MIN; i <= REQUEST_ID_MAX; ++i) {
+    int request_id = next_request_id_;
+    next_request_id_ = request_id == REQUEST_ID_MAX ? REQUEST_ID_MIN
+                                                    : request_id + 1;
+    Request *request = &requests_[request_id];
+    if (request->active) {
+      continue;
+    }
+    request->active = true;
+    request->expects_answer = expects_answer;
+    request->answered = false;
+    if (expects_answer) {
+      waiting_.push_back(request_id);
+    }
+    report[REQUEST_ID_OFFSET] = request_id;
+    return request_id;
+  }
+  return LIBUSB_ERROR_BUSY;
+}
+
+void RequestDispatcher::end_request_locked(int request_id) {
+  Request *request = &requests_[request_id];
+  request->active = false;
+  std::deque<int>::iterator it =
+      std::find(waiting_.begin(), waiting_.end(), request_id);
+  if (it != waiting_.end()) {
+    waiting_.erase(it);
+  }
+}
+
+void RequestDispatcher::end_request(int request_id) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  end_request_locked(request_id);
+}
+
+int RequestDispatcher::wait_answer(int request_id,
+                                   unsigned char answer[PACKET_INT_LEN],
+                                   int timeout_ms) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  Request *request = &requests_[request_id];
+  bool ready = cond_.wait_for(lock,
+                              std::chrono::milliseconds(timeout_ms),
+                              [this, request] {
+    return request->answered || device_gone_;
+  });
+  if (!ready) {
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+  bool answered = request->answered;
+  if (answered) {
+    memcpy(answer, request->answer, PACKET_INT_LEN);
+  }
+  end_request_locked(request_id);
+  return answered ? 0 : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int RequestDispatcher::poll_answer(int request_id,
+                                   unsigned char answer[PACKET_INT_LEN]) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  Request *request = &requests_[request_id];
+  if (request->answered) {
+    memcpy(answer, request->answer, PACKET_INT_LEN);
+  } else if (!device_gone_) {
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+  bool answered = request->answered;
+  end_request_locked(request_id);
+  return answered ? 0 : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int RequestDispatcher::answer_fd(void) {
+  return answer_fd_;
+}
+
+void RequestDispatcher::dispatch_report(
+    const unsigned char report[PACKET_INT_LEN]) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  int request_id = report[REQUEST_ID_OFFSET];
+  if (request_id == REQUEST_ID_EVENT) {
+    if (events_.size() == MAX_QUEUED_EVENTS) {
+      /* Nobody is reading, drop the oldest event. */
+      events_.pop_front();
+    }
+    events_.push_back(
+        std::vector<unsigned char>(report, report + PACKET_INT_LEN));
+    update_event_fd_locked();
+    cond_.notify_all();
+    return;
+  }
+  if (request_id == REQUEST_ID_NONE && !waiting_.empty()) {
+    request_id = waiting_.front();
+  }
+  if (request_id < REQUEST_ID_MIN || request_id > REQUEST_ID_MAX) {
+    ++num_dropped_answers_;
+    return;
+  }
+  Request *request = &requests_[request_id];
+  if (!request->active || !request->expects_answer || request->answered) {
+    ++num_dropped_answers_;
+    return;
+  }
+  memcpy(request->answer, report, PACKET_INT_LEN);
+  request->answered = true;
+  std::deque<int>::iterator it =
+      std::find(waiting_.begin(), waiting_.end(), request_id);
+  if (it != waiting_.end()) {
+    waiting_.erase(it);
+  }
+  signal_answer_fd();
+  cond_.notify_all();
+}
+
+int RequestDispatcher::num_dropped_answers(void) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return num_dropped_answers_;
+}
+
+int RequestDispatcher::wait_event(unsigned char event[PACKET_INT_LEN],
+                                  int timeout_ms) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  bool ready = cond_.wait_for(lock,
+                              std::chrono::milliseconds(timeout_ms),
+                              [this] {
+    return !events_.empty() || device_gone_;
+  });
+  if (!ready) {
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+  /* Events which came before the device was gone are still delivered. */
+  if (events_.empty()) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  memcpy(event, &events_.front()[0], PACKET_INT_LEN);
+  events_.pop_front();
+  update_event_fd_locked();
+  return 0;
+}
+
+int RequestDispatcher::event_fd(void) {
+  return event_fd_;
+}
+
+void RequestDispatcher::set_device_gone(bool gone) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  device_gone_ = gone;
+  update_event_fd_locked();
+  if (gone) {
+    signal_answer_fd();
+  }
+  cond_.notify_all();
+}
+
+void RequestDispatcher::update_event_fd_locked(void) {
+  uint64_t value = 1;
+  if (!events_.empty() || device_gone_) {
+    if (write(event_fd_, &value, sizeof(value)) < 0) {
+      /* Counter is only used as a flag, it can't overflow in practice. */
+    }
+  } else if (read(event_fd_, &value, sizeof(value)) < 0) {
+    /* Counter is already reset. */
+  }
+}
+
+void RequestDispatcher::signal_answer_fd(void) {
+  uint64_t value = 1;
+  if (write(answer_fd_, &value, sizeof(value)) < 0) {
+    /* Counter is only used as a flag, it can't overflow in practice. */
+  }
+}
@@ -0,0 +1,114 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __DISPATCHER_H__
+#define __DISPATCHER_H__
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "protocol.h"
+
+/* Matches IN reports to the outstanding requests by their request ID.
+ *
+ * Every request gets an ID which is stored in the last byte of its report,
+ * and the firmware echoes it back in the answer. Answers without an ID come
+ * from older firmware and are given to the oldest outstanding request.
+ * Answers to requests nobody waits for any more (for example, the ones
+ * which arrived after a timeout) are dropped. Event reports are queued
+ * separately.
+ */
+class RequestDispatcher {
+ public:
+  RequestDispatcher();
+  ~RequestDispatcher();
+
+  /* Allocate request ID and tag the report with it.
+   * Returns the ID or negative libusb error code.
+   */
+  int begin_request(unsigned char report[PACKET_INT_LEN], bool expects_answer);
+
+  /* Forget about the request, answer to it is dropped if it comes later. */
+  void end_request(int request_id);
+
+  /* Wait for the answer and end the request. On timeout the request stays
+   * outstanding, so it might be sent again or ended.
+   */
+  int wait_answer(int request_id,
+                  unsigned char answer[PACKET_INT_LEN],
+                  int timeout_ms);
+
+  /* Non-blocking wait_answer(), returns LIBUSB_ERROR_TIMEOUT while the
+   * answer didn't come yet and keeps the request outstanding then.
+   */
+  int poll_answer(int request_id, unsigned char answer[PACKET_INT_LEN]);
+
+  /* Descriptor which becomes readable when an answer comes or the device
+   * is gone. It's a counter which is reset by reading it.
+   */
+  int answer_fd(void);
+
+  /* Route incoming IN report to the request it answers. */
+  void dispatch_report(const unsigned char report[PACKET_INT_LEN]);
+
+  int num_dropped_answers(void);
+
+  /* Wait for the next event report. */
+  int wait_event(unsigned char event[PACKET_INT_LEN], int timeout_ms);
+
+  /* Descriptor which is readable while there are queued events or the
+   * device is gone.
+   */
+  int event_fd(void);
+
+  /* Fail all waiters and new requests with LIBUSB_ERROR_NO_DEVICE until the
+   * device is back.
+   */
+  void set_device_gone(bool gone);
+
+ protected:
+  struct Request {
+    bool active;
+    bool expects_answer;
+    bool answered;
+    unsigned char answer[PACKET_INT_LEN];
+  };
+
+  void end_request_locked(int request_id);
+  void update_event_fd_locked(void);
+  void signal_answer_fd(void);
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  Request requests_[REQUEST_ID_MAX + 1];
+  /* Requests which wait for an answer, oldest first. */
+  std::deque<int> waiting_;
+  int next_request_id_;
+  int num_dropped_answers_;
+  std::deque<std::vector<unsigned char> > events_;
+  int event_fd_;
+  int answer_fd_;
+  bool device_gone_;
+};
+
+#endif  /* __DISPATCHER_H__ */
@@ -0,0 +1,529 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "emulator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <vector>
+
+#include <libusb.h>
+
+#include "emulator/usb/inc/usb_device_hid.h"
+
+extern "C" {
+/* Firmware's HID code, see app_device_custom_hid.h. */
+void APP_DeviceCustomHIDInitialize(void);
+void APP_DeviceCustomHIDTasks(void);
+}
+
+namespace {
+
+/* How often the firmware main loop runs. */
+const int LOOP_INTERVAL_MS = 10;
+/* Host takes one IN report per frame, out of two ping-pong buffers like on
+ * the board.
+ */
+const std::chrono::milliseconds FRAME_INTERVAL(1);
+const int IN_PING_PONG_DEPTH = 2;
+/* Period of the timer which drives the switches on the board. */
+const int SWITCH_TICK_MS = 350;
+
+/* Same states as in app_control.c. */
+enum {
+  SW_STATE_NONE = 0,
+  SW_STATE_NEED_PRESS = 1,
+  SW_STATE_NEED_FORCE_PRESS = 2,
+  SW_STATE_PRESSED = 3,
+};
+
+struct EmulatedPc {
+  bool on;
+  bool autoboot;
+  bool forced;
+  int switch_state;
+  int switch_counter;
+  char name[PC_MAX_NAME];
+  unsigned char last_status;
+};
+
+/* Ping-pong buffer of the IN endpoint, busy until the host took the report
+ * in a frame.
+ */
+struct InBuffer {
+  bool busy;
+  std::chrono::steady_clock::time_point arm_time;
+  std::vector<unsigned char> report;
+};
+
+/* Protects the firmware globals and everything below. */
+std::mutex firmware_mutex;
+
+/* HID endpoint as seen by the firmware. */
+unsigned char *out_buffer = NULL;
+bool out_ready = false;
+/* Times the OUT endpoint was armed, it's not while the firmware has no
+ * buffer for the answer.
+ */
+unsigned int num_out_arms = 0;
+std::deque<std::vector<unsigned char> > out_reports;
+/* OUT transmissions complete immediately, its handle only needs to be
+ * unique.
+ */
+int out_handle;
+InBuffer in_buffers[IN_PING_PONG_DEPTH];
+/* Buffer armed by the next HIDTxPacket() and the oldest one which might be
+ * busy.
+ */
+int next_in_buffer, next_in_frame_buffer;
+std::chrono::steady_clock::time_point last_frame_time;
+/* Reports taken by the host, delivered once the firmware lock is released. */
+std::vector<std::vector<unsigned char> > in_reports;
+
+/* Simulated board. */
+EmulatedPc pcs[NUM_PCS];
+unsigned char status_changes;
+unsigned char ip[4];
+unsigned char mac[6];
+
+/* Hand the next OUT report to the firmware if the endpoint is armed. */
+void receive_out_report(void) {
+  if (out_buffer == NULL || out_ready || out_reports.empty()) {
+    return;
+  }
+  memcpy(out_buffer, &out_reports.front()[0], PACKET_INT_LEN);
+  out_reports.pop_front();
+  out_ready = true;
+}
+
+void reset_board(void) {
+  static const unsigned char default_ip[4] = {192, 168, 1, 200};
+  static const unsigned char default_mac[6] = {0x00, 0x04, 0xa3,
+                                               0x00, 0x00, 0x01};
+  memset(pcs, 0, sizeof(pcs));
+  for (int i = 0; i < NUM_PCS; ++i) {
+    snprintf(pcs[i].name, PC_MAX_NAME, "PC%d", i + 1);
+  }
+  status_changes = 0;
+  memcpy(ip, default_ip, sizeof(ip));
+  memcpy(mac, default_mac, sizeof(mac));
+  out_buffer = NULL;
+  out_ready = false;
+  num_out_arms = 0;
+  out_reports.clear();
+  for (int i = 0; i < IN_PING_PONG_DEPTH; ++i) {
+    in_buffers[i].busy = false;
+  }
+  next_in_buffer = 0;
+  next_in_frame_buffer = 0;
+  last_frame_time = std::chrono::steady_clock::time_point();
+  in_reports.clear();
+}
+
+/* Run the firmware while it takes the OUT reports. With the IN ring full
+ * the OUT endpoint stays un-armed, the rest waits for the frames.
+ */
+void run_firmware_tasks(void) {
+  unsigned int num_arms;
+  do {
+    num_arms = num_out_arms;
+    APP_DeviceCustomHIDTasks();
+  } while (out_ready && num_out_arms != num_arms);
+}
+
+/* Let the host take the busy IN buffers, one per frame since the last one
+ * was taken. Returns true while some buffer is still busy.
+ */
+bool run_in_frames(void) {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  for (;;) {
+    InBuffer *buffer = &in_buffers[next_in_frame_buffer];
+    if (!buffer->busy) {
+      return false;
+    }
+    std::chrono::steady_clock::time_point frame_time =
+        std::max(last_frame_time + FRAME_INTERVAL, buffer->arm_time);
+    if (frame_time > now) {
+      return true;
+    }
+    last_frame_time = frame_time;
+    in_reports.push_back(buffer->report);
+    buffer->busy = false;
+    next_in_frame_buffer = (next_in_frame_buffer + 1) % IN_PING_PONG_DEPTH;
+    /* Buffer is free for the responses queued in the ring. */
+    run_firmware_tasks();
+  }
+}
+
+/* Timer tick of APP_control_loop(). Releasing the switch after a short
+ * press toggles the computer, after a long one it's turned off.
+ */
+void tick_switches(void) {
+  for (int i = 0; i < NUM_PCS; ++i) {
+    EmulatedPc *pc = &pcs[i];
+    switch (pc->switch_state) {
+      case SW_STATE_NEED_PRESS:
+      case SW_STATE_NEED_FORCE_PRESS:
+        pc->forced = pc->switch_state == SW_STATE_NEED_FORCE_PRESS;
+        pc->switch_state = SW_STATE_PRESSED;
+        pc->switch_counter = pc->forced ? 16 : 1;
+        break;
+      case SW_STATE_PRESSED:
+        if (--pc->switch_counter == 0) {
+          pc->switch_state = SW_STATE_NONE;
+          pc->on = pc->forced ? false : !pc->on;
+        }
+        break;
+    }
+  }
+}
+
+}  /* namespace */
+
+/* Simulated app_control.h and app_network.h, and the USB stack. */
+extern "C" {
+
+uint8_t APP_control_num_pcs(void) {
+  return NUM_PCS;
+}
+
+bool APP_control_is_pc_on(uint8_t pc) {
+  return pcs[pc].on;
+}
+
+bool APP_control_is_autoboot_enabled(uint8_t pc) {
+  return pcs[pc].autoboot;
+}
+
+void APP_control_set_autoboot_enabled(uint8_t pc, bool enabled) {
+  pcs[pc].autoboot = enabled;
+}
+
+uint8_t APP_control_get_pc_status(uint8_t pc) {
+  uint8_t status = pcs[pc].on ? PC_STATUS_ON : 0;
+  switch (pcs[pc].switch_state) {
+    case SW_STATE_NEED_PRESS:
+    case SW_STATE_NEED_FORCE_PRESS:
+      status |= PC_STATUS_WILL_PRESS;
+      break;
+    case SW_STATE_PRESSED:
+      status |= PC_STATUS_PRESSED;
+      break;
+  }
+  return status;
+}
+
+uint8_t APP_control_take_status_changes(void) {
+  uint8_t changes = status_changes;
+  status_changes = 0;
+  return changes;
+}
+
+void APP_control_set_pc_name(uint8_t pc, const char name[PC_MAX_NAME]) {
+  memcpy(pcs[pc].name, name, PC_MAX_NAME);
+}
+
+void APP_control_get_pc_name(uint8_t pc, char name[PC_MAX_NAME]) {
+  memcpy(name, pcs[pc].name, PC_MAX_NAME);
+}
+
+void APP_control_switch_press(uint8_t pc, bool force) {
+  pcs[pc].switch_state = force ? SW_STATE_NEED_FORCE_PRESS
+                               : SW_STATE_NEED_PRESS;
+}
+
+void APP_network_debug_blink(void) {
+}
+
+void APP_network_set_ip(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3) {
+  ip[0] = ip0;
+  ip[1] = ip1;
+  ip[2] = ip2;
+  ip[3] = ip3;
+}
+
+void APP_network_set_mac(uint8_t mac0,
+                         uint8_t mac1,
+                         uint8_t mac2,
+                         uint8_t mac3,
+                         uint8_t mac4,
+                         uint8_t mac5) {
+  mac[0] = mac0;
+  mac[1] = mac1;
+  mac[2] = mac2;
+  mac[3] = mac3;
+  mac[4] = mac4;
+  mac[5] = mac5;
+}
+
+void APP_network_get_ip(uint8_t *ip0, uint8_t *ip1, uint8_t *ip2, uint8_t *ip3) {
+  *ip0 = ip[0];
+  *ip1 = ip[1];
+  *ip2 = ip[2];
+  *ip3 = ip[3];
+}
+
+void APP_network_get_mac(uint8_t *mac0,
+                         uint8_t *mac1,
+                         uint8_t *mac2,
+                         uint8_t *mac3,
+                         uint8_t *mac4,
+                         uint8_t *mac5) {
+  *mac0 = mac[0];
+  *mac1 = mac[1];
+  *mac2 = mac[2];
+  *mac3 = mac[3];
+  *mac4 = mac[4];
+  *mac5 = mac[5];
+}
+
+void USBEnableEndpoint(uint8_t /*ep*/, uint8_t /*options*/) {
+}
+
+USB_HANDLE HIDTxPacket(uint8_t /*ep*/, uint8_t *data, uint16_t len) {
+  /* Firmware only arms a buffer once it's not busy. */
+  InBuffer *buffer = &in_buffers[next_in_buffer];
+  next_in_buffer = (next_in_buffer + 1) % IN_PING_PONG_DEPTH;
+  buffer->report.assign(PACKET_INT_LEN, 0);
+  memcpy(&buffer->report[0], data, len < PACKET_INT_LEN ? len : PACKET_INT_LEN);
+  buffer->arm_time = std::chrono::steady_clock::now();
+  buffer->busy = true;
+  return buffer;
+}
+
+USB_HANDLE HIDRxPacket(uint8_t /*ep*/, uint8_t *data, uint16_t /*len*/) {
+  out_buffer = data;
+  out_ready = false;
+  ++num_out_arms;
+  receive_out_report();
+  return &out_handle;
+}
+
+bool HIDTxHandleBusy(USB_HANDLE handle) {
+  return handle != NULL && ((InBuffer *)handle)->busy;
+}
+
+bool HIDRxHandleBusy(USB_HANDLE /*handle*/) {
+  return !out_ready;
+}
+
+}  /* extern "C" */
+
+EmulatedTransport::EmulatedTransport()
+    : report_callback_(NULL),
+      report_callback_data_(NULL),
+      answer_loss_(0.0),
+      loss_seed_(1),
+      running_(false),
+      transmitting_(false) {
+  const char *loss = getenv("PCREMOTECONTROL_EMULATOR_LOSS");
+  if (loss != NULL) {
+    answer_loss_ = atof(loss);
+  }
+}
+
+EmulatedTransport::~EmulatedTransport() {
+  stop();
+}
+
+void EmulatedTransport::set_report_callback(ReportCallback callback,
+                                            void *user_data) {
+  report_callback_ = callback;
+  report_callback_data_ = user_data;
+}
+
+void EmulatedTransport::set_device_gone_callback(
+    DeviceGoneCallback /*callback*/,
+    void * /*user_data*/) {
+  /* Emulated device is never unplugged. */
+}
+
+int EmulatedTransport::start(void) {
+  {
+    std::unique_lock<std::mutex> lock(firmware_mutex);
+    reset_board();
+    APP_DeviceCustomHIDInitialize();
+  }
+  running_ = true;
+  ticker_thread_ = std::thread(&EmulatedTransport::ticker_loop, this);
+  return 0;
+}
+
+void EmulatedTransport::stop(void) {
+  if (!ticker_thread_.joinable()) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(ticker_mutex_);
+    running_ = false;
+    ticker_cond_.notify_all();
+  }
+  ticker_thread_.join();
+}
+
+bool EmulatedTransport::run_firmware(const unsigned char *out_report,
+                                     bool tick) {
+  std::unique_lock<std::mutex> lock(firmware_mutex);
+  if (out_report != NULL) {
+    out_reports.push_back(std::vector<unsigned char>(
+        out_report, out_report + PACKET_INT_LEN));
+    receive_out_report();
+  }
+  if (tick) {
+    tick_switches();
+  }
+  /* Same change detection as in APP_control_loop(). */
+  for (int i = 0; i < NUM_PCS; ++i) {
+    unsigned char status = APP_control_get_pc_status(i);
+    if (status != pcs[i].last_status) {
+      pcs[i].last_status = status;
+      status_changes |= (1 << i);
+    }
+  }
+  run_firmware_tasks();
+  bool transmitting = run_in_frames();
+  std::vector<std::vector<unsigned char> > reports;
+  reports.swap(in_reports);
+  std::unique_lock<std::mutex> delivery_lock(delivery_mutex_);
+  lock.unlock();
+  for (size_t i = 0; i < reports.size(); ++i) {
+    if (reports[i][REQUEST_ID_OFFSET] != REQUEST_ID_EVENT &&
+        answer_loss_ > 0.0 &&
+        rand_r(&loss_seed_) < answer_loss_ * RAND_MAX) {
+      continue;
+    }
+    if (report_callback_ != NULL) {
+      report_callback_(&reports[i][0], report_callback_data_);
+    }
+  }
+  return transmitting;
+}
+
+int EmulatedTransport::submit_report(
+    const unsigned char report[PACKET_INT_LEN],
+    int /*timeout_ms*/) {
+  if (!ticker_thread_.joinable()) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  if (run_firmware(report, false)) {
+    /* Ticker runs the frames of the reports which didn't fit. */
+    std::unique_lock<std::mutex> lock(ticker_mutex_);
+    transmitting_ = true;
+    ticker_cond_.notify_all();
+  }
+  return 0;
+}
+
+int EmulatedTransport::send_report(const unsigned char report[PACKET_INT_LEN],
+                                   int timeout_ms) {
+  return submit_report(report, timeout_ms);
+}
+
+bool EmulatedTransport::is_device_gone(void) {
+  return false;
+}
+
+void EmulatedTransport::ticker_loop(void) {
+  std::chrono::steady_clock::time_point next_tick =
+      std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(SWITCH_TICK_MS);
+  std::unique_lock<std::mutex> lock(ticker_mutex_);
+  while (running_) {
+    if (transmitting_) {
+      ticker_cond_.wait_for(lock, FRAME_INTERVAL);
+    } else {
+      ticker_cond_.wait_for(lock,
+                            std::chrono::milliseconds(LOOP_INTERVAL_MS));
+    }
+    if (!running_) {
+      break;
+    }
+    bool tick = std::chrono::steady_clock::now() >= next_tick;
+    if (tick) {
+      next_tick += std::chrono::milliseconds(SWITCH_TICK_MS);
+    }
+    transmitting_ = false;
+    lock.unlock();
+    bool transmitting = run_firmware(NULL, tick);
+    lock.lock();
+    transmitting_ = transmitting_ || transmitting;
+  }
+}
+
+namespace {
+
+/* Same as print_webpage_pc() in app_network.c. */
+void append_pc_webpage(int pc, std::string *page) {
+  char buffer[256];
+  uint8_t status = APP_control_get_pc_status(pc);
+  snprintf(buffer, sizeof(buffer),
+           "<span>Name: %.*s</span><div>Status: %s%s%s</div>"
+           "<div><a href=\"/press/%d\">Press Button</a>"
+           "&nbsp;&nbsp;&nbsp;&nbsp;"
+           "<a href=\"/hold/%d\">Hold Button</a></div>",
+           PC_MAX_NAME, pcs[pc].name,
+           (status & PC_STATUS_ON) ? "<span style=\"color: green\">ON</span>"
+                                   : "<span style=\"color: red\">OFF</span>",
+           (status & PC_STATUS_WILL_PRESS) ? ", WILL_PRESS_BUTTON" : "",
+           (status & PC_STATUS_PRESSED) ? ", BUTTON_PRESSED" : "",
+           pc, pc);
+  *page += buffer;
+}
+
+}  /* namespace */
+
+std::string emulator_http_response(const std::string &request) {
+  if (request.compare(0, 4, "GET ") != 0) {
+    return "HTTP/1.0 200 OK\r\n"
+           "Content-Type: text/html\r\n\r\n"
+           "<h1>200 OK</h1>";
+  }
+  std::string path = request.substr(4, request.find(' ', 4) - 4);
+  bool force = path.compare(0, 6, "/hold/") == 0;
+  if (force || path.compare(0, 7, "/press/") == 0) {
+    /* Firmware only looks at the single digit. */
+    int pc = path[force ? 6 : 7] - '0';
+    if (pc >= 0 && pc < NUM_PCS) {
+      std::unique_lock<std::mutex> lock(firmware_mutex);
+      APP_control_switch_press(pc, force);
+    }
+    return "HTTP/1.1 302 Found\r\n"
+           "Location: /\r\n\r\n";
+  }
+  std::string page = "HTTP/1.0 200 OK\r\n"
+                     "Content-Type: text/html\r\n\r\n"
+                     "<html><body>"
+                     "<h1>Welcome 2 PCRemoteControl</h1>";
+  std::unique_lock<std::mutex> lock(firmware_mutex);
+  for (int i = 0; i < NUM_PCS; ++i) {
+    char heading[64];
+    snprintf(heading, sizeof(heading), "<h2>Computer #%d</h2>", i + 1);
+    page += heading;
+    append_pc_webpage(i, &page);
+  }
+  page += "</html></body>";
+  return page;
+}
@@ -0,0 +1,94 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __EMULATOR_H__
+#define __EMULATOR_H__
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "transport.h"
+
+/* Transport which runs the firmware's HID code (app_device_custom_hid.c)
+ * in-process on top of simulated computers, so every host code path can be
+ * exercised without the board.
+ *
+ * OUT reports are handled right in submit_report(). IN endpoint has two
+ * ping-pong buffers and the host takes one report per 1 ms frame, so an
+ * answer to a single request is delivered before submit_report() returns,
+ * while a burst fills the firmware's IN ring and the OUT reports wait for
+ * it to drain. A ticker thread runs the frames and the simulated control
+ * loop, so presses complete and status change events are sent the same way
+ * as on the board. Firmware keeps its state in globals, so only one emulator
+ * can be started at a time.
+ *
+ * PCREMOTECONTROL_EMULATOR_LOSS is the fraction of answers to drop, to see
+ * how the host copes with a flaky link.
+ */
+class EmulatedTransport : public Transport {
+ public:
+  EmulatedTransport();
+  ~EmulatedTransport();
+
+  void set_report_callback(ReportCallback callback, void *user_data);
+  void set_device_gone_callback(DeviceGoneCallback callback, void *user_data);
+
+  int start(void);
+  void stop(void);
+
+  int submit_report(const unsigned char report[PACKET_INT_LEN],
+                    int timeout_ms);
+  int send_report(const unsigned char report[PACKET_INT_LEN], int timeout_ms);
+
+  bool is_device_gone(void);
+
+ protected:
+  /* Run the firmware and deliver the IN reports it sent. Returns true
+   * while some reports wait for the next frames.
+   */
+  bool run_firmware(const unsigned char *out_report, bool tick);
+  void ticker_loop(void);
+
+  ReportCallback report_callback_;
+  void *report_callback_data_;
+
+  /* Keeps IN reports in the order they were sent by the firmware. */
+  std::mutex delivery_mutex_;
+  double answer_loss_;
+  unsigned int loss_seed_;
+
+  std::thread ticker_thread_;
+  std::mutex ticker_mutex_;
+  std::condition_variable ticker_cond_;
+  bool running_;
+  /* Ticker runs every frame while reports wait for them. */
+  bool transmitting_;
+};
+
+/* Response of APP_network_loop() to the HTTP request, made from the state
+ * of the emulated board. It's what lan_serve() needs to stand in for the
+ * board's web server, presses only complete while the emulator is started.
+ */
+std::string emulator_http_response(const std::string &request);
+
+#endif  /* __EMULATOR_H__ */
@@ -0,0 +1,51 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Subset of the Microchip USB stack API which the firmware's HID code uses,
+ * implemented by the emulator (see emulator.cc).
+ */
+
+#ifndef __EMULATOR_USB_H__
+#define __EMULATOR_USB_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void *USB_HANDLE;
+
+#define CUSTOM_DEVICE_HID_EP 1
+
+#define USB_IN_ENABLED        0x01
+#define USB_OUT_ENABLED       0x02
+#define USB_HANDSHAKE_ENABLED 0x04
+#define USB_DISALLOW_SETUP    0x08
+
+void USBEnableEndpoint(uint8_t ep, uint8_t options);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __EMULATOR_USB_H__ */
@@ -0,0 +1,43 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __EMULATOR_USB_DEVICE_HID_H__
+#define __EMULATOR_USB_DEVICE_HID_H__
+
+#include "usb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Arm the endpoint with the buffer, returns handle of the transmission. */
+USB_HANDLE HIDTxPacket(uint8_t ep, uint8_t *data, uint16_t len);
+USB_HANDLE HIDRxPacket(uint8_t ep, uint8_t *data, uint16_t len);
+
+/* True while the transmission is not complete. */
+bool HIDTxHandleBusy(USB_HANDLE handle);
+bool HIDRxHandleBusy(USB_HANDLE handle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __EMULATOR_USB_DEVICE_HID_H__ */
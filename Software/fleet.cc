@@ -0,0 +1,188 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "fleet.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "device.h"
+
+namespace {
+
+struct Worker {
+  pid_t pid;
+  int fd;  /* Read end of the worker's stdout and stderr, -1 once closed. */
+  std::string output;
+  bool ok;
+};
+
+/* Body of the worker process, never returns. */
+void run_worker(const std::string &id,
+                int output_fd,
+                FleetCommand command,
+                int argc,
+                char **argv) {
+  dup2(output_fd, STDOUT_FILENO);
+  dup2(output_fd, STDERR_FILENO);
+  close(output_fd);
+  device_select(id.c_str());
+  bool ok = command(argc, argv);
+  fflush(stdout);
+  fflush(stderr);
+  _exit(ok ? 0 : 1);
+}
+
+int start_worker(const std::string &id,
+                 FleetCommand command,
+                 int argc,
+                 char **argv,
+                 Worker *worker) {
+  int fds[2];
+  if (pipe(fds) < 0) {
+    return -errno;
+  }
+  /* Make sure buffered output is not written twice. */
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid < 0) {
+    int r = -errno;
+    close(fds[0]);
+    close(fds[1]);
+    return r;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    run_worker(id, fds[1], command, argc, argv);
+  }
+  close(fds[1]);
+  worker->pid = pid;
+  worker->fd = fds[0];
+  worker->ok = false;
+  return 0;
+}
+
+/* Read available output, reap the worker once it closed its end. */
+void read_worker_output(Worker *worker) {
+  char buffer[4096];
+  ssize_t len = read(worker->fd, buffer, sizeof(buffer));
+  if (len > 0) {
+    worker->output.append(buffer, len);
+    return;
+  }
+  if (len < 0 && errno == EINTR) {
+    return;
+  }
+  close(worker->fd);
+  worker->fd = -1;
+  int status;
+  while (waitpid(worker->pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  worker->ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void print_worker_output(const std::string &id, const Worker &worker) {
+  size_t start = 0;
+  while (start < worker.output.size()) {
+    size_t end = worker.output.find('\n', start);
+    if (end == std::string::npos) {
+      end = worker.output.size();
+    }
+    printf("%s: %.*s\n",
+           id.c_str(),
+           (int)(end - start),
+           worker.output.c_str() + start);
+    start = end + 1;
+  }
+  if (!worker.ok) {
+    printf("%s: FAILED\n", id.c_str());
+  }
+}
+
+}  /* namespace */
+
+int fleet_run(const std::vector<std::string> &ids,
+              int max_jobs,
+              FleetCommand command,
+              int argc,
+              char **argv) {
+  std::vector<Worker> workers(ids.size());
+  size_t num_started = 0, num_printed = 0;
+  int num_running = 0, num_failed = 0;
+  while (num_printed < ids.size()) {
+    while (num_running < max_jobs && num_started < ids.size()) {
+      Worker *worker = &workers[num_started];
+      int r = start_worker(ids[num_started], command, argc, argv, worker);
+      if (r < 0) {
+        fprintf(stderr, "Failed to start worker for %s: %s\n",
+                ids[num_started].c_str(), strerror(-r));
+        worker->pid = -1;
+        worker->fd = -1;
+        worker->ok = false;
+      } else {
+        ++num_running;
+      }
+      ++num_started;
+    }
+    /* Results are printed in order as soon as all the boards before are
+     * done.
+     */
+    while (num_printed < num_started && workers[num_printed].fd < 0) {
+      print_worker_output(ids[num_printed], workers[num_printed]);
+      if (!workers[num_printed].ok) {
+        ++num_failed;
+      }
+      ++num_printed;
+    }
+    if (num_running == 0) {
+      continue;
+    }
+    std::vector<pollfd> fds;
+    std::vector<Worker *> polled;
+    for (size_t i = num_printed; i < num_started; ++i) {
+      if (workers[i].fd >= 0) {
+        fds.push_back((pollfd){workers[i].fd, POLLIN, 0});
+        polled.push_back(&workers[i]);
+      }
+    }
+    if (poll(&fds[0], fds.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    for (size_t i = 0; i < fds.size(); ++i) {
+      if (fds[i].revents != 0) {
+        read_worker_output(polled[i]);
+        if (polled[i]->fd < 0) {
+          --num_running;
+        }
+      }
+    }
+  }
+  fflush(stdout);
+  return num_failed;
+}
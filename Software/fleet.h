@@ -0,0 +1,47 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __FLEET_H__
+#define __FLEET_H__
+
+#include <string>
+#include <vector>
+
+/* Command which is run on a single board, it's selected with
+ * device_select() and the command opens it.
+ */
+typedef bool (*FleetCommand)(int argc, char **argv);
+
+/* Run the command on all the boards in parallel.
+ *
+ * Every board is served by its own worker process which selects it and runs
+ * the command, at most max_jobs workers run at once. Output of the workers
+ * is printed in the order of the boards, every line is prefixed with the
+ * board identifier.
+ * Returns number of boards the command failed on, or negative errno.
+ */
+int fleet_run(const std::vector<std::string> &ids,
+              int max_jobs,
+              FleetCommand command,
+              int argc,
+              char **argv);
+
+#endif  /* __FLEET_H__ */
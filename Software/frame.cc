@@ -0,0 +1,112 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "frame.h"
+
+#include <string.h>
+
+namespace {
+
+/* Number of argument bytes the command actually uses. */
+int command_args_size(const unsigned char report[PACKET_INT_LEN]) {
+  switch (report[0]) {
+    case COMMAND_SWITCH_PRESS:
+    case COMMAND_CFG_SET_AUTOBOOT:
+      return 2;
+    case COMMAND_CFG_SET_IP:
+      return 4;
+    case COMMAND_CFG_SET_MAC:
+      return 6;
+    case COMMAND_CFG_SET_PC_NAME:
+      return 1 + strnlen((const char *)report + 2, PC_MAX_NAME);
+    case COMMAND_CFG_GET_AUTOBOOT:
+    case COMMAND_CFG_GET_PC_NAME:
+      return 1;
+  }
+  return 0;
+}
+
+/* Find record with the given index, returns its offset in the buffer. */
+int frame_find_record(const Frame *frame, int index) {
+  int pos = 1;
+  for (int i = 0; i < index; ++i) {
+    pos += FRAME_RECORD_HEADER_SIZE + frame->buffer[pos + 1];
+  }
+  return pos;
+}
+
+}  /* namespace */
+
+void frame_init(Frame *frame) {
+  memset(frame, 0, sizeof(*frame));
+  frame->buffer[0] = COMMAND_FRAME;
+  frame->size = 1;
+  frame->num_commands = 0;
+}
+
+bool frame_add_report(Frame *frame,
+                      const unsigned char report[PACKET_INT_LEN]) {
+  int args_size = command_args_size(report);
+  if (frame->size + FRAME_RECORD_HEADER_SIZE + args_size > FRAME_MAX_SIZE) {
+    return false;
+  }
+  unsigned char *record = frame->buffer + frame->size;
+  record[0] = report[0];
+  record[1] = args_size;
+  memcpy(record + FRAME_RECORD_HEADER_SIZE, report + 1, args_size);
+  frame->size += FRAME_RECORD_HEADER_SIZE + args_size;
+  ++frame->num_commands;
+  return true;
+}
+
+void frame_get_report(const Frame *frame,
+                      int index,
+                      unsigned char report[PACKET_INT_LEN]) {
+  const unsigned char *record = frame->buffer + frame_find_record(frame, index);
+  memset(report, 0, PACKET_INT_LEN);
+  report[0] = record[0];
+  memcpy(report + 1, record + FRAME_RECORD_HEADER_SIZE, record[1]);
+}
+
+int frame_parse_answer(const unsigned char answer[PACKET_INT_LEN],
+                       FrameResult *results,
+                       int max_results) {
+  int num_results = answer[0];
+  if (num_results > max_results) {
+    return -1;
+  }
+  int pos = 1;
+  for (int i = 0; i < num_results; ++i) {
+    if (pos + FRAME_ANSWER_HEADER_SIZE > FRAME_MAX_SIZE) {
+      return -1;
+    }
+    const unsigned char *record = answer + pos;
+    if (pos + FRAME_ANSWER_HEADER_SIZE + record[2] > FRAME_MAX_SIZE) {
+      return -1;
+    }
+    results[i].command = record[0];
+    results[i].status = record[1];
+    results[i].answer = record + FRAME_ANSWER_HEADER_SIZE;
+    results[i].answer_len = record[2];
+    pos += FRAME_ANSWER_HEADER_SIZE + record[2];
+  }
+  return num_results;
+}
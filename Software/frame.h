@@ -0,0 +1,72 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include "protocol.h"
+
+/* Several commands packed into a single COMMAND_FRAME report.
+ *
+ * Every command is stored as <command> <length> <arguments>, see
+ * app_device_custom_hid.c for the details.
+ */
+struct Frame {
+  unsigned char buffer[PACKET_INT_LEN];
+  int size;
+  int num_commands;
+};
+
+/* Answer to a single command from the frame. */
+struct FrameResult {
+  int command;
+  int status;
+  const unsigned char *answer;
+  int answer_len;
+};
+
+const int FRAME_RECORD_HEADER_SIZE = 2;
+const int FRAME_ANSWER_HEADER_SIZE = 3;
+/* Frame can't overlap the request ID. */
+const int FRAME_MAX_SIZE = REQUEST_ID_OFFSET;
+
+void frame_init(Frame *frame);
+
+/* Append command from the regular single-command report.
+ * Returns false if there's no space left in the frame.
+ */
+bool frame_add_report(Frame *frame, const unsigned char report[PACKET_INT_LEN]);
+
+/* Convert command with the given index back to a single-command report,
+ * used with firmware which doesn't support frames.
+ */
+void frame_get_report(const Frame *frame,
+                      int index,
+                      unsigned char report[PACKET_INT_LEN]);
+
+/* Parse answer to the frame, returns number of results or -1 if the
+ * answer is malformed.
+ */
+int frame_parse_answer(const unsigned char answer[PACKET_INT_LEN],
+                       FrameResult *results,
+                       int max_results);
+
+#endif  /* __FRAME_H__ */
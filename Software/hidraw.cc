@@ -0,0 +1,308 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "hidraw.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <linux/hidraw.h>
+
+#include <libusb.h>
+
+namespace {
+
+const char *SYSFS_HIDRAW_DIR = "/sys/class/hidraw";
+
+/* Value of the key from the uevent file of the hidraw's HID device. */
+std::string read_uevent_value(const std::string &uevent, const char *key) {
+  size_t key_len = strlen(key);
+  size_t start = 0;
+  while (start < uevent.size()) {
+    size_t end = uevent.find('\n', start);
+    if (end == std::string::npos) {
+      end = uevent.size();
+    }
+    if (uevent.compare(start, key_len, key) == 0 &&
+        uevent[start + key_len] == '=') {
+      return uevent.substr(start + key_len + 1, end - start - key_len - 1);
+    }
+    start = end + 1;
+  }
+  return "";
+}
+
+bool read_file(const std::string &path, std::string *r_contents) {
+  FILE *file = fopen(path.c_str(), "r");
+  if (file == NULL) {
+    return false;
+  }
+  char buffer[1024];
+  size_t len = fread(buffer, 1, sizeof(buffer), file);
+  fclose(file);
+  r_contents->assign(buffer, len);
+  return true;
+}
+
+/* "<bus>-<port>[.<port>...]" path of the USB device, which is the name of
+ * its sysfs directory. HID device lives in the directory of the interface
+ * ("<bus>-<ports>:<config>.<interface>").
+ */
+std::string get_port_path(const std::string &device_dir) {
+  char real_path[PATH_MAX];
+  if (realpath(device_dir.c_str(), real_path) == NULL) {
+    return "";
+  }
+  std::string interface_dir(real_path);
+  interface_dir.erase(interface_dir.rfind('/'));
+  std::string name = interface_dir.substr(interface_dir.rfind('/') + 1);
+  return name.substr(0, name.find(':'));
+}
+
+/* Same identifiers as device_list() gives. */
+std::string get_board_id(const std::string &device_dir,
+                         const std::string &uevent) {
+  std::string serial = read_uevent_value(uevent, "HID_UNIQ");
+  return serial.empty() ? get_port_path(device_dir) : serial;
+}
+
+int to_libusb_error(int error) {
+  switch (error) {
+    case ENODEV: return LIBUSB_ERROR_NO_DEVICE;
+    case ETIMEDOUT: return LIBUSB_ERROR_TIMEOUT;
+    case EACCES: return LIBUSB_ERROR_ACCESS;
+    default: return LIBUSB_ERROR_IO;
+  }
+}
+
+}  /* namespace */
+
+int hidraw_open_device(const std::string &id,
+                       std::string *r_path,
+                       std::string *r_id) {
+  DIR *dir = opendir(SYSFS_HIDRAW_DIR);
+  if (dir == NULL) {
+    return -errno;
+  }
+  char hid_id[32];
+  snprintf(hid_id, sizeof(hid_id), "%04X:%08X:%08X",
+           0x0003 /* BUS_USB */, VENDOR_ID, PRODUCT_ID);
+  int fd = -ENOENT;
+  while (dirent *entry = readdir(dir)) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    std::string device_dir =
+        std::string(SYSFS_HIDRAW_DIR) + "/" + entry->d_name + "/device";
+    std::string uevent;
+    if (!read_file(device_dir + "/uevent", &uevent) ||
+        read_uevent_value(uevent, "HID_ID") != hid_id) {
+      continue;
+    }
+    std::string board_id = get_board_id(device_dir, uevent);
+    if (!id.empty() && board_id != id) {
+      continue;
+    }
+    std::string path = std::string("/dev/") + entry->d_name;
+    fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+      fd = -errno;
+      continue;
+    }
+    if (r_path != NULL) {
+      *r_path = path;
+    }
+    if (r_id != NULL) {
+      *r_id = board_id;
+    }
+    break;
+  }
+  closedir(dir);
+  return fd;
+}
+
+int hidraw_open_path(const char *path, const std::string &id) {
+  int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+  hidraw_devinfo info;
+  struct stat st;
+  if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0 ||
+      (uint16_t)info.vendor != VENDOR_ID ||
+      (uint16_t)info.product != PRODUCT_ID ||
+      fstat(fd, &st) < 0) {
+    close(fd);
+    return -ENODEV;
+  }
+  /* Node might have been given to another board after renumbering. */
+  char device_dir[64];
+  snprintf(device_dir, sizeof(device_dir), "/sys/dev/char/%u:%u/device",
+           major(st.st_rdev), minor(st.st_rdev));
+  std::string uevent;
+  if (!read_file(std::string(device_dir) + "/uevent", &uevent) ||
+      get_board_id(device_dir, uevent) != id) {
+    close(fd);
+    return -ENODEV;
+  }
+  return fd;
+}
+
+HidrawTransport::HidrawTransport(int fd)
+    : fd_(fd),
+      wakeup_fd_(-1),
+      report_callback_(NULL),
+      report_callback_data_(NULL),
+      device_gone_callback_(NULL),
+      device_gone_callback_data_(NULL),
+      stopping_(false),
+      device_gone_(false) {
+}
+
+HidrawTransport::~HidrawTransport() {
+  stop();
+  close(fd_);
+}
+
+void HidrawTransport::set_report_callback(ReportCallback callback,
+                                          void *user_data) {
+  report_callback_ = callback;
+  report_callback_data_ = user_data;
+}
+
+void HidrawTransport::set_device_gone_callback(DeviceGoneCallback callback,
+                                               void *user_data) {
+  device_gone_callback_ = callback;
+  device_gone_callback_data_ = user_data;
+}
+
+int HidrawTransport::start(void) {
+  wakeup_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wakeup_fd_ < 0) {
+    return LIBUSB_ERROR_NO_MEM;
+  }
+  read_thread_ = std::thread(&HidrawTransport::read_loop, this);
+  return 0;
+}
+
+void HidrawTransport::stop(void) {
+  if (read_thread_.joinable()) {
+    stopping_ = true;
+    uint64_t value = 1;
+    if (write(wakeup_fd_, &value, sizeof(value)) < 0) {
+      /* Counter can't overflow, so write only fails on a bad descriptor. */
+    }
+    read_thread_.join();
+  }
+  if (wakeup_fd_ >= 0) {
+    close(wakeup_fd_);
+    wakeup_fd_ = -1;
+  }
+}
+
+void HidrawTransport::mark_device_gone(void) {
+  if (!device_gone_.exchange(true) && device_gone_callback_ != NULL) {
+    device_gone_callback_(device_gone_callback_data_);
+  }
+}
+
+int HidrawTransport::submit_report(const unsigned char report[PACKET_INT_LEN],
+                                   int timeout_ms) {
+  if (device_gone_) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  unsigned char buffer[PACKET_INT_LEN + 1];
+  buffer[0] = 0;  /* Report number. */
+  memcpy(buffer + 1, report, PACKET_INT_LEN);
+  for (;;) {
+    if (write(fd_, buffer, sizeof(buffer)) == (ssize_t)sizeof(buffer)) {
+      return 0;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN) {
+      int r = to_libusb_error(errno);
+      if (r == LIBUSB_ERROR_NO_DEVICE) {
+        mark_device_gone();
+      }
+      return r;
+    }
+    pollfd pfd = {fd_, POLLOUT, 0};
+    int n = poll(&pfd, 1, timeout_ms);
+    if (n == 0) {
+      return LIBUSB_ERROR_TIMEOUT;
+    }
+  }
+}
+
+int HidrawTransport::send_report(const unsigned char report[PACKET_INT_LEN],
+                                 int timeout_ms) {
+  /* Kernel has taken the report once write() returns. */
+  return submit_report(report, timeout_ms);
+}
+
+bool HidrawTransport::is_device_gone(void) {
+  return device_gone_;
+}
+
+void HidrawTransport::read_loop(void) {
+  pollfd fds[2] = {{fd_, POLLIN, 0}, {wakeup_fd_, POLLIN, 0}};
+  while (!stopping_) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (fds[1].revents != 0) {
+      continue;
+    }
+    if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+      mark_device_gone();
+      break;
+    }
+    unsigned char report[PACKET_INT_LEN] = {0};
+    ssize_t len = read(fd_, report, sizeof(report));
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        continue;
+      }
+      mark_device_gone();
+      break;
+    }
+    /* Short reports are padded with zeros, same as with libusb. */
+    if (len > 0 && report_callback_ != NULL) {
+      report_callback_(report, report_callback_data_);
+    }
+  }
+}
@@ -0,0 +1,86 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __HIDRAW_H__
+#define __HIDRAW_H__
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "transport.h"
+
+/* Find hidraw node of the board by looking for its VID/PID in sysfs and
+ * open it. Board is matched by its identifier (see device_list()), the
+ * first one is used when id is empty. No libusb initialization is needed
+ * and the kernel HID driver stays attached.
+ * Returns descriptor or negative errno, path of the node and identifier of
+ * the board are stored in r_path and r_id.
+ */
+int hidraw_open_device(const std::string &id,
+                       std::string *r_path,
+                       std::string *r_id);
+
+/* Open the node if it's still the board with the identifier, -ENODEV when
+ * it's some other device now.
+ */
+int hidraw_open_path(const char *path, const std::string &id);
+
+/* Transport which reads and writes reports of the /dev/hidrawN node.
+ *
+ * Reports are written with a leading report number, which is 0 as the
+ * board doesn't use numbered reports. IN reports are read by a thread
+ * which polls the non-blocking descriptor.
+ */
+class HidrawTransport : public Transport {
+ public:
+  /* Takes ownership of the descriptor from hidraw_open_device(). */
+  explicit HidrawTransport(int fd);
+  ~HidrawTransport();
+
+  void set_report_callback(ReportCallback callback, void *user_data);
+  void set_device_gone_callback(DeviceGoneCallback callback, void *user_data);
+
+  int start(void);
+  void stop(void);
+
+  int submit_report(const unsigned char report[PACKET_INT_LEN],
+                    int timeout_ms);
+  int send_report(const unsigned char report[PACKET_INT_LEN], int timeout_ms);
+
+  bool is_device_gone(void);
+
+ protected:
+  void read_loop(void);
+  void mark_device_gone(void);
+
+  int fd_;
+  int wakeup_fd_;
+  ReportCallback report_callback_;
+  void *report_callback_data_;
+  DeviceGoneCallback device_gone_callback_;
+  void *device_gone_callback_data_;
+  std::thread read_thread_;
+  std::atomic<bool> stopping_;
+  std::atomic<bool> device_gone_;
+};
+
+#endif  /* __HIDRAW_H__ */
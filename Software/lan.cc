@@ -0,0 +1,488 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "lan.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const int MAX_EVENTS = 256;
+/* Replies of the firmware fit into a single packet, anything much bigger
+ * is not from the board.
+ */
+const size_t MAX_REPLY_SIZE = 64 * 1024;
+const size_t MAX_REQUEST_SIZE = 4096;
+/* How often lan_serve() checks whether it's asked to stop. */
+const int SERVE_STOP_CHECK_MS = 100;
+
+struct Connection {
+  size_t index;
+  int fd;
+  bool connected;
+  std::string request;
+  size_t sent;
+  std::string reply;
+  Clock::time_point start_time;
+  Clock::time_point deadline;
+};
+
+double elapsed_ms(Clock::time_point start_time) {
+  return std::chrono::duration<double, std::milli>(
+      Clock::now() - start_time).count();
+}
+
+/* Text between the marker and the terminator which follows it, the
+ * position is moved past the terminator.
+ */
+bool find_field(const std::string &page,
+                const char *marker,
+                const char *terminator,
+                size_t *position,
+                std::string *r_value) {
+  size_t start = page.find(marker, *position);
+  if (start == std::string::npos) {
+    return false;
+  }
+  start += strlen(marker);
+  size_t end = page.find(terminator, start);
+  if (end == std::string::npos) {
+    return false;
+  }
+  r_value->assign(page, start, end - start);
+  *position = end + strlen(terminator);
+  return true;
+}
+
+/* Page is made by print_webpage() in app_network.c, every computer has a
+ * "Name: " span followed by a "Status: " div.
+ */
+int parse_status_page(const std::string &page, LanResult *result) {
+  size_t position = 0;
+  std::string name, status;
+  while (result->num_pcs < NUM_PCS &&
+         find_field(page, "<span>Name: ", "</span>", &position, &name) &&
+         find_field(page, "<div>Status: ", "</div>", &position, &status)) {
+    int pc = result->num_pcs++;
+    snprintf(result->pcs[pc].name, sizeof(result->pcs[pc].name),
+             "%.*s", PC_MAX_NAME, name.c_str());
+    result->pcs[pc].status = 0;
+    if (status.find(">ON<") != std::string::npos) {
+      result->pcs[pc].status |= PC_STATUS_ON;
+    }
+    if (status.find("WILL_PRESS_BUTTON") != std::string::npos) {
+      result->pcs[pc].status |= PC_STATUS_WILL_PRESS;
+    }
+    if (status.find("BUTTON_PRESSED") != std::string::npos) {
+      result->pcs[pc].status |= PC_STATUS_PRESSED;
+    }
+  }
+  return result->num_pcs != 0 ? 0 : -EPROTO;
+}
+
+int parse_reply(const LanRequest &request,
+                const std::string &reply,
+                LanResult *result) {
+  int major, minor, status;
+  if (sscanf(reply.c_str(), "HTTP/%d.%d %d", &major, &minor, &status) != 3) {
+    return -EPROTO;
+  }
+  result->http_status = status;
+  if (request.action != LAN_STATUS) {
+    /* Board redirects back to the page once the press is scheduled. */
+    return status >= 200 && status < 400 ? 0 : -EPROTO;
+  }
+  if (status != 200) {
+    return -EPROTO;
+  }
+  size_t body = reply.find("\r\n\r\n");
+  if (body == std::string::npos) {
+    return -EPROTO;
+  }
+  return parse_status_page(reply.substr(body + 4), result);
+}
+
+bool is_reply_complete(const LanRequest &request, const std::string &reply) {
+  /* Redirects have no body, status page is complete once the board closes
+   * the connection.
+   */
+  return request.action != LAN_STATUS &&
+         reply.find("\r\n\r\n") != std::string::npos;
+}
+
+void format_request(const LanRequest &request, std::string *r_request) {
+  char buffer[64];
+  switch (request.action) {
+    case LAN_STATUS:
+      snprintf(buffer, sizeof(buffer), "GET / HTTP/1.0\r\n\r\n");
+      break;
+    case LAN_PRESS:
+      snprintf(buffer, sizeof(buffer), "GET /press/%d HTTP/1.0\r\n\r\n",
+               request.pc);
+      break;
+    case LAN_HOLD:
+      snprintf(buffer, sizeof(buffer), "GET /hold/%d HTTP/1.0\r\n\r\n",
+               request.pc);
+      break;
+  }
+  *r_request = buffer;
+}
+
+/* Start a non-blocking connection, the connection is registered for
+ * writability which tells when it's established.
+ */
+int start_connection(int epoll_fd,
+                     const LanRequest &request,
+                     int timeout_ms,
+                     Connection *connection) {
+  sockaddr_in address;
+  int r = lan_parse_address(request.address.c_str(), NULL,
+                            LAN_DEFAULT_PORT, &address);
+  if (r < 0) {
+    return r;
+  }
+  connection->fd = socket(AF_INET,
+                          SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (connection->fd < 0) {
+    return -errno;
+  }
+  connection->connected = false;
+  connection->sent = 0;
+  format_request(request, &connection->request);
+  connection->start_time = Clock::now();
+  connection->deadline = connection->start_time +
+                         std::chrono::milliseconds(timeout_ms);
+  if (connect(connection->fd, (sockaddr *)&address, sizeof(address)) < 0 &&
+      errno != EINPROGRESS) {
+    r = -errno;
+    close(connection->fd);
+    return r;
+  }
+  epoll_event event;
+  event.events = EPOLLOUT;
+  event.data.ptr = connection;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->fd, &event) < 0) {
+    r = -errno;
+    close(connection->fd);
+    return r;
+  }
+  return 0;
+}
+
+/* Move the connection forward. Returns 1 while it's still going, 0 once
+ * the reply is complete, or negative errno.
+ */
+int handle_connection(int epoll_fd,
+                      const LanRequest &request,
+                      Connection *connection) {
+  if (!connection->connected) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (error != 0) {
+      return -error;
+    }
+    connection->connected = true;
+  }
+  if (connection->sent < connection->request.size()) {
+    ssize_t len = send(connection->fd,
+                       connection->request.data() + connection->sent,
+                       connection->request.size() - connection->sent,
+                       MSG_NOSIGNAL);
+    if (len < 0) {
+      return errno == EAGAIN || errno == EINTR ? 1 : -errno;
+    }
+    connection->sent += len;
+    if (connection->sent == connection->request.size()) {
+      epoll_event event;
+      event.events = EPOLLIN;
+      event.data.ptr = connection;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+    }
+    return 1;
+  }
+  for (;;) {
+    char buffer[4096];
+    ssize_t len = recv(connection->fd, buffer, sizeof(buffer), 0);
+    if (len == 0) {
+      return 0;
+    }
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        return is_reply_complete(request, connection->reply) ? 0 : 1;
+      }
+      return -errno;
+    }
+    connection->reply.append(buffer, len);
+    if (connection->reply.size() > MAX_REPLY_SIZE) {
+      return -EPROTO;
+    }
+  }
+}
+
+struct Client {
+  std::string request;
+  std::string response;
+  size_t sent;
+};
+
+/* Read the request and answer it once its headers are complete. Returns
+ * true when the client is to be closed.
+ */
+bool serve_client(int epoll_fd,
+                  int fd,
+                  Client *client,
+                  LanHandler handler,
+                  void *user_data) {
+  if (client->response.empty()) {
+    char buffer[1024];
+    ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+    if (len < 0) {
+      return errno != EAGAIN && errno != EINTR;
+    }
+    client->request.append(buffer, len);
+    if (len != 0 &&
+        client->request.find("\r\n\r\n") == std::string::npos &&
+        client->request.size() < MAX_REQUEST_SIZE) {
+      return false;
+    }
+    client->response = handler(client->request, user_data);
+    client->sent = 0;
+    epoll_event event;
+    event.events = EPOLLOUT;
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+  }
+  ssize_t len = send(fd, client->response.data() + client->sent,
+                     client->response.size() - client->sent, MSG_NOSIGNAL);
+  if (len < 0) {
+    return errno != EAGAIN && errno != EINTR;
+  }
+  client->sent += len;
+  return client->sent == client->response.size();
+}
+
+}  /* namespace */
+
+int lan_parse_address(const char *address,
+                      const char *default_host,
+                      int default_port,
+                      sockaddr_in *r_address) {
+  std::string host = default_host != NULL ? default_host : "";
+  int port = default_port;
+  const char *colon = strrchr(address, ':');
+  if (colon != NULL) {
+    host.assign(address, colon - address);
+    port = atoi(colon + 1);
+  } else if (strchr(address, '.') != NULL) {
+    host = address;
+  } else {
+    port = atoi(address);
+  }
+  memset(r_address, 0, sizeof(*r_address));
+  r_address->sin_family = AF_INET;
+  r_address->sin_port = htons(port);
+  if (inet_pton(AF_INET, host.c_str(), &r_address->sin_addr) != 1 ||
+      port <= 0 || port > 65535) {
+    return -EINVAL;
+  }
+  return 0;
+}
+
+int lan_run(const std::vector<LanRequest> &requests,
+            int max_connections,
+            int timeout_ms,
+            std::vector<LanResult> *r_results) {
+  r_results->assign(requests.size(), LanResult());
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    return -errno;
+  }
+  std::vector<std::unique_ptr<Connection> > active;
+  size_t next = 0;
+  int num_failed = 0;
+  while (next < requests.size() || !active.empty()) {
+    while (next < requests.size() && (int)active.size() < max_connections) {
+      std::unique_ptr<Connection> connection(new Connection());
+      connection->index = next;
+      int r = start_connection(epoll_fd, requests[next], timeout_ms,
+                               connection.get());
+      if (r < 0) {
+        (*r_results)[next].result = r;
+        ++num_failed;
+      } else {
+        active.push_back(std::move(connection));
+      }
+      ++next;
+    }
+    if (active.empty()) {
+      break;
+    }
+
+    Clock::time_point deadline = active[0]->deadline;
+    for (size_t i = 1; i < active.size(); ++i) {
+      deadline = std::min(deadline, active[i]->deadline);
+    }
+    int wait_ms = std::chrono::ceil<std::chrono::milliseconds>(
+        deadline - Clock::now()).count();
+    epoll_event events[MAX_EVENTS];
+    int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS,
+                                std::max(wait_ms, 0));
+    if (num_events < 0 && errno != EINTR) {
+      int r = -errno;
+      close(epoll_fd);
+      return r;
+    }
+
+    /* Finished connections are dropped below, together with the ones
+     * whose deadline passed.
+     */
+    for (int i = 0; i < num_events; ++i) {
+      Connection *connection = (Connection *)events[i].data.ptr;
+      const LanRequest &request = requests[connection->index];
+      LanResult *result = &(*r_results)[connection->index];
+      int r = handle_connection(epoll_fd, request, connection);
+      result->sent = connection->sent == connection->request.size();
+      if (r == 1) {
+        continue;
+      }
+      if (r == 0) {
+        r = parse_reply(request, connection->reply, result);
+      }
+      result->result = r;
+      result->latency_ms = elapsed_ms(connection->start_time);
+      close(connection->fd);
+      connection->fd = -1;
+    }
+    Clock::time_point now = Clock::now();
+    for (size_t i = 0; i < active.size();) {
+      Connection *connection = active[i].get();
+      if (connection->fd >= 0 && connection->deadline <= now) {
+        LanResult *result = &(*r_results)[connection->index];
+        result->result = -ETIMEDOUT;
+        result->latency_ms = elapsed_ms(connection->start_time);
+        close(connection->fd);
+        connection->fd = -1;
+      }
+      if (connection->fd < 0) {
+        if ((*r_results)[connection->index].result < 0) {
+          ++num_failed;
+        }
+        active[i] = std::move(active.back());
+        active.pop_back();
+      } else {
+        ++i;
+      }
+    }
+  }
+  close(epoll_fd);
+  return num_failed;
+}
+
+int lan_listen(const char *address, const char *default_host) {
+  sockaddr_in socket_address;
+  if (lan_parse_address(address, default_host, 0, &socket_address) < 0) {
+    return -EINVAL;
+  }
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -errno;
+  }
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (bind(fd, (sockaddr *)&socket_address, sizeof(socket_address)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    int r = -errno;
+    close(fd);
+    return r;
+  }
+  return fd;
+}
+
+int lan_serve(int listen_fd,
+              LanHandler handler,
+              void *user_data,
+              volatile sig_atomic_t *stop) {
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    return -errno;
+  }
+  /* Connections are accepted until there are no more pending. */
+  fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = listen_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+  std::map<int, Client> clients;
+  int r = 0;
+  while (!*stop) {
+    epoll_event events[MAX_EVENTS];
+    int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS,
+                                SERVE_STOP_CHECK_MS);
+    if (num_events < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      r = -errno;
+      break;
+    }
+    for (int i = 0; i < num_events; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == listen_fd) {
+        int client_fd;
+        while ((client_fd = accept4(listen_fd, NULL, NULL,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+          event.events = EPOLLIN;
+          event.data.fd = client_fd;
+          epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+          clients[client_fd] = Client();
+        }
+        continue;
+      }
+      if (serve_client(epoll_fd, fd, &clients[fd], handler, user_data)) {
+        close(fd);
+        clients.erase(fd);
+      }
+    }
+  }
+  for (std::map<int, Client>::iterator it = clients.begin();
+       it != clients.end();
+       ++it) {
+    close(it->first);
+  }
+  close(epoll_fd);
+  return r;
+}
@@ -0,0 +1,119 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __LAN_H__
+#define __LAN_H__
+
+#include <netinet/in.h>
+#include <signal.h>
+
+#include <string>
+#include <vector>
+
+#include "protocol.h"
+
+/* Control of the boards over their web interface (APP_network_loop()), so
+ * a whole rack can be driven from one host without a USB cable to every
+ * board.
+ *
+ * All the requests are run by a single thread in one epoll loop, every
+ * request has its own deadline counted from the moment it's started.
+ */
+
+/* Port the board's web server listens on. */
+#define LAN_DEFAULT_PORT 80
+
+enum LanAction {
+  /* Fetch the page with the status of the computers. */
+  LAN_STATUS,
+  /* Same as the links on the page. */
+  LAN_PRESS,
+  LAN_HOLD,
+};
+
+struct LanRequest {
+  /* <ip>[:<port>] of the board. */
+  std::string address;
+  LanAction action;
+  int pc;
+};
+
+struct LanResult {
+  /* 0 or negative errno: -ETIMEDOUT when the deadline passed, -EPROTO when
+   * the reply is not understood.
+   */
+  int result;
+  /* Whole request was written out, the board might have acted on it even
+   * when the reply didn't come.
+   */
+  bool sent;
+  /* Status code of the reply, zero when there was none. */
+  int http_status;
+  /* From the start of the connection to the complete reply. */
+  double latency_ms;
+  /* Only known for LAN_STATUS, names are not terminated by the firmware
+   * so they're cut to PC_MAX_NAME.
+   */
+  int num_pcs;
+  struct {
+    unsigned char status;
+    char name[PC_MAX_NAME + 1];
+  } pcs[NUM_PCS];
+};
+
+/* Parse [<host>:]<port> or <host>[:<port>], whichever part is missing is
+ * taken from the defaults. Returns 0 or -EINVAL.
+ */
+int lan_parse_address(const char *address,
+                      const char *default_host,
+                      int default_port,
+                      sockaddr_in *r_address);
+
+/* Run the requests with at most max_connections of them at once, results
+ * are stored in the order of requests.
+ * Returns number of failed requests, or negative errno.
+ */
+int lan_run(const std::vector<LanRequest> &requests,
+            int max_connections,
+            int timeout_ms,
+            std::vector<LanResult> *r_results);
+
+/* Listening TCP socket on the address, see lan_parse_address().
+ * Returns the descriptor or negative errno.
+ */
+int lan_listen(const char *address, const char *default_host);
+
+/* Full HTTP response to the request, which is everything received up to
+ * the end of its headers.
+ */
+typedef std::string (*LanHandler)(const std::string &request,
+                                  void *user_data);
+
+/* Stand-in for the board's web server: answers every connection with the
+ * handler's response and closes it, the same way the firmware does.
+ * Runs until stop is set. Returns 0 or negative errno.
+ */
+int lan_serve(int listen_fd,
+              LanHandler handler,
+              void *user_data,
+              volatile sig_atomic_t *stop);
+
+#endif  /* __LAN_H__ */
@@ -19,201 +19,200 @@
  * IN THE SOFTWARE.
  */
 
+#include <ctype.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
-#include <libusb.h>
-
-// #define VERSION "0.1.0"
-#define VENDOR_ID 0x04d8
-#define PRODUCT_ID 0x003f
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
 
-#define COMMAND_TEST             0x80
-#define COMMAND_SWITCH_PRESS     0x81
-#define COMMAND_CFG_SET_AUTOBOOT 0x82
-#define COMMAND_CFG_SET_IP       0x83
-#define COMMAND_CFG_SET_MAC      0x84
-#define COMMAND_CFG_SET_PC_NAME  0x85
-#define COMMAND_CFG_GET_AUTOBOOT 0x86
-#define COMMAND_CFG_GET_IP       0x87
-#define COMMAND_CFG_GET_MAC      0x88
-#define COMMAND_GET_STATUS       0x89
-#define COMMAND_CFG_GET_PC_NAME  0x90
+#include <libusb.h>
 
-#define NUM_PCS 2
+#include "async_board.h"
+#include "bench.h"
+#include "capture.h"
+#include "daemon.h"
+#include "device.h"
+#include "emulator.h"
+#include "fleet.h"
+#include "lan.h"
+#include "multipath.h"
+#include "pcremote.h"
+#include "protocol.h"
+#include "provision.h"
+#include "status_cache.h"
 
 namespace {
 
-const int PACKET_INT_LEN = 64;
-const int INTERFACE = 0;
-const int ENDPOINT_INT_IN = 0x81; /* endpoint 0x81 address for IN */
-const int ENDPOINT_INT_OUT = 0x01; /* endpoint 1 address for OUT */
-const int TIMEOUT = 5000; /* timeout in ms */
-
-static libusb_device_handle *devh = NULL;
-static libusb_context *ctx = NULL;
-
-int find_lvr_hidusb(void) {
-  devh = libusb_open_device_with_vid_pid(ctx, VENDOR_ID, PRODUCT_ID);
-  return devh ? 0 : -EIO;
-}
-
-int send_buffer(unsigned char buffer[PACKET_INT_LEN]) {
-  int transferred;
-  int r = libusb_interrupt_transfer(devh,
-                                    ENDPOINT_INT_OUT,
-                                    buffer,
-                                    PACKET_INT_LEN,
-                                    &transferred,
-                                    TIMEOUT);
-  if (r < 0) {
-    fprintf(stderr, "Interrupt write error %s\n", libusb_error_name(r));
-    return r;
-  }
-  return 0;
-}
-
-int send_command(int command,
-                 int arg,
-                 const char *data,
-                 int len) {
-  unsigned char buffer[PACKET_INT_LEN] = {0};
-  buffer[0] = command;
-  buffer[1] = arg;
-  memcpy(buffer + 2, data, len);
-  send_buffer(buffer);
-  return 0;
-}
-
-int send_command(int command,
-                 int arg1 = 0,
-                 int arg2 = 0,
-                 int arg3 = 0,
-                 int arg4 = 0,
-                 int arg5 = 0,
-                 int arg6 = 0) {
-  unsigned char buffer[PACKET_INT_LEN] = {0};
-  buffer[0] = command;
-  buffer[1] = arg1;
-  buffer[2] = arg2;
-  buffer[3] = arg3;
-  buffer[4] = arg4;
-  buffer[5] = arg5;
-  buffer[6] = arg6;
-  return send_buffer(buffer);
-}
-
-int read_answer(unsigned char *buffer) {
-  int r, transferred;
-  r = libusb_interrupt_transfer(devh,
-                                ENDPOINT_INT_IN,
-                                buffer,
-                                PACKET_INT_LEN,
-                                &transferred,
-                                TIMEOUT);
-  if (r < 0) {
-    fprintf(stderr, "Interrupt read error %s\n", libusb_error_name(r));
-    return r;
-  }
-  return 0;
-}
-
-void send_test_command(void) {
-  send_command(COMMAND_TEST);
-}
-
-void send_press_command(int pc, bool force) {
-  send_command(COMMAND_SWITCH_PRESS, pc, force ? 1 : 0);
-}
-
-void send_set_ip_command(const unsigned char ip[4]) {
-  send_command(COMMAND_CFG_SET_IP, ip[0], ip[1], ip[2], ip[3]);
-}
+/* Board all the commands are run on. */
+Device board;
 
-void send_set_mac_command(const unsigned char mac[6]) {
-  send_command(COMMAND_CFG_SET_MAC,
-               mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-}
-
-void send_set_autoboot_command(int pc, bool enabled) {
-  send_command(COMMAND_CFG_SET_AUTOBOOT, pc, enabled ? 1 : 0);
-}
-
-void send_set_name_command(int pc, const char *name) {
-  send_command(COMMAND_CFG_SET_PC_NAME, pc, name, strlen(name));
-}
+/* Traffic of the board is recorded there, see --capture. */
+CaptureWriter capture_writer;
 
-void send_get_ip_command(void) {
-  send_command(COMMAND_CFG_GET_IP);
-}
+/* Same board over its web interface, see --lan. */
+bool use_paths = false;
+MultipathBoard paths;
 
-void retrieve_ip(unsigned char ip[4]) {
-  unsigned char buffer[64];
-  read_answer(buffer);
-  memcpy(ip, buffer, 4);
-}
+/* Output of the commands goes to stdout and their errors to stderr,
+ * unless OutputCapture collects both.
+ */
+std::string *captured_output = NULL;
 
-void send_get_mac_command(void) {
-  send_command(COMMAND_CFG_GET_MAC);
+void print_to(FILE *stream, const char *format, va_list args) {
+  if (captured_output == NULL) {
+    vfprintf(stream, format, args);
+    return;
+  }
+  char *text;
+  int len = vasprintf(&text, format, args);
+  if (len >= 0) {
+    captured_output->append(text, len);
+    free(text);
+  }
 }
 
-void retrieve_mac(unsigned char mac[6]) {
-  unsigned char buffer[64];
-  read_answer(buffer);
-  memcpy(mac, buffer, 6);
+void output(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  print_to(stdout, format, args);
+  va_end(args);
 }
 
-void send_get_status_command(void) {
-  send_command(COMMAND_GET_STATUS);
+void print_error(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  print_to(stderr, format, args);
+  va_end(args);
 }
 
-void retrieve_status(unsigned char buffer[64]) {
-  read_answer(buffer);
+/* Report failed library call, returns false in that case. */
+bool check_result(int r, const char *action) {
+  if (r < 0) {
+    print_error("Failed to %s: %s\n", action, libusb_error_name(r));
+    return false;
+  }
+  return true;
 }
 
-void send_get_autoboot_command(int pc) {
-  send_command(COMMAND_CFG_GET_AUTOBOOT, pc);
+bool check_pc_valid(int pc) {
+  return pc >= 0 && pc < NUM_PCS;
 }
 
-bool retrieve_autoboot(void) {
-  unsigned char buffer[64];
-  read_answer(buffer);
-  return buffer[0] != 0;
+/* Commands which can take either path when the board is reachable over
+ * LAN too. Collected frames only go over USB.
+ */
+int press_switch(const PressRequest &request) {
+  if (use_paths && !board.is_collecting_frame()) {
+    return paths.press(request);
+  }
+  return board.press(request);
 }
 
-void send_get_name_command(int pc) {
-  send_command(COMMAND_CFG_GET_PC_NAME, pc);
+int get_board_status(StatusAnswer *r_answer) {
+  return use_paths ? paths.get_status(r_answer) : board.get_status(r_answer);
 }
 
-void retrieve_name(unsigned char name[64]) {
-  read_answer(name);
+/* Press the switch and wait until the computer is on or off, reporting
+ * how long it took.
+ */
+bool press_and_wait(const PressRequest &request, bool on, double timeout) {
+  const char *state = on ? "on" : "off";
+  StatusAnswer status;
+  if (!check_result(get_board_status(&status), "get status")) {
+    return false;
+  }
+  /* Pressing would only turn it the other way. */
+  if (((status.status[request.pc] & PC_STATUS_ON) != 0) == on) {
+    output("Computer %d is already %s\n", request.pc, state);
+    return true;
+  }
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  if (!check_result(press_switch(request), "press the switch")) {
+    return false;
+  }
+  Executor executor;
+  AsyncBoard async_board(&executor);
+  int r = 0;
+  executor.spawn(async_board.wait_state(request.pc,
+                                        PC_STATUS_ON,
+                                        on ? PC_STATUS_ON : 0,
+                                        (int)(timeout * 1000.0)),
+                 &r);
+  executor.run();
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  if (r == LIBUSB_ERROR_TIMEOUT) {
+    print_error("Computer %d is not %s after %.1f ms\n",
+                request.pc, state, elapsed.count());
+    return false;
+  } else if (!check_result(r, "wait for the computer")) {
+    return false;
+  }
+  output("Computer %d is %s after %.1f ms\n",
+         request.pc, state, elapsed.count());
+  return true;
 }
 
-bool check_pc_valid(int pc) {
-  return pc >= 0 && pc <= NUM_PCS;
-}
+/* Seconds to wait for the computer with press --wait by default. */
+const double PRESS_WAIT_TIMEOUT = 60.0;
 
 bool parse_press_command(int argc, char **argv) {
-  if ((argc != 3 && argc != 4) ||
-      (argc == 4 && strcmp(argv[3], "force") != 0)) {
-    printf("Usage: %s press <pc> [force]\n", argv[0]);
+  if (argc < 3) {
+    output("Usage: %s press <pc> [force] [--wait on|off] "
+           "[--timeout <seconds>]\n", argv[0]);
     return false;
   }
+  bool force = false, wait = false, wait_on = false;
+  double timeout = PRESS_WAIT_TIMEOUT;
+  for (int i = 3; i < argc; ++i) {
+    if (!strcmp(argv[i], "force")) {
+      force = true;
+    } else if (!strcmp(argv[i], "--wait") && i + 1 < argc &&
+               (!strcmp(argv[i + 1], "on") || !strcmp(argv[i + 1], "off"))) {
+      wait = true;
+      wait_on = !strcmp(argv[++i], "on");
+    } else if (!strcmp(argv[i], "--timeout") && i + 1 < argc) {
+      timeout = atof(argv[++i]);
+    } else {
+      output("Usage: %s press <pc> [force] [--wait on|off] "
+             "[--timeout <seconds>]\n", argv[0]);
+      return false;
+    }
+  }
   int pc = atoi(argv[2]);
   if (!check_pc_valid(pc)) {
-    fprintf(stderr, "Invalid PC number\n");
+    print_error("Invalid PC number\n");
     return false;
   }
-  bool force = argc == 4;
-  send_press_command(pc, force);
-  return true;
+  PressRequest request = {pc, force};
+  if (!wait) {
+    return check_result(press_switch(request), "press the switch");
+  }
+  if (board.is_collecting_frame()) {
+    print_error("press --wait can't be combined with other commands\n");
+    return false;
+  }
+  return press_and_wait(request, wait_on, timeout);
 }
 
 void parse_ip_addr(const char *value, unsigned char ip[4]) {
-  sscanf(value, "%d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3]);
+  int tip[4] = {0};
+  sscanf(value, "%d.%d.%d.%d", &tip[0], &tip[1], &tip[2], &tip[3]);
+  ip[0] = tip[0];
+  ip[1] = tip[1];
+  ip[2] = tip[2];
+  ip[3] = tip[3];
 }
 
 void parse_mac_addr(const char *value, unsigned char mac[6]) {
@@ -233,45 +232,42 @@ bool parse_set_global_command(int argc, char **argv) {
   const char *variable = argv[2];
   const char *value = argv[3];
   if (strcmp(variable, "ip") == 0) {
-    unsigned char ip[4];
-    parse_ip_addr(value, ip);
-    send_set_ip_command(ip);
+    SetIpRequest request;
+    parse_ip_addr(value, request.ip);
+    return check_result(board.set_ip(request), "set IP address");
   } else if (strcmp(variable, "mac") == 0) {
-    unsigned char mac[6];
-    parse_mac_addr(value, mac);
-    send_set_mac_command(mac);
-  } else {
-    printf("Unknown variable %s. "
-           "Supported variables are: ip, mac.\n", variable);
-    return false;
+    SetMacRequest request;
+    parse_mac_addr(value, request.mac);
+    return check_result(board.set_mac(request), "set MAC address");
   }
-  return true;
+  output("Unknown variable %s. "
+         "Supported variables are: ip, mac.\n", variable);
+  return false;
 }
 
 bool parse_set_pc_command(int argc, char **argv) {
   /* Number of arguments has been already checked by callee. */
   int pc = atoi(argv[2]);
   if (!check_pc_valid(pc)) {
-    fprintf(stderr, "Invalid PC number\n");
+    print_error("Invalid PC number\n");
     return false;
   }
   const char *variable = argv[3];
   const char *value = argv[4];
   if (strcmp(variable, "autoboot") == 0) {
     if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
-      printf("Unsupported value %s. Supported values: on, off\n", value);
+      output("Unsupported value %s. Supported values: on, off\n", value);
       return false;
     }
-    bool autoboot = strcmp(value, "on") == 0;
-    send_set_autoboot_command(pc, autoboot);
+    SetAutobootRequest request = {pc, strcmp(value, "on") == 0};
+    return check_result(board.set_autoboot(request), "set autoboot");
   } else if (strcmp(variable, "name") == 0) {
-    send_set_name_command(pc, value);
-  } else {
-    printf("Unknown variable %s. "
-           "Supported variables are: autoboot, name.\n", variable);
-    return false;
+    SetNameRequest request = {pc, value};
+    return check_result(board.set_name(request), "set computer name");
   }
-  return true;
+  output("Unknown variable %s. "
+         "Supported variables are: autoboot, name.\n", variable);
+  return false;
 }
 
 bool parse_set_command(int argc, char **argv) {
@@ -280,77 +276,154 @@ bool parse_set_command(int argc, char **argv) {
   } else if (argc == 5) {
     return parse_set_pc_command(argc, argv);
   }
-  printf("Usage: %s set [<pc>] <variable> <value>\n", argv[0]);
+  output("Usage: %s set [<pc>] <variable> <value>\n", argv[0]);
   return false;
 }
 
-void retrieve_and_print_ip(void) {
-  unsigned char ip[4];
-  send_get_ip_command();
-  retrieve_ip(ip);
-  printf("IP address: %d:%d:%d:%d\n",
-         ip[0], ip[1], ip[2], ip[3]);
+bool retrieve_and_print_ip(void) {
+  IpAnswer answer;
+  if (!check_result(board.get_ip(&answer), "get IP address")) {
+    return false;
+  }
+  output("IP address: %d:%d:%d:%d\n",
+         answer.ip[0], answer.ip[1], answer.ip[2], answer.ip[3]);
+  return true;
+}
+
+bool retrieve_and_print_mac(void) {
+  MacAnswer answer;
+  if (!check_result(board.get_mac(&answer), "get MAC address")) {
+    return false;
+  }
+  output("Mac address: %x:%x:%x:%x:%x:%x\n",
+         answer.mac[0], answer.mac[1], answer.mac[2],
+         answer.mac[3], answer.mac[4], answer.mac[5]);
+  return true;
+}
+
+void print_snapshot(const SnapshotAnswer &snapshot) {
+  output("IP address: %d:%d:%d:%d\n",
+         snapshot.ip[0], snapshot.ip[1], snapshot.ip[2], snapshot.ip[3]);
+  output("Mac address: %x:%x:%x:%x:%x:%x\n",
+         snapshot.mac[0], snapshot.mac[1], snapshot.mac[2],
+         snapshot.mac[3], snapshot.mac[4], snapshot.mac[5]);
+  output("Number of computers: %d\n", snapshot.num_pcs);
+  for (int i = 0; i < snapshot.num_pcs; ++i) {
+    output("  Computer %d:\n", i);
+    output("    Name: %s\n",  snapshot.pcs[i].name);
+    output("    Status: %d\n",  snapshot.pcs[i].status);
+    if (snapshot.has_autoboot) {
+      output("    Autoboot: %s\n",
+             snapshot.pcs[i].autoboot ? "enabled" : "disabled");
+    }
+  }
+}
+
+bool retrieve_and_print_status(void) {
+  SnapshotAnswer snapshot;
+  if (!check_result(board.get_snapshot(&snapshot), "get status")) {
+    return false;
+  }
+  print_snapshot(snapshot);
+  return true;
+}
+
+bool retrieve_and_print_capabilities(void) {
+  CapabilitiesAnswer capabilities;
+  if (!check_result(board.get_capabilities(&capabilities),
+                    "get capabilities")) {
+    return false;
+  }
+  if (capabilities.protocol_version == 0) {
+    output("Protocol version: legacy, optional commands are probed\n");
+  } else {
+    output("Protocol version: %d\n", capabilities.protocol_version);
+  }
+  output("Number of computers: %d\n", capabilities.num_pcs);
+  output("Maximum name length: %d\n", capabilities.max_name);
+  output("Report size: %d\n", capabilities.report_size);
+  output("Queued answers: %d\n", capabilities.queue_size);
+  output("Frame size: %d\n", capabilities.max_frame_size);
+  output("Commands:");
+  for (int command = COMMAND_FIRST; command <= COMMAND_LAST; ++command) {
+    if (capabilities_has_command(capabilities, command)) {
+      output(" 0x%02x", command);
+    }
+  }
+  output("\n");
+  return true;
 }
 
-void retrieve_and_print_mac(void) {
-  unsigned char mac[6];
-  send_get_mac_command();
-  retrieve_mac(mac);
-  printf("Mac address: %x:%x:%x:%x:%x:%x\n",
-         mac[0], mac[1], mac[2],
-         mac[3], mac[4], mac[5]);
+bool print_paths(void) {
+  if (!use_paths) {
+    output("Board is only reachable over USB, see --lan\n");
+    return true;
+  }
+  output("Preferred path: %s\n", board_path_name(paths.preferred_path()));
+  for (int i = 0; i < NUM_BOARD_PATHS; ++i) {
+    PathStats stats;
+    paths.path_stats((BoardPath)i, &stats);
+    if (!stats.configured) {
+      output("%s: not available\n", board_path_name((BoardPath)i));
+      continue;
+    }
+    output("%s: %s, %d requests, %d failures, %d failovers, "
+           "latency %.2f ms, last %.2f ms\n",
+           board_path_name((BoardPath)i),
+           stats.healthy ? "healthy" : "down",
+           stats.num_requests, stats.num_failures, stats.num_failovers,
+           stats.srtt_ms, stats.last_latency_ms);
+  }
+  return true;
 }
 
 bool parse_get_global_command(int argc, char **argv) {
   /* Number of arguments has been already checked by callee. */
   const char *variable = argv[2];
   if (strcmp(variable, "ip") == 0) {
-    retrieve_and_print_ip();
+    return retrieve_and_print_ip();
   } else if (strcmp(variable, "mac") == 0) {
-    retrieve_and_print_mac();
+    return retrieve_and_print_mac();
   } else if (strcmp(variable, "status") == 0) {
-    retrieve_and_print_ip();
-    retrieve_and_print_mac();
-    unsigned char buffer[64];
-    send_get_status_command();
-    retrieve_status(buffer);
-    printf("Number of computers: %d\n", buffer[0]);
-    for (int i = 0; i < buffer[0]; ++i) {
-      unsigned char name[64];
-      send_get_name_command(i);
-      retrieve_name(name);
-      printf("  Computer %d:\n", i);
-      printf("    Name: %s\n",  name);
-      printf("    Status: %d\n",  buffer[i + 1]);
-    }
-  } else {
-    printf("Unknown variable %s. "
-           "Supported variables are: ip, mac, status.\n", variable);
-    return false;
+    return retrieve_and_print_status();
+  } else if (strcmp(variable, "capabilities") == 0) {
+    return retrieve_and_print_capabilities();
+  } else if (strcmp(variable, "paths") == 0) {
+    return print_paths();
   }
-  return true;
+  output("Unknown variable %s. "
+         "Supported variables are: ip, mac, status, capabilities, paths.\n",
+         variable);
+  return false;
 }
 
 bool parse_get_pc_command(int argc, char **argv) {
   /* Number of arguments has been already checked by callee. */
   int pc = atoi(argv[2]);
   if (!check_pc_valid(pc)) {
-    fprintf(stderr, "Invalid PC number\n");
+    print_error("Invalid PC number\n");
     return false;
   }
   const char *variable = argv[3];
   if (strcmp(variable, "autoboot") == 0) {
-    send_get_autoboot_command(pc);
-    bool enabled = retrieve_autoboot();
-    printf("Computer %d: Autoboot is %s\n",
-           pc, enabled ? "disabled" : "enabled");
+    GetAutobootRequest request = {pc};
+    AutobootAnswer answer;
+    if (!check_result(board.get_autoboot(request, &answer),
+                      "get autoboot")) {
+      return false;
+    }
+    output("Computer %d: Autoboot is %s\n",
+           pc, answer.enabled ? "enabled" : "disabled");
   } else if (strcmp(variable, "name") == 0) {
-    unsigned char name[64];
-    send_get_name_command(pc);
-    retrieve_name(name);
-    printf("Computer name: %s\n", name);
+    GetNameRequest request = {pc};
+    NameAnswer answer;
+    if (!check_result(board.get_name(request, &answer),
+                      "get computer name")) {
+      return false;
+    }
+    output("Computer name: %s\n", answer.name);
   } else {
-    printf("Unknown variable %s. "
+    output("Unknown variable %s. "
            "Supported variables are: autoboot, name.\n", variable);
     return false;
   }
@@ -363,79 +436,968 @@ bool parse_get_command(int argc, char **argv) {
   } else if (argc == 4) {
     return parse_get_pc_command(argc, argv);
   }
-  printf("Usage: %s set [<pc>] <variable> <value>\n", argv[0]);
+  output("Usage: %s set [<pc>] <variable> <value>\n", argv[0]);
   return false;
 }
 
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_stop_signal(int /*signum*/) {
+  stop_requested = 1;
+}
+
+/* Stop long-running commands on SIGINT/SIGTERM. */
+void install_stop_handler(void) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_stop_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+}
+
+void print_pc_status(int pc, int status) {
+  output("Computer %d: %s%s%s\n",
+         pc,
+         (status & PC_STATUS_ON) ? "on" : "off",
+         (status & PC_STATUS_WILL_PRESS) ? ", will press" : "",
+         (status & PC_STATUS_PRESSED) ? ", pressed" : "");
+}
+
+void print_event(const unsigned char event[PACKET_INT_LEN]) {
+  if (event[0] != EVENT_STATUS_CHANGED) {
+    return;
+  }
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  char time_str[32];
+  strftime(time_str, sizeof(time_str), "%H:%M:%S", localtime(&tv.tv_sec));
+  int num_pcs = event[EVENT_NUM_PCS_OFFSET];
+  for (int i = 0; i < num_pcs && i < NUM_PCS; ++i) {
+    if (event[EVENT_CHANGES_OFFSET] & (1 << i)) {
+      output("%s.%03d ", time_str, (int)(tv.tv_usec / 1000));
+      print_pc_status(i, event[EVENT_STATUS_OFFSET + i]);
+    }
+  }
+  fflush(stdout);
+}
+
+bool parse_watch_command(int argc, char **argv) {
+  if (argc != 2) {
+    output("Usage: %s watch\n", argv[0]);
+    return false;
+  }
+  install_stop_handler();
+  if (device_set_events(true) < 0) {
+    return false;
+  }
+  bool ok = true;
+  bool connected = true;
+  while (!stop_requested) {
+    if (!connected) {
+      double latency_ms;
+      int r = device_reconnect(1000, &latency_ms);
+      if (r == LIBUSB_ERROR_TIMEOUT) {
+        continue;
+      }
+      if (r < 0) {
+        print_error("Failed to reconnect %s\n", libusb_error_name(r));
+        ok = false;
+        break;
+      }
+      output("Device reconnected in %.1f ms\n", latency_ms);
+      connected = true;
+    }
+    unsigned char event[PACKET_INT_LEN];
+    int r = device_wait_event(event, 1000);
+    if (r == LIBUSB_ERROR_TIMEOUT) {
+      continue;
+    }
+    if (r == LIBUSB_ERROR_NO_DEVICE && !device_is_daemon_client()) {
+      /* Keep watching, the board is back as soon as it enumerates. */
+      output("Device is gone, waiting for it to come back\n");
+      connected = false;
+      continue;
+    }
+    if (r < 0) {
+      print_error("Failed to receive event %s\n", libusb_error_name(r));
+      ok = false;
+      break;
+    }
+    print_event(event);
+  }
+  if (device_is_connected()) {
+    device_set_events(false);
+  }
+  return ok;
+}
+
 void print_usage(const char *argv0) {
-  printf("Usage: %s test|"
-         "press <pc> <force>|"
+  output("Usage: %s [--device <board>] [--emulate|--libusb|--hidraw] "
+         "[--lan <ip>[:<port>]] [--capture <file>] test|"
+         "press <pc> [force] [--wait on|off] [--timeout <seconds>]|"
          "set <variable> [<pc>] <value>|"
-         "get <variable> [<pc>]\n", argv0);
+         "get <variable> [<pc>]|"
+         "watch|"
+         "bench [-n <reports>] [--depth <n>] [--json] [--open]|"
+         "daemon [<socket>] [--metrics [<host>:]<port>]|"
+         "cached [<file>]|"
+         "batch [<file>|-]|"
+         "repl|"
+         "list|"
+         "all <command>|"
+         "lan [--timeout <ms>] [--jobs <n>] status|press <pc>|hold <pc> "
+         "<ip>[:<port>]...|-|"
+         "lan serve [<host>:]<port>|"
+         "provision <manifest> [--jobs <n>] [--dry-run]|"
+         "replay <capture> [--speed <factor>]\n"
+         "Commands which don't retrieve anything can be combined into a "
+         "single report: %s <command> , <command> ...\n", argv0, argv0);
 };
 
-}  /* namespace */
-
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    print_usage(argv[0]);
-    return EXIT_FAILURE;
+bool parse_daemon_command(int argc, char **argv) {
+  const char *socket_path = daemon_socket_path();
+  const char *metrics_address = NULL;
+  bool has_socket_path = false;
+  for (int i = 2; i < argc; ++i) {
+    if (!strcmp(argv[i], "--metrics") && i + 1 < argc) {
+      metrics_address = argv[++i];
+    } else if (!has_socket_path && strncmp(argv[i], "--", 2) != 0) {
+      socket_path = argv[i];
+      has_socket_path = true;
+    } else {
+      printf("Usage: %s daemon [<socket>] [--metrics [<host>:]<port>]\n",
+             argv[0]);
+      return false;
+    }
   }
+  return daemon_run(socket_path, metrics_address, &board) == 0;
+}
 
-  int r = libusb_init(&ctx);
+/* Status published by the daemon, the board is not touched. */
+bool parse_cached_command(int argc, char **argv) {
+  if (argc > 3) {
+    printf("Usage: %s cached [<file>]\n", argv[0]);
+    return false;
+  }
+  const char *path = argc == 3 ? argv[2] : status_cache_path();
+  StatusCacheReader reader;
+  int r = reader.open(path);
   if (r < 0) {
-    fprintf(stderr, "Failed to initialise libusb\n");
-    return EXIT_FAILURE;
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(-r));
+    return false;
+  }
+  CachedStatus status;
+  r = reader.read(&status);
+  if (r < 0) {
+    fprintf(stderr, "Failed to read %s: %s\n", path, strerror(-r));
+    return false;
+  }
+  if (status.num_updates == 0) {
+    fprintf(stderr, "Status was not published yet\n");
+    return false;
   }
+  print_snapshot(status.snapshot);
+  printf("Updates: %llu, last one %.1f seconds ago%s\n",
+         (unsigned long long)status.num_updates,
+         (status_cache_now_ns() - status.update_time_ns) / 1e9,
+         status.connected ? "" : ", device is gone");
+  return true;
+}
 
-  /* Set verbosity level to 3, as suggested in the documentation. */
-  libusb_set_debug(ctx, 3);
+bool parse_bench_command(int argc, char **argv) {
+  BenchOptions options;
+  options.num_reports = -1;
+  options.depth = 1;
+  options.json = false;
+  options.open = false;
+  for (int i = 2; i < argc; ++i) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      options.num_reports = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--depth") && i + 1 < argc) {
+      options.depth = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--json")) {
+      options.json = true;
+    } else if (!strcmp(argv[i], "--open")) {
+      options.open = true;
+    } else {
+      options.num_reports = 0;
+      break;
+    }
+  }
+  if (options.num_reports == -1) {
+    /* Opening the device is much slower than a request. */
+    options.num_reports = options.open ? 20 : 1000;
+  }
+  if (options.num_reports < 1 ||
+      options.depth < 1 ||
+      options.depth > REQUEST_ID_MAX) {
+    output("Usage: %s bench [-n <reports>] [--depth <1..%d>] [--json] "
+           "[--open]\n",
+           argv[0], REQUEST_ID_MAX);
+    return false;
+  }
+  if (captured_output == NULL) {
+    options.output = stdout;
+    return bench_run(options);
+  }
+  /* Results are collected like the output of other commands. */
+  char *results = NULL;
+  size_t results_size = 0;
+  options.output = open_memstream(&results, &results_size);
+  if (options.output == NULL) {
+    print_error("Failed to collect results: %s\n", strerror(errno));
+    return false;
+  }
+  bool ok = bench_run(options);
+  fclose(options.output);
+  captured_output->append(results, results_size);
+  free(results);
+  return ok;
+}
 
-  r = find_lvr_hidusb();
-  if (r < 0) {
-    fprintf(stderr, "Could not find/open LVR Generic HID device\n");
-    return EXIT_FAILURE;
+bool run_command(int argc, char **argv) {
+  if (!strcmp(argv[1], "test")) {
+    return check_result(board.test(), "send test command");
+  } else if (!strcmp(argv[1], "press")) {
+    return parse_press_command(argc, argv);
+  } else if (!strcmp(argv[1], "set")) {
+    return parse_set_command(argc, argv);
+  } else if (!strcmp(argv[1], "get")) {
+    return parse_get_command(argc, argv);
+  } else if (!strcmp(argv[1], "watch")) {
+    return parse_watch_command(argc, argv);
+  } else if (!strcmp(argv[1], "bench")) {
+    return parse_bench_command(argc, argv);
   }
+  print_usage(argv[0]);
+  return false;
+}
 
-  printf("Successfully find the LVR Generic HID device\n");
+/* Run commands separated by "," packing them into as few reports as
+ * possible.
+ */
+bool run_combined_commands(int argc, char **argv) {
+  std::vector<std::vector<char *> > commands(1);
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], ",")) {
+      commands.push_back(std::vector<char *>());
+    } else {
+      commands.back().push_back(argv[i]);
+    }
+  }
+  for (size_t i = 0; i < commands.size(); ++i) {
+    if (commands[i].empty() ||
+        (strcmp(commands[i][0], "test") != 0 &&
+         strcmp(commands[i][0], "press") != 0 &&
+         strcmp(commands[i][0], "set") != 0)) {
+      fprintf(stderr, "Only test, press and set commands can be combined\n");
+      return false;
+    }
+  }
+  board.begin_frame();
+  bool ok = true;
+  for (size_t i = 0; i < commands.size() && ok; ++i) {
+    std::vector<char *> command_argv(1, argv[0]);
+    command_argv.insert(command_argv.end(),
+                        commands[i].begin(), commands[i].end());
+    command_argv.push_back(NULL);
+    ok = run_command(command_argv.size() - 1, &command_argv[0]);
+  }
+  if (!ok) {
+    board.cancel_frame();
+    return false;
+  }
+  std::vector<FrameStatus> statuses;
+  if (!check_result(board.end_frame(&statuses), "send commands")) {
+    return false;
+  }
+  for (size_t i = 0; i < statuses.size(); ++i) {
+    if (statuses[i].status != COMMAND_STATUS_OK) {
+      fprintf(stderr, "Command 0x%x failed: %s\n",
+              statuses[i].command, command_status_name(statuses[i].status));
+      ok = false;
+    }
+  }
+  return ok;
+}
 
-  libusb_detach_kernel_driver(devh, 0);
+bool has_combined_commands(int argc, char **argv) {
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], ",")) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Single line of the batch mode. */
+struct BatchCommand {
+  int line;
+  std::string text;
+  bool ok;
+  /* Everything the command printed. */
+  std::string output;
+  /* Reports it added to the batch frame. */
+  int num_reports;
+};
+
+/* Split the line into arguments, double quotes keep spaces in one. */
+bool split_command_line(const std::string &line,
+                        std::vector<std::string> *r_args) {
+  r_args->clear();
+  size_t i = 0;
+  while (i < line.size()) {
+    while (i < line.size() && isspace(line[i])) {
+      ++i;
+    }
+    if (i == line.size()) {
+      break;
+    }
+    std::string arg;
+    bool quoted = false;
+    for (; i < line.size() && (quoted || !isspace(line[i])); ++i) {
+      if (line[i] == '"') {
+        quoted = !quoted;
+      } else {
+        arg += line[i];
+      }
+    }
+    if (quoted) {
+      return false;
+    }
+    r_args->push_back(arg);
+  }
+  return true;
+}
+
+/* Collects what the command prints with output() and print_error() while
+ * it's alive, so it's reported together with the command. stdout and
+ * stderr are left alone, the library's threads write to them.
+ */
+class OutputCapture {
+ public:
+  OutputCapture() : saved_output_(captured_output) {
+    captured_output = &output_;
+  }
+
+  ~OutputCapture() {
+    finish();
+  }
+
+  const std::string &finish(void) {
+    if (captured_output == &output_) {
+      captured_output = saved_output_;
+    }
+    return output_;
+  }
+
+ protected:
+  std::string output_;
+  std::string *saved_output_;
+};
+
+void print_json_string(const std::string &text) {
+  putchar('"');
+  for (size_t i = 0; i < text.size(); ++i) {
+    unsigned char c = text[i];
+    if (c == '"' || c == '\\') {
+      printf("\\%c", c);
+    } else if (c == '\n') {
+      printf("\\n");
+    } else if (c < 0x20) {
+      printf("\\u%04x", c);
+    } else {
+      putchar(c);
+    }
+  }
+  putchar('"');
+}
+
+/* One JSON object per line, in the order of the input. */
+void print_batch_command(const BatchCommand &command) {
+  printf("{\"line\": %d, \"command\": ", command.line);
+  print_json_string(command.text);
+  printf(", \"ok\": %s, \"output\": ", command.ok ? "true" : "false");
+  print_json_string(command.output);
+  printf("}\n");
+}
+
+/* Send the frame of the pending commands and report all of them. */
+void flush_batch(std::vector<BatchCommand> *pending, int *num_failed) {
+  std::vector<FrameStatus> statuses;
+  int r = board.end_frame(&statuses);
+  size_t report = 0;
+  for (size_t i = 0; i < pending->size(); ++i) {
+    BatchCommand *command = &(*pending)[i];
+    for (int j = 0; j < command->num_reports; ++j, ++report) {
+      if (report >= statuses.size()) {
+        /* Sending failed before the command was reached. */
+        command->ok = false;
+        command->output += std::string("Failed to send: ") +
+                           libusb_error_name(r) + "\n";
+      } else if (statuses[report].status != COMMAND_STATUS_OK) {
+        command->ok = false;
+        command->output += std::string("Command failed: ") +
+                           command_status_name(statuses[report].status) +
+                           "\n";
+      }
+    }
+    if (!command->ok) {
+      ++*num_failed;
+    }
+    print_batch_command(*command);
+  }
+  pending->clear();
+  fflush(stdout);
+}
+
+/* Commands which don't retrieve anything are packed into frames, they're
+ * sent once the frame is full or a command needs an answer.
+ */
+bool is_packable_command(const std::vector<std::string> &args) {
+  if (std::find(args.begin(), args.end(), "--wait") != args.end()) {
+    return false;
+  }
+  return args[0] == "test" || args[0] == "press" || args[0] == "set";
+}
+
+/* Run commands from the input, one per line, over the opened device. */
+bool run_batch(FILE *input, const char *argv0) {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  std::vector<BatchCommand> pending;
+  int num_commands = 0, num_failed = 0;
+  char *line = NULL;
+  size_t line_size = 0;
+  for (int line_number = 1;
+       getline(&line, &line_size, input) >= 0;
+       ++line_number) {
+    std::vector<std::string> args;
+    BatchCommand command;
+    command.line = line_number;
+    command.text = line;
+    command.text.erase(command.text.find_last_not_of(" \t\r\n") + 1);
+    command.ok = split_command_line(command.text, &args);
+    command.num_reports = 0;
+    if (command.ok && (args.empty() || args[0][0] == '#')) {
+      continue;
+    }
+    ++num_commands;
+    std::vector<char *> command_argv(1, (char *)argv0);
+    for (size_t i = 0; i < args.size(); ++i) {
+      command_argv.push_back(&args[i][0]);
+    }
+    command_argv.push_back(NULL);
+    int command_argc = command_argv.size() - 1;
+    if (!command.ok) {
+      command.output = "Unbalanced quotes\n";
+    } else if (is_packable_command(args)) {
+      if (!board.is_collecting_frame()) {
+        board.begin_frame();
+      }
+      int num_frame_commands = board.num_frame_commands();
+      {
+        OutputCapture capture;
+        command.ok = run_command(command_argc, &command_argv[0]);
+        command.output = capture.finish();
+      }
+      command.num_reports = board.num_frame_commands() - num_frame_commands;
+      if (command.num_reports != 0) {
+        pending.push_back(command);
+        continue;
+      }
+    } else {
+      /* Keep the output in the order of the input. */
+      flush_batch(&pending, &num_failed);
+      OutputCapture capture;
+      command.ok = run_command(command_argc, &command_argv[0]);
+      command.output = capture.finish();
+    }
+    pending.push_back(command);
+    flush_batch(&pending, &num_failed);
+  }
+  flush_batch(&pending, &num_failed);
+  free(line);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  printf("{\"commands\": %d, \"failed\": %d, \"elapsed_ms\": %.3f, "
+         "\"per_second\": %.1f}\n",
+         num_commands, num_failed, elapsed.count() * 1000.0,
+         elapsed.count() > 0 ? num_commands / elapsed.count() : 0.0);
+  return num_failed == 0;
+}
+
+bool parse_batch_command(int argc, char **argv) {
+  if (argc > 3) {
+    printf("Usage: %s batch [<file>|-]\n", argv[0]);
+    return false;
+  }
+  if (argc == 2 || !strcmp(argv[2], "-")) {
+    return run_batch(stdin, argv[0]);
+  }
+  FILE *input = fopen(argv[2], "r");
+  if (input == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", argv[2], strerror(errno));
+    return false;
+  }
+  bool ok = run_batch(input, argv[0]);
+  fclose(input);
+  return ok;
+}
+
+/* Interactive shell, commands are run right away with their usual output. */
+bool run_repl(const char *argv0) {
+  bool interactive = isatty(STDIN_FILENO);
+  char *line = NULL;
+  size_t line_size = 0;
+  for (;;) {
+    if (interactive) {
+      printf("pcremotecontrol> ");
+      fflush(stdout);
+    }
+    if (getline(&line, &line_size, stdin) < 0) {
+      break;
+    }
+    std::vector<std::string> args;
+    if (!split_command_line(line, &args)) {
+      printf("Unbalanced quotes\n");
+      continue;
+    }
+    if (args.empty() || args[0][0] == '#') {
+      continue;
+    }
+    if (args[0] == "quit" || args[0] == "exit") {
+      break;
+    }
+    std::vector<char *> command_argv(1, (char *)argv0);
+    for (size_t i = 0; i < args.size(); ++i) {
+      command_argv.push_back(&args[i][0]);
+    }
+    command_argv.push_back(NULL);
+    if (!run_command(command_argv.size() - 1, &command_argv[0])) {
+      printf("error\n");
+    }
+    fflush(stdout);
+  }
+  if (interactive) {
+    printf("\n");
+  }
+  free(line);
+  return true;
+}
 
-#if 0
-  r = libusb_set_configuration(devh, 1);
+/* Number of boards which are talked to at once by the "all" command. */
+const int MAX_FLEET_JOBS = 32;
+
+/* Run command on the selected board. */
+bool run_board_command(int argc, char **argv) {
+  if (board.open(false) < 0) {
+    return false;
+  }
+  bool ok;
+  if (has_combined_commands(argc, argv)) {
+    ok = run_combined_commands(argc, argv);
+  } else {
+    ok = run_command(argc, argv);
+  }
+  board.close();
+  return ok;
+}
+
+bool parse_list_command(int argc, char **argv) {
+  if (argc != 2) {
+    printf("Usage: %s list\n", argv[0]);
+    return false;
+  }
+  std::vector<std::string> ids;
+  if (device_list(&ids) < 0) {
+    return false;
+  }
+  for (size_t i = 0; i < ids.size(); ++i) {
+    printf("%s\n", ids[i].c_str());
+  }
+  return true;
+}
+
+/* Run the command on all the boards in parallel. */
+bool parse_all_command(int argc, char **argv) {
+  if (argc < 3 ||
+      !strcmp(argv[2], "watch") ||
+      !strcmp(argv[2], "daemon") ||
+      !strcmp(argv[2], "batch") ||
+      !strcmp(argv[2], "repl") ||
+      !strcmp(argv[2], "list") ||
+      !strcmp(argv[2], "lan") ||
+      !strcmp(argv[2], "provision") ||
+      !strcmp(argv[2], "replay") ||
+      !strcmp(argv[2], "all")) {
+    printf("Usage: %s all test|press|set|get ...\n", argv[0]);
+    return false;
+  }
+  std::vector<std::string> ids;
+  if (device_list(&ids) < 0) {
+    return false;
+  }
+  if (ids.empty()) {
+    fprintf(stderr, "Could not find any LVR Generic HID device\n");
+    return false;
+  }
+  /* Command is run as if "all" was not there. */
+  argv[1] = argv[0];
+  return fleet_run(ids, MAX_FLEET_JOBS, run_board_command,
+                   argc - 1, argv + 1) == 0;
+}
+
+/* Manifest of the "provision" command, workers find their board in it. */
+std::vector<ProvisionEntry> provision_entries;
+bool provision_dry_run = false;
+
+/* Worker of the "provision" command, runs on the board selected by
+ * fleet_run().
+ */
+bool provision_selected_board(int /*argc*/, char ** /*argv*/) {
+  const ProvisionEntry *entry = NULL;
+  for (size_t i = 0; i < provision_entries.size(); ++i) {
+    if (provision_entries[i].board == device_selected()) {
+      entry = &provision_entries[i];
+    }
+  }
+  if (entry == NULL || board.open(false) < 0) {
+    return false;
+  }
+  std::chrono::steady_clock::time_point start_time =
+      std::chrono::steady_clock::now();
+  std::vector<ProvisionChange> changes;
+  int r = provision_board(&board, *entry, provision_dry_run, &changes);
+  double elapsed_ms = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start_time).count();
+  board.close();
+  for (size_t i = 0; i < changes.size(); ++i) {
+    const ProvisionChange &change = changes[i];
+    printf("%s: %s -> %s%s\n",
+           change.field.c_str(),
+           change.old_value.c_str(),
+           change.new_value.c_str(),
+           provision_dry_run || change.verified ? "" : ", not verified");
+  }
+  if (!check_result(r, "provision")) {
+    return false;
+  }
+  if (changes.empty()) {
+    printf("Up to date, checked in %.1f ms\n", elapsed_ms);
+  } else if (provision_dry_run) {
+    printf("%d fields to write\n", (int)changes.size());
+  } else {
+    printf("%d fields written and verified in %.1f ms\n",
+           (int)changes.size(), elapsed_ms);
+  }
+  return true;
+}
+
+/* Bring all the boards of the manifest to the state it describes. */
+bool parse_provision_command(int argc, char **argv) {
+  const char *path = NULL;
+  int max_jobs = MAX_FLEET_JOBS;
+  bool ok = true;
+  for (int i = 2; i < argc && ok; ++i) {
+    if (!strcmp(argv[i], "--jobs") && i + 1 < argc) {
+      max_jobs = atoi(argv[++i]);
+      ok = max_jobs > 0;
+    } else if (!strcmp(argv[i], "--dry-run")) {
+      provision_dry_run = true;
+    } else if (path == NULL && strncmp(argv[i], "--", 2) != 0) {
+      path = argv[i];
+    } else {
+      ok = false;
+    }
+  }
+  if (!ok || path == NULL) {
+    printf("Usage: %s provision <manifest> [--jobs <n>] [--dry-run]\n",
+           argv[0]);
+    return false;
+  }
+  std::string error;
+  int r = provision_load_manifest(path, &provision_entries, &error);
+  if (r < 0) {
+    fprintf(stderr, "Failed to load %s: %s\n",
+            path, r == -EINVAL ? error.c_str() : strerror(-r));
+    return false;
+  }
+  std::vector<std::string> ids;
+  for (size_t i = 0; i < provision_entries.size(); ++i) {
+    ids.push_back(provision_entries[i].board);
+  }
+  std::chrono::steady_clock::time_point start_time =
+      std::chrono::steady_clock::now();
+  int num_failed = fleet_run(ids, max_jobs, provision_selected_board,
+                             argc, argv);
+  double elapsed = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start_time).count();
+  if (num_failed < 0) {
+    fprintf(stderr, "Failed to provision: %s\n", strerror(-num_failed));
+    return false;
+  }
+  printf("%d boards in %.1f ms, %.1f boards per second, %d failed\n",
+         (int)ids.size(), elapsed * 1000.0,
+         elapsed > 0.0 ? ids.size() / elapsed : 0.0, num_failed);
+  return num_failed == 0;
+}
+
+/* Send captured traffic to the board, see --capture. */
+bool parse_replay_command(int argc, char **argv) {
+  double speed = 1.0;
+  if (argc == 5 && !strcmp(argv[3], "--speed")) {
+    speed = atof(argv[4]);
+  } else if (argc != 3) {
+    speed = -1.0;
+  }
+  if (speed < 0.0) {
+    printf("Usage: %s replay <capture> [--speed <factor>]\n"
+           "Speed of zero sends the reports back to back.\n", argv[0]);
+    return false;
+  }
+  CaptureReplayer replayer(capture_writer.is_open() ? &capture_writer : NULL);
+  int r = replayer.load(argv[2]);
   if (r < 0) {
-    fprintf(stderr, "libusb_set_configuration error %d\n", r);
-    goto out;
+    fprintf(stderr, "Failed to load %s: %s\n", argv[2], strerror(-r));
+    return false;
+  }
+  device_set_capture(&replayer);
+  if (board.open(false) < 0) {
+    return false;
   }
+  ReplayStats stats;
+  r = replayer.run(speed, &stats);
+  board.close();
+  device_set_capture(NULL);
+  printf("Replayed %d reports in %.1f ms, recorded in %.1f ms\n",
+         stats.num_reports, stats.replay_ms, stats.recorded_ms);
+  printf("Answers: %d recorded, %d matched, %d mismatched, %d missing\n",
+         stats.num_answers, stats.num_matched, stats.num_mismatched,
+         stats.num_missing);
+  printf("Answer latency: avg %.3f ms, max %.3f ms\n",
+         stats.avg_answer_ms, stats.max_answer_ms);
+  printf("Maximum lag behind the recorded pacing: %.3f ms\n",
+         stats.max_lag_ms);
+  printf("Events: %d\n", stats.num_events);
+  return check_result(r, "replay");
+}
+
+/* Boards which are talked to at once by the "lan" command. */
+const int MAX_LAN_CONNECTIONS = 256;
+const int LAN_TIMEOUT_MS = 1000;
 
-  printf("Successfully set usb configuration 1\n");
-#endif
+std::string serve_emulated_board(const std::string &request,
+                                 void * /*user_data*/) {
+  return emulator_http_response(request);
+}
 
-  r = libusb_claim_interface(devh, 0);
+/* Web interface of the emulated board, to try the "lan" command without
+ * a rack of boards. It's only reachable locally unless the host is given.
+ */
+bool parse_lan_serve_command(int argc, char **argv) {
+  if (argc != 4) {
+    printf("Usage: %s lan serve [<host>:]<port>\n", argv[0]);
+    return false;
+  }
+  int fd = lan_listen(argv[3], "127.0.0.1");
+  if (fd < 0) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", argv[3], strerror(-fd));
+    return false;
+  }
+  device_set_backend(DEVICE_BACKEND_EMULATOR);
+  if (board.open(false) < 0) {
+    close(fd);
+    return false;
+  }
+  install_stop_handler();
+  int r = lan_serve(fd, serve_emulated_board, NULL, &stop_requested);
   if (r < 0) {
-    fprintf(stderr, "libusb_claim_interface error %d\n", r);
-    goto out;
+    fprintf(stderr, "Failed to serve: %s\n", strerror(-r));
   }
+  board.close();
+  close(fd);
+  return r == 0;
+}
 
-  printf("Successfully claimed interface\n");
+void print_lan_result(const LanRequest &request, const LanResult &result) {
+  const char *address = request.address.c_str();
+  if (result.result < 0) {
+    printf("%s: Failed: %s (%.1f ms)\n",
+           address, strerror(-result.result), result.latency_ms);
+    return;
+  }
+  if (request.action != LAN_STATUS) {
+    printf("%s: HTTP %d (%.1f ms)\n",
+           address, result.http_status, result.latency_ms);
+    return;
+  }
+  for (int i = 0; i < result.num_pcs; ++i) {
+    int status = result.pcs[i].status;
+    printf("%s: Computer %d (%s): %s%s%s (%.1f ms)\n",
+           address, i, result.pcs[i].name,
+           (status & PC_STATUS_ON) ? "on" : "off",
+           (status & PC_STATUS_WILL_PRESS) ? ", will press" : "",
+           (status & PC_STATUS_PRESSED) ? ", pressed" : "",
+           result.latency_ms);
+  }
+}
 
-  if (!strcmp(argv[1], "test")) {
-    send_test_command();
-  } else if (!strcmp(argv[1], "press")) {
-    parse_press_command(argc, argv);
-  } else if (!strcmp(argv[1], "set")) {
-    parse_set_command(argc, argv);
-  } else if (!strcmp(argv[1], "get")) {
-    parse_get_command(argc, argv);
+/* Drive the boards over their web interface, all at once. */
+bool parse_lan_command(int argc, char **argv) {
+  if (argc >= 3 && !strcmp(argv[2], "serve")) {
+    return parse_lan_serve_command(argc, argv);
+  }
+  int timeout_ms = LAN_TIMEOUT_MS;
+  int max_connections = MAX_LAN_CONNECTIONS;
+  int i = 2;
+  for (; i + 1 < argc; i += 2) {
+    if (!strcmp(argv[i], "--timeout")) {
+      timeout_ms = atoi(argv[i + 1]);
+    } else if (!strcmp(argv[i], "--jobs")) {
+      max_connections = atoi(argv[i + 1]);
+    } else {
+      break;
+    }
+  }
+  LanRequest request;
+  request.pc = 0;
+  bool ok = i < argc && timeout_ms > 0 && max_connections > 0;
+  if (ok && !strcmp(argv[i], "status")) {
+    request.action = LAN_STATUS;
+    ++i;
+  } else if (ok && i + 1 < argc &&
+             (!strcmp(argv[i], "press") || !strcmp(argv[i], "hold"))) {
+    request.action = !strcmp(argv[i], "press") ? LAN_PRESS : LAN_HOLD;
+    request.pc = atoi(argv[i + 1]);
+    ok = check_pc_valid(request.pc);
+    i += 2;
   } else {
+    ok = false;
+  }
+  if (!ok || i == argc) {
+    printf("Usage: %s lan [--timeout <ms>] [--jobs <n>] "
+           "status|press <pc>|hold <pc> <ip>[:<port>]...|-\n", argv[0]);
+    return false;
+  }
+
+  /* Addresses of a large fleet come from the standard input. */
+  std::vector<LanRequest> requests;
+  for (; i < argc; ++i) {
+    if (strcmp(argv[i], "-") != 0) {
+      request.address = argv[i];
+      requests.push_back(request);
+      continue;
+    }
+    char address[64];
+    while (scanf("%63s", address) == 1) {
+      request.address = address;
+      requests.push_back(request);
+    }
+  }
+  std::chrono::steady_clock::time_point start_time =
+      std::chrono::steady_clock::now();
+  std::vector<LanResult> results;
+  int num_failed = lan_run(requests, max_connections, timeout_ms, &results);
+  double elapsed_ms = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start_time).count();
+  if (num_failed < 0) {
+    fprintf(stderr, "Failed to run requests: %s\n", strerror(-num_failed));
+    return false;
+  }
+  for (size_t j = 0; j < requests.size(); ++j) {
+    print_lan_result(requests[j], results[j]);
+  }
+  printf("%d boards in %.1f ms, %d failed\n",
+         (int)requests.size(), elapsed_ms, num_failed);
+  return num_failed == 0;
+}
+
+}  /* namespace */
+
+int main(int argc, char **argv) {
+  /* Library is quiet, the command line tool tells what went wrong. */
+  device_set_log_enabled(true);
+  if (argc < 2) {
     print_usage(argv[0]);
+    return EXIT_FAILURE;
   }
 
-  libusb_release_interface(devh, 0);
+  /* Global options come before the command. */
+  while (argc >= 2 && !strncmp(argv[1], "--", 2)) {
+    int num_args = 1;
+    if (!strcmp(argv[1], "--device") && argc >= 3) {
+      device_select(argv[2]);
+      num_args = 2;
+    } else if (!strcmp(argv[1], "--emulate")) {
+      device_set_backend(DEVICE_BACKEND_EMULATOR);
+    } else if (!strcmp(argv[1], "--libusb")) {
+      device_set_backend(DEVICE_BACKEND_LIBUSB);
+    } else if (!strcmp(argv[1], "--hidraw")) {
+      device_set_backend(DEVICE_BACKEND_HIDRAW);
+    } else if (!strcmp(argv[1], "--lan") && argc >= 3) {
+      /* Presses and status take the faster of USB and LAN. */
+      use_paths = true;
+      paths.set_usb_path(&board);
+      paths.set_lan_path(argv[2], LAN_TIMEOUT_MS);
+      num_args = 2;
+    } else if (!strcmp(argv[1], "--capture") && argc >= 3) {
+      int r = capture_writer.open(argv[2]);
+      if (r < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", argv[2], strerror(-r));
+        return EXIT_FAILURE;
+      }
+      device_set_capture(&capture_writer);
+      num_args = 2;
+    } else {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    argv[num_args] = argv[0];
+    argc -= num_args;
+    argv += num_args;
+  }
+  if (argc < 2) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  /* These commands open the boards on their own, or don't need one. */
+  if (!strcmp(argv[1], "list")) {
+    return parse_list_command(argc, argv) ? EXIT_SUCCESS : EXIT_FAILURE;
+  } else if (!strcmp(argv[1], "all")) {
+    return parse_all_command(argc, argv) ? EXIT_SUCCESS : EXIT_FAILURE;
+  } else if (!strcmp(argv[1], "cached")) {
+    return parse_cached_command(argc, argv) ? EXIT_SUCCESS : EXIT_FAILURE;
+  } else if (!strcmp(argv[1], "lan")) {
+    return parse_lan_command(argc, argv) ? EXIT_SUCCESS : EXIT_FAILURE;
+  } else if (!strcmp(argv[1], "provision")) {
+    return parse_provision_command(argc, argv) ? EXIT_SUCCESS : EXIT_FAILURE;
+  } else if (!strcmp(argv[1], "replay")) {
+    return parse_replay_command(argc, argv) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  /* Daemon keeps the device for itself, everything else goes through the
+   * daemon when it's running.
+   */
+  bool is_daemon = !strcmp(argv[1], "daemon");
+  int r = board.open(!is_daemon);
+  if (r < 0) {
+    return EXIT_FAILURE;
+  }
+
+  if (is_daemon) {
+    r = parse_daemon_command(argc, argv) ? 0 : -1;
+  } else if (!strcmp(argv[1], "batch")) {
+    r = parse_batch_command(argc, argv) ? 0 : -1;
+  } else if (!strcmp(argv[1], "repl")) {
+    r = run_repl(argv[0]) ? 0 : -1;
+  } else if (has_combined_commands(argc, argv)) {
+    r = run_combined_commands(argc, argv) ? 0 : -1;
+  } else {
+    r = run_command(argc, argv) ? 0 : -1;
+  }
 
- out:
-  /* libusb_reset_device(devh); */
-  libusb_close(devh);
-  libusb_exit(ctx);
-  return r == 0 ? EXIT_SUCCESS : -EXIT_FAILURE;
+  board.close();
+  return r == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,269 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "device.h"
+#include "lan.h"
+
+namespace {
+
+const char *DEFAULT_METRICS_HOST = "127.0.0.1";
+/* Scrapers send the whole request at once and read the response right
+ * away, stuck ones are dropped after this long.
+ */
+const int SCRAPE_TIMEOUT_MS = 1000;
+const int MAX_REQUEST_SIZE = 4096;
+
+void append(std::string *out, const char *format, ...) {
+  char buffer[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  *out += buffer;
+}
+
+/* Label values are quoted, names might have anything in them. */
+std::string escape_label(const char *value) {
+  std::string escaped;
+  for (const char *c = value; *c != '\0'; ++c) {
+    if (*c == '\\' || *c == '"') {
+      escaped += '\\';
+      escaped += *c;
+    } else if (*c == '\n') {
+      escaped += "\\n";
+    } else {
+      escaped += *c;
+    }
+  }
+  return escaped;
+}
+
+void append_header(std::string *out,
+                   const char *name,
+                   const char *type,
+                   const char *help) {
+  append(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void append_command_counter(std::string *out,
+                            const char *board,
+                            const char *name,
+                            const char *help,
+                            int CommandStats::*counter) {
+  append_header(out, name, "counter", help);
+  for (int command = COMMAND_FIRST; command <= COMMAND_LAST; ++command) {
+    CommandStats stats;
+    device_command_stats(command, &stats);
+    if (stats.num_requests != 0) {
+      append(out, "%s{board=\"%s\",command=\"%s\"} %d\n",
+             name, board, command_name(command), stats.*counter);
+    }
+  }
+}
+
+std::string make_response(const std::string &request,
+                          MetricsBodyCallback body_callback,
+                          void *user_data) {
+  if (request.compare(0, 13, "GET /metrics ") != 0) {
+    return "HTTP/1.0 404 Not Found\r\n"
+           "Content-Length: 0\r\n"
+           "Connection: close\r\n\r\n";
+  }
+  std::string body = body_callback(user_data);
+  std::string response;
+  append(&response,
+         "HTTP/1.0 200 OK\r\n"
+         "Content-Type: text/plain; version=0.0.4\r\n"
+         "Content-Length: %d\r\n"
+         "Connection: close\r\n\r\n",
+         (int)body.size());
+  return response + body;
+}
+
+}  /* namespace */
+
+int metrics_listen(const char *address) {
+  int fd = lan_listen(address, DEFAULT_METRICS_HOST);
+  if (fd >= 0) {
+    /* Scrape which went away before it was accepted mustn't block. */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+  return fd;
+}
+
+std::string metrics_format(const std::string &board_id,
+                           const CachedStatus &status,
+                           const DaemonCounters &counters) {
+  std::string out;
+  std::string board = escape_label(board_id.c_str());
+  const char *b = board.c_str();
+
+  append_header(&out, "pcremote_up", "gauge",
+                "Whether the board is connected.");
+  append(&out, "pcremote_up{board=\"%s\"} %d\n", b, status.connected ? 1 : 0);
+  append_header(&out, "pcremote_reconnects_total", "counter",
+                "Times the board came back after it was gone.");
+  append(&out, "pcremote_reconnects_total{board=\"%s\"} %d\n",
+         b, counters.num_reconnects);
+  append_header(&out, "pcremote_status_updates_total", "counter",
+                "Updates of the cached status.");
+  append(&out, "pcremote_status_updates_total{board=\"%s\"} %llu\n",
+         b, (unsigned long long)status.num_updates);
+  if (status.num_updates != 0) {
+    append_header(&out, "pcremote_status_age_seconds", "gauge",
+                  "Time since the cached status was updated.");
+    append(&out, "pcremote_status_age_seconds{board=\"%s\"} %.3f\n",
+           b, (status_cache_now_ns() - status.update_time_ns) / 1e9);
+  }
+
+  const SnapshotAnswer &snapshot = status.snapshot;
+  append_header(&out, "pcremote_pc_power_on", "gauge",
+                "Whether the computer is powered on.");
+  for (int i = 0; i < snapshot.num_pcs; ++i) {
+    append(&out, "pcremote_pc_power_on{board=\"%s\",pc=\"%d\",name=\"%s\"} "
+           "%d\n",
+           b, i, escape_label(snapshot.pcs[i].name).c_str(),
+           (snapshot.pcs[i].status & PC_STATUS_ON) ? 1 : 0);
+  }
+  append_header(&out, "pcremote_pc_status", "gauge",
+                "PC_STATUS_* bits of the computer.");
+  for (int i = 0; i < snapshot.num_pcs; ++i) {
+    append(&out, "pcremote_pc_status{board=\"%s\",pc=\"%d\"} %d\n",
+           b, i, snapshot.pcs[i].status);
+  }
+  append_header(&out, "pcremote_presses_total", "counter",
+                "Switch presses sent through the daemon.");
+  for (int i = 0; i < NUM_PCS; ++i) {
+    append(&out, "pcremote_presses_total{board=\"%s\",pc=\"%d\"} %d\n",
+           b, i, counters.num_presses[i]);
+  }
+
+  append_command_counter(&out, b, "pcremote_requests_total",
+                         "Requests which expect an answer.",
+                         &CommandStats::num_requests);
+  append_command_counter(&out, b, "pcremote_timeouts_total",
+                         "Attempts whose answer didn't come in time.",
+                         &CommandStats::num_timeouts);
+  append_command_counter(&out, b, "pcremote_retries_total",
+                         "Requests sent again after a timeout.",
+                         &CommandStats::num_retries);
+
+  append_header(&out, "pcremote_answer_timeout_seconds", "gauge",
+                "Current timeout of the first attempt.");
+  for (int command = COMMAND_FIRST; command <= COMMAND_LAST; ++command) {
+    CommandStats stats;
+    device_command_stats(command, &stats);
+    if (stats.num_requests != 0) {
+      append(&out, "pcremote_answer_timeout_seconds{board=\"%s\","
+             "command=\"%s\"} %.3f\n",
+             b, command_name(command), stats.rto_ms / 1000.0);
+    }
+  }
+
+  append_header(&out, "pcremote_request_duration_seconds", "histogram",
+                "Time from sending the request to its answer.");
+  for (int command = COMMAND_FIRST; command <= COMMAND_LAST; ++command) {
+    CommandStats stats;
+    device_command_stats(command, &stats);
+    if (stats.num_requests == 0) {
+      continue;
+    }
+    const char *name = command_name(command);
+    int count = 0;
+    for (int i = 0; i < NUM_LATENCY_BUCKETS - 1; ++i) {
+      count += stats.latency_buckets[i];
+      append(&out, "pcremote_request_duration_seconds_bucket{board=\"%s\","
+             "command=\"%s\",le=\"%g\"} %d\n",
+             b, name, LATENCY_BUCKETS_MS[i] / 1000.0, count);
+    }
+    count += stats.latency_buckets[NUM_LATENCY_BUCKETS - 1];
+    append(&out, "pcremote_request_duration_seconds_bucket{board=\"%s\","
+           "command=\"%s\",le=\"+Inf\"} %d\n", b, name, count);
+    append(&out, "pcremote_request_duration_seconds_sum{board=\"%s\","
+           "command=\"%s\"} %.6f\n", b, name, stats.latency_sum_ms / 1000.0);
+    append(&out, "pcremote_request_duration_seconds_count{board=\"%s\","
+           "command=\"%s\"} %d\n", b, name, count);
+  }
+  return out;
+}
+
+int metrics_accept(int listen_fd, MetricsScrape *r_scrape) {
+  int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+  r_scrape->fd = fd;
+  r_scrape->request.clear();
+  r_scrape->response.clear();
+  r_scrape->sent = 0;
+  r_scrape->deadline = std::chrono::steady_clock::now() +
+                       std::chrono::milliseconds(SCRAPE_TIMEOUT_MS);
+  return 0;
+}
+
+short metrics_scrape_events(const MetricsScrape &scrape) {
+  return scrape.response.empty() ? POLLIN : POLLOUT;
+}
+
+bool metrics_scrape_handle(MetricsScrape *scrape,
+                           MetricsBodyCallback body_callback,
+                           void *user_data) {
+  while (scrape->response.empty()) {
+    char buffer[1024];
+    ssize_t len = recv(scrape->fd, buffer, sizeof(buffer), 0);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return false;
+    } else if (len < 0) {
+      return true;
+    }
+    scrape->request.append(buffer, len);
+    if (len == 0 ||
+        scrape->request.find("\r\n\r\n") != std::string::npos ||
+        scrape->request.size() >= (size_t)MAX_REQUEST_SIZE) {
+      scrape->response = make_response(scrape->request,
+                                        body_callback,
+                                        user_data);
+    }
+  }
+  while (scrape->sent < scrape->response.size()) {
+    ssize_t len = send(scrape->fd,
+                       scrape->response.data() + scrape->sent,
+                       scrape->response.size() - scrape->sent,
+                       MSG_NOSIGNAL);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return false;
+    } else if (len <= 0) {
+      return true;
+    }
+    scrape->sent += len;
+  }
+  return true;
+}
@@ -0,0 +1,79 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <chrono>
+#include <string>
+
+#include "status_cache.h"
+
+/* Counters which only the daemon knows about. */
+struct DaemonCounters {
+  int num_presses[NUM_PCS];
+  int num_reconnects;
+};
+
+/* Listen for scrapes on [<host>:]<port>, host defaults to 127.0.0.1.
+ * Returns the descriptor or negative errno.
+ */
+int metrics_listen(const char *address);
+
+/* Prometheus text exposition of the board. Only the cached status and the
+ * request statistics are used, nothing is sent to the device.
+ */
+std::string metrics_format(const std::string &board,
+                           const CachedStatus &status,
+                           const DaemonCounters &counters);
+
+/* Scrape connection, it's read and answered from the daemon's poll loop
+ * without ever blocking it.
+ */
+struct MetricsScrape {
+  int fd;
+  std::string request;
+  std::string response;
+  size_t sent;
+  /* Whole scrape has to be done by then, it's dropped otherwise. */
+  std::chrono::steady_clock::time_point deadline;
+};
+
+/* Body of the response, only made once the request was read. */
+typedef std::string (*MetricsBodyCallback)(void *user_data);
+
+/* Accept the pending connection as a non-blocking one. Returns 0 or
+ * negative errno.
+ */
+int metrics_accept(int listen_fd, MetricsScrape *r_scrape);
+
+/* Events to poll the descriptor of the scrape for. */
+short metrics_scrape_events(const MetricsScrape &scrape);
+
+/* Read as much of the request or send as much of the response as the
+ * socket takes, GET /metrics is answered with the body. Returns true when
+ * the scrape is finished or failed, its descriptor is to be closed then.
+ */
+bool metrics_scrape_handle(MetricsScrape *scrape,
+                           MetricsBodyCallback body_callback,
+                           void *user_data);
+
+#endif  /* __METRICS_H__ */
@@ -0,0 +1,281 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "multipath.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <libusb.h>
+
+#include "lan.h"
+
+namespace {
+
+/* Gain of the latency average, recent commands count the most. */
+const double LATENCY_GAIN = 0.25;
+/* Failed path is skipped for this long, doubled for every failure in
+ * a row.
+ */
+const int MIN_PATH_BACKOFF_MS = 1000;
+const int MAX_PATH_BACKOFF_MS = 30000;
+const int DEFAULT_LAN_TIMEOUT_MS = 1000;
+/* Path which is not preferred is measured again after this long. */
+const int PATH_PROBE_INTERVAL_MS = 10000;
+
+/* Errors which the board gives for the command itself, the other path
+ * would give the same.
+ */
+bool is_path_failure(int r) {
+  return r < 0 &&
+         r != LIBUSB_ERROR_INVALID_PARAM &&
+         r != LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int lan_error_to_libusb(int r) {
+  switch (r) {
+    case 0:
+      return 0;
+    case -ETIMEDOUT:
+      return LIBUSB_ERROR_TIMEOUT;
+    case -EPROTO:
+      return LIBUSB_ERROR_IO;
+    case -ECONNREFUSED:
+    case -EHOSTUNREACH:
+    case -ENETUNREACH:
+      return LIBUSB_ERROR_NO_DEVICE;
+  }
+  return LIBUSB_ERROR_OTHER;
+}
+
+}  /* namespace */
+
+const char *board_path_name(BoardPath path) {
+  switch (path) {
+    case BOARD_PATH_USB:
+      return "usb";
+    case BOARD_PATH_LAN:
+      return "lan";
+    case NUM_BOARD_PATHS:
+      break;
+  }
+  return "none";
+}
+
+MultipathBoard::MultipathBoard()
+    : device_(NULL),
+      lan_timeout_ms_(DEFAULT_LAN_TIMEOUT_MS) {
+  for (int i = 0; i < NUM_BOARD_PATHS; ++i) {
+    memset(&paths_[i].stats, 0, sizeof(paths_[i].stats));
+    paths_[i].num_failures_in_row = 0;
+  }
+}
+
+void MultipathBoard::set_usb_path(Device *device) {
+  device_ = device;
+}
+
+void MultipathBoard::set_lan_path(const std::string &address,
+                                  int timeout_ms) {
+  lan_address_ = address;
+  lan_timeout_ms_ = timeout_ms;
+}
+
+bool MultipathBoard::is_configured(BoardPath path) const {
+  if (path == BOARD_PATH_USB) {
+    return device_ != NULL && device_->is_open();
+  }
+  return !lan_address_.empty();
+}
+
+BoardPath MultipathBoard::preferred_path(void) const {
+  Clock::time_point now = Clock::now();
+  BoardPath best = NUM_BOARD_PATHS;
+  for (int i = 0; i < NUM_BOARD_PATHS; ++i) {
+    BoardPath path = (BoardPath)i;
+    if (!is_configured(path)) {
+      continue;
+    }
+    if (best == NUM_BOARD_PATHS) {
+      best = path;
+      continue;
+    }
+    /* Healthy paths come first, the one which comes back sooner among
+     * the failed ones.
+     */
+    const Path &a = paths_[path], &b = paths_[best];
+    bool a_healthy = a.retry_time <= now, b_healthy = b.retry_time <= now;
+    if (a_healthy != b_healthy) {
+      if (a_healthy) {
+        best = path;
+      }
+    } else if (!a_healthy) {
+      if (a.retry_time < b.retry_time) {
+        best = path;
+      }
+    } else if (a.stats.srtt_ms < b.stats.srtt_ms) {
+      /* Path which was never used has no latency yet, it's measured by the
+       * first command.
+       */
+      best = path;
+    }
+  }
+  return best;
+}
+
+void MultipathBoard::path_stats(BoardPath path, PathStats *r_stats) const {
+  *r_stats = paths_[path].stats;
+  r_stats->configured = is_configured(path);
+  r_stats->healthy = paths_[path].retry_time <= Clock::now();
+}
+
+void MultipathBoard::record_success(BoardPath path, double latency_ms) {
+  Path *p = &paths_[path];
+  ++p->stats.num_requests;
+  if (p->stats.srtt_ms == 0.0) {
+    p->stats.srtt_ms = latency_ms;
+  } else {
+    p->stats.srtt_ms += LATENCY_GAIN * (latency_ms - p->stats.srtt_ms);
+  }
+  p->stats.last_latency_ms = latency_ms;
+  p->num_failures_in_row = 0;
+  p->retry_time = Clock::time_point();
+}
+
+void MultipathBoard::record_failure(BoardPath path) {
+  Path *p = &paths_[path];
+  ++p->stats.num_requests;
+  ++p->stats.num_failures;
+  int backoff_ms = MIN_PATH_BACKOFF_MS;
+  for (int i = 0; i < p->num_failures_in_row &&
+                  backoff_ms < MAX_PATH_BACKOFF_MS; ++i) {
+    backoff_ms *= 2;
+  }
+  ++p->num_failures_in_row;
+  p->retry_time = Clock::now() + std::chrono::milliseconds(
+      std::min(backoff_ms, MAX_PATH_BACKOFF_MS));
+}
+
+int MultipathBoard::route(PathCommand command, void *data, bool idempotent) {
+  BoardPath path = preferred_path();
+  if (path == NUM_BOARD_PATHS) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  if (idempotent) {
+    BoardPath other = path == BOARD_PATH_USB ? BOARD_PATH_LAN
+                                             : BOARD_PATH_USB;
+    Clock::time_point now = Clock::now();
+    if (is_configured(other) &&
+        paths_[other].retry_time <= now &&
+        now - paths_[other].last_use_time >=
+            std::chrono::milliseconds(PATH_PROBE_INTERVAL_MS)) {
+      path = other;
+    }
+  }
+  /* Every path gets a single attempt. */
+  for (int attempt = 0;; ++attempt) {
+    Clock::time_point start_time = Clock::now();
+    paths_[path].last_use_time = start_time;
+    bool may_fail_over = true;
+    int r = (this->*command)(path, data, &may_fail_over);
+    if (!is_path_failure(r)) {
+      record_success(path, std::chrono::duration<double, std::milli>(
+          Clock::now() - start_time).count());
+      return r;
+    }
+    record_failure(path);
+    /* Other path is tried even if it failed recently, it's the only chance
+     * for the command to get through.
+     */
+    BoardPath other = path == BOARD_PATH_USB ? BOARD_PATH_LAN
+                                             : BOARD_PATH_USB;
+    if (!may_fail_over ||
+        !is_configured(other) ||
+        attempt + 1 == NUM_BOARD_PATHS) {
+      return r;
+    }
+    ++paths_[path].stats.num_failovers;
+    path = other;
+  }
+}
+
+int MultipathBoard::press_over(BoardPath path,
+                               void *data,
+                               bool *r_may_fail_over) {
+  const PressRequest &request = *(const PressRequest *)data;
+  if (path == BOARD_PATH_USB) {
+    /* Report which failed to go out never reached the firmware. */
+    return device_->press(request);
+  }
+  std::vector<LanRequest> requests(1);
+  requests[0].address = lan_address_;
+  requests[0].action = request.force ? LAN_HOLD : LAN_PRESS;
+  requests[0].pc = request.pc;
+  std::vector<LanResult> results;
+  int r = lan_run(requests, 1, lan_timeout_ms_, &results);
+  if (r < 0) {
+    return lan_error_to_libusb(r);
+  }
+  *r_may_fail_over = !results[0].sent;
+  return lan_error_to_libusb(results[0].result);
+}
+
+int MultipathBoard::get_status_over(BoardPath path,
+                                    void *data,
+                                    bool * /*r_may_fail_over*/) {
+  StatusAnswer *answer = (StatusAnswer *)data;
+  if (path == BOARD_PATH_USB) {
+    return device_->get_status(answer);
+  }
+  std::vector<LanRequest> requests(1);
+  requests[0].address = lan_address_;
+  requests[0].action = LAN_STATUS;
+  requests[0].pc = 0;
+  std::vector<LanResult> results;
+  int r = lan_run(requests, 1, lan_timeout_ms_, &results);
+  if (r < 0) {
+    return lan_error_to_libusb(r);
+  }
+  const LanResult &result = results[0];
+  if (result.result < 0) {
+    return lan_error_to_libusb(result.result);
+  }
+  answer->num_pcs = result.num_pcs;
+  for (int i = 0; i < result.num_pcs; ++i) {
+    answer->status[i] = result.pcs[i].status;
+  }
+  return 0;
+}
+
+int MultipathBoard::press(const PressRequest &request) {
+  /* Web interface doesn't check the computer, see APP_network_loop(). */
+  if (request.pc < 0 || request.pc >= NUM_PCS) {
+    return LIBUSB_ERROR_INVALID_PARAM;
+  }
+  return route(&MultipathBoard::press_over, (void *)&request, false);
+}
+
+int MultipathBoard::get_status(StatusAnswer *r_answer) {
+  return route(&MultipathBoard::get_status_over, r_answer, true);
+}
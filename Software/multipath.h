@@ -0,0 +1,120 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __MULTIPATH_H__
+#define __MULTIPATH_H__
+
+#include <chrono>
+#include <string>
+
+#include "pcremote.h"
+
+/* Board which is reachable over USB and over its web interface at the same
+ * time.
+ *
+ * Every command takes the healthy path with the lowest recent latency. When
+ * the path fails the command is sent over the other one right away, and the
+ * failed path is skipped for a while, longer after every failure in a row.
+ * A press is only moved when it surely didn't reach the board, otherwise
+ * the computer could be toggled twice. Status queries now and then go over
+ * the slower path, so its latency doesn't get stale.
+ */
+
+enum BoardPath {
+  BOARD_PATH_USB,
+  BOARD_PATH_LAN,
+  NUM_BOARD_PATHS,
+};
+
+struct PathStats {
+  /* Path was given to the board. */
+  bool configured;
+  /* Not skipped because of recent failures. */
+  bool healthy;
+  int num_requests;
+  int num_failures;
+  /* Failed commands which were moved to the other path. */
+  int num_failovers;
+  /* Smoothed latency of the recent commands, zero before the first one. */
+  double srtt_ms;
+  double last_latency_ms;
+};
+
+class MultipathBoard {
+ public:
+  MultipathBoard();
+
+  /* The device is opened by the caller and must not be collecting a
+   * frame. NULL when there is no USB path.
+   */
+  void set_usb_path(Device *device);
+  /* <ip>[:<port>] of the web interface, see lan_run(). Empty address
+   * removes the path.
+   */
+  void set_lan_path(const std::string &address, int timeout_ms);
+
+  /* Commands which the web interface has too, everything else is only
+   * available on the device itself. Errors are libusb ones, same as for
+   * Device.
+   */
+  int press(const PressRequest &request);
+  int get_status(StatusAnswer *r_answer);
+
+  /* Path the next command takes, NUM_BOARD_PATHS when there is none. */
+  BoardPath preferred_path(void) const;
+  void path_stats(BoardPath path, PathStats *r_stats) const;
+
+ protected:
+  typedef std::chrono::steady_clock Clock;
+
+  /* Run the command over the path. may_fail_over is cleared when the
+   * board could have acted on the command despite the error.
+   */
+  typedef int (MultipathBoard::*PathCommand)(BoardPath path,
+                                             void *data,
+                                             bool *r_may_fail_over);
+
+  /* Idempotent commands may be used to measure the other path. */
+  int route(PathCommand command, void *data, bool idempotent);
+  int press_over(BoardPath path, void *data, bool *r_may_fail_over);
+  int get_status_over(BoardPath path, void *data, bool *r_may_fail_over);
+
+  bool is_configured(BoardPath path) const;
+  void record_success(BoardPath path, double latency_ms);
+  void record_failure(BoardPath path);
+
+  struct Path {
+    PathStats stats;
+    int num_failures_in_row;
+    /* Path is skipped until then after a failure. */
+    Clock::time_point retry_time;
+    Clock::time_point last_use_time;
+  };
+
+  Device *device_;
+  std::string lan_address_;
+  int lan_timeout_ms_;
+  Path paths_[NUM_BOARD_PATHS];
+};
+
+const char *board_path_name(BoardPath path);
+
+#endif  /* __MULTIPATH_H__ */
@@ -0,0 +1,628 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "pcremote.h"
+
+#include <string.h>
+
+#include <libusb.h>
+
+#include "device.h"
+
+namespace {
+
+/* Device which owns the opened board. */
+Device *open_board = NULL;
+
+void init_report(int command, unsigned char report[PACKET_INT_LEN]) {
+  memset(report, 0, PACKET_INT_LEN);
+  report[0] = command;
+}
+
+bool is_pc_valid(int pc) {
+  return pc >= 0 && pc < NUM_PCS;
+}
+
+void copy_name(const unsigned char *data, char name[PC_MAX_NAME + 1]) {
+  memcpy(name, data, PC_MAX_NAME);
+  name[PC_MAX_NAME] = '\0';
+}
+
+}  /* namespace */
+
+int encode_request(const PressRequest &request,
+                   unsigned char report[PACKET_INT_LEN]) {
+  if (!is_pc_valid(request.pc)) {
+    return LIBUSB_ERROR_INVALID_PARAM;
+  }
+  init_report(COMMAND_SWITCH_PRESS, report);
+  report[1] = request.pc;
+  report[2] = request.force ? 1 : 0;
+  return 0;
+}
+
+int encode_request(const SetAutobootRequest &request,
+                   unsigned char report[PACKET_INT_LEN]) {
+  if (!is_pc_valid(request.pc)) {
+    return LIBUSB_ERROR_INVALID_PARAM;
+  }
+  init_report(COMMAND_CFG_SET_AUTOBOOT, report);
+  report[1] = request.pc;
+  report[2] = request.enabled ? 1 : 0;
+  return 0;
+}
+
+int encode_request(const SetIpRequest &request,
+                   unsigned char report[PACKET_INT_LEN]) {
+  init_report(COMMAND_CFG_SET_IP, report);
+  memcpy(report + 1, request.ip, 4);
+  return 0;
+}
+
+int encode_request(const SetMacRequest &request,
+                   unsigned char report[PACKET_INT_LEN]) {
+  init_report(COMMAND_CFG_SET_MAC, report);
+  memcpy(report + 1, request.mac, 6);
+  return 0;
+}
+
+int encode_request(const SetNameRequest &request,
+                   unsigned char report[PACKET_INT_LEN]) {
+  if (!is_pc_valid(request.pc) || request.name == NULL) {
+    return LIBUSB_ERROR_INVALID_PARAM;
+  }
+  init_report(COMMAND_CFG_SET_PC_NAME, report);
+  report[1] = request.pc;
+  /* Firmware takes name length from the frame record, so the name is not
+   * padded with zeros there.
+   */
+  strncpy((char *)report + 2, request.name, PC_MAX_NAME);
+  return 0;
+}
+
+int encode_request(const GetAutobootRequest &request,
+                   unsigned char report[PACKET_INT_LEN]) {
+  if (!is_pc_valid(request.pc)) {
+    return LIBUSB_ERROR_INVALID_PARAM;
+  }
+  init_report(COMMAND_CFG_GET_AUTOBOOT, report);
+  report[1] = request.pc;
+  return 0;
+}
+
+int encode_request(const GetNameRequest &request,
+                   unsigned char report[PACKET_INT_LEN]) {
+  if (!is_pc_valid(request.pc)) {
+    return LIBUSB_ERROR_INVALID_PARAM;
+  }
+  init_report(COMMAND_CFG_GET_PC_NAME, report);
+  report[1] = request.pc;
+  return 0;
+}
+
+void decode_answer(const unsigned char answer[PACKET_INT_LEN],
+                   IpAnswer *r_answer) {
+  memcpy(r_answer->ip, answer, 4);
+}
+
+void decode_answer(const unsigned char answer[PACKET_INT_LEN],
+                   MacAnswer *r_answer) {
+  memcpy(r_answer->mac, answer, 6);
+}
+
+void decode_answer(const unsigned char answer[PACKET_INT_LEN],
+                   StatusAnswer *r_answer) {
+  r_answer->num_pcs = answer[0];
+  if (r_answer->num_pcs > NUM_PCS) {
+    r_answer->num_pcs = NUM_PCS;
+  }
+  memset(r_answer->status, 0, sizeof(r_answer->status));
+  memcpy(r_answer->status, answer + 1, r_answer->num_pcs);
+}
+
+void decode_answer(const unsigned char answer[PACKET_INT_LEN],
+                   AutobootAnswer *r_answer) {
+  r_answer->enabled = answer[0] != 0;
+}
+
+void decode_answer(const unsigned char answer[PACKET_INT_LEN],
+                   NameAnswer *r_answer) {
+  copy_name(answer, r_answer->name);
+}
+
+void decode_answer(const unsigned char answer[PACKET_INT_LEN],
+                   SnapshotAnswer *r_answer) {
+  memset(r_answer, 0, sizeof(*r_answer));
+  memcpy(r_answer->ip, answer + SNAPSHOT_IP_OFFSET, 4);
+  memcpy(r_answer->mac, answer + SNAPSHOT_MAC_OFFSET, 6);
+  r_answer->num_pcs = answer[SNAPSHOT_NUM_PCS_OFFSET];
+  if (r_answer->num_pcs > NUM_PCS) {
+    r_answer->num_pcs = NUM_PCS;
+  }
+  r_answer->has_autoboot = true;
+  for (int i = 0; i < r_answer->num_pcs; ++i) {
+    const unsigned char *pc_data =
+        answer + SNAPSHOT_PC_OFFSET + i * SNAPSHOT_PC_SIZE;
+    r_answer->pcs[i].status = pc_data[0];
+    r_answer->pcs[i].autoboot = pc_data[1] != 0;
+    copy_name(pc_data + 2, r_answer->pcs[i].name);
+  }
+}
+
+void decode_answer(const unsigned char answer[PACKET_INT_LEN],
+                   CapabilitiesAnswer *r_answer) {
+  r_answer->protocol_version = answer[CAPABILITIES_VERSION_OFFSET];
+  r_answer->num_pcs = answer[CAPABILITIES_NUM_PCS_OFFSET];
+  r_answer->max_name = answer[CAPABILITIES_MAX_NAME_OFFSET];
+  r_answer->report_size = answer[CAPABILITIES_REPORT_SIZE_OFFSET];
+  r_answer->queue_size = answer[CAPABILITIES_QUEUE_SIZE_OFFSET];
+  r_answer->max_frame_size = answer[CAPABILITIES_FRAME_SIZE_OFFSET];
+  memcpy(r_answer->commands,
+         answer + CAPABILITIES_BITMAP_OFFSET,
+         CAPABILITIES_BITMAP_SIZE);
+}
+
+void legacy_capabilities(CapabilitiesAnswer *r_answer) {
+  memset(r_answer, 0, sizeof(*r_answer));
+  r_answer->num_pcs = NUM_PCS;
+  r_answer->max_name = PC_MAX_NAME;
+  r_answer->report_size = PACKET_INT_LEN;
+  /* Answer was dropped when the endpoint was busy. */
+  r_answer->queue_size = 1;
+  const int commands[] = {
+    COMMAND_TEST,
+    COMMAND_SWITCH_PRESS,
+    COMMAND_CFG_SET_AUTOBOOT,
+    COMMAND_CFG_SET_IP,
+    COMMAND_CFG_SET_MAC,
+    COMMAND_CFG_SET_PC_NAME,
+    COMMAND_CFG_GET_AUTOBOOT,
+    COMMAND_CFG_GET_IP,
+    COMMAND_CFG_GET_MAC,
+    COMMAND_GET_STATUS,
+    COMMAND_CFG_GET_PC_NAME,
+  };
+  for (size_t i = 0; i < sizeof(commands) / sizeof(*commands); ++i) {
+    int bit = commands[i] - COMMAND_FIRST;
+    r_answer->commands[bit / 8] |= 1 << (bit % 8);
+  }
+}
+
+bool capabilities_has_command(const CapabilitiesAnswer &capabilities,
+                              int command) {
+  int bit = command - COMMAND_FIRST;
+  if (bit < 0 || bit >= CAPABILITIES_BITMAP_SIZE * 8) {
+    return false;
+  }
+  return (capabilities.commands[bit / 8] & (1 << (bit % 8))) != 0;
+}
+
+const char *command_status_name(int status) {
+  switch (status) {
+    case COMMAND_STATUS_OK: return "ok";
+    case COMMAND_STATUS_INVALID_ARGUMENT: return "invalid argument";
+    case COMMAND_STATUS_UNKNOWN_COMMAND: return "unknown command";
+    case COMMAND_STATUS_NO_SPACE: return "no space";
+  }
+  return "unknown status";
+}
+
+const char *command_name(int command) {
+  switch (command) {
+    case COMMAND_TEST: return "test";
+    case COMMAND_SWITCH_PRESS: return "press";
+    case COMMAND_CFG_SET_AUTOBOOT: return "set_autoboot";
+    case COMMAND_CFG_SET_IP: return "set_ip";
+    case COMMAND_CFG_SET_MAC: return "set_mac";
+    case COMMAND_CFG_SET_PC_NAME: return "set_pc_name";
+    case COMMAND_CFG_GET_AUTOBOOT: return "get_autoboot";
+    case COMMAND_CFG_GET_IP: return "get_ip";
+    case COMMAND_CFG_GET_MAC: return "get_mac";
+    case COMMAND_GET_STATUS: return "get_status";
+    case COMMAND_CFG_GET_PC_NAME: return "get_pc_name";
+    case COMMAND_GET_SNAPSHOT: return "get_snapshot";
+    case COMMAND_FRAME: return "frame";
+    case COMMAND_SET_EVENTS: return "set_events";
+    case COMMAND_GET_CAPABILITIES: return "get_capabilities";
+  }
+  return "unknown";
+}
+
+Device::Device()
+    : open_(false),
+      capabilities_checked_(false),
+      capabilities_known_(false),
+      frames_checked_(false),
+      frames_supported_(false),
+      collecting_(false) {
+  frame_init(&frame_);
+}
+
+Device::~Device() {
+  close();
+}
+
+int Device::open(bool allow_daemon) {
+  close();
+  if (open_board != NULL) {
+    return LIBUSB_ERROR_BUSY;
+  }
+  int r = device_open(allow_daemon);
+  if (r < 0) {
+    return r;
+  }
+  open_ = true;
+  open_board = this;
+  return 0;
+}
+
+void Device::close(void) {
+  if (!open_) {
+    return;
+  }
+  cancel_frame();
+  device_close();
+  open_ = false;
+  open_board = NULL;
+  capabilities_checked_ = false;
+  frames_checked_ = false;
+}
+
+bool Device::is_open(void) const {
+  return open_;
+}
+
+int Device::send(unsigned char report[PACKET_INT_LEN]) {
+  if (!collecting_) {
+    return device_send_buffer(report);
+  }
+  if (frame_add_report(&frame_, report)) {
+    return 0;
+  }
+  int r = send_frame();
+  if (r < 0) {
+    return r;
+  }
+  frame_add_report(&frame_, report);
+  return 0;
+}
+
+int Device::request(unsigned char report[PACKET_INT_LEN],
+                    unsigned char answer[PACKET_INT_LEN]) {
+  int request = device_submit_request(report);
+  if (request < 0) {
+    return request;
+  }
+  return device_wait_answer(request, answer);
+}
+
+int Device::test(void) {
+  unsigned char report[PACKET_INT_LEN];
+  init_report(COMMAND_TEST, report);
+  return send(report);
+}
+
+int Device::press(const PressRequest &request) {
+  unsigned char report[PACKET_INT_LEN];
+  int r = encode_request(request, report);
+  return r < 0 ? r : send(report);
+}
+
+int Device::set_autoboot(const SetAutobootRequest &request) {
+  unsigned char report[PACKET_INT_LEN];
+  int r = encode_request(request, report);
+  return r < 0 ? r : send(report);
+}
+
+int Device::set_ip(const SetIpRequest &request) {
+  unsigned char report[PACKET_INT_LEN];
+  int r = encode_request(request, report);
+  return r < 0 ? r : send(report);
+}
+
+int Device::set_mac(const SetMacRequest &request) {
+  unsigned char report[PACKET_INT_LEN];
+  int r = encode_request(request, report);
+  return r < 0 ? r : send(report);
+}
+
+int Device::set_name(const SetNameRequest &request) {
+  unsigned char report[PACKET_INT_LEN];
+  int r = encode_request(request, report);
+  return r < 0 ? r : send(report);
+}
+
+int Device::get_autoboot(const GetAutobootRequest &request,
+                         AutobootAnswer *r_answer) {
+  unsigned char report[PACKET_INT_LEN], answer[PACKET_INT_LEN];
+  int r = encode_request(request, report);
+  if (r == 0) {
+    r = this->request(report, answer);
+  }
+  if (r < 0) {
+    return r;
+  }
+  decode_answer(answer, r_answer);
+  return 0;
+}
+
+int Device::get_ip(IpAnswer *r_answer) {
+  unsigned char report[PACKET_INT_LEN], answer[PACKET_INT_LEN];
+  init_report(COMMAND_CFG_GET_IP, report);
+  int r = request(report, answer);
+  if (r < 0) {
+    return r;
+  }
+  decode_answer(answer, r_answer);
+  return 0;
+}
+
+int Device::get_mac(MacAnswer *r_answer) {
+  unsigned char report[PACKET_INT_LEN], answer[PACKET_INT_LEN];
+  init_report(COMMAND_CFG_GET_MAC, report);
+  int r = request(report, answer);
+  if (r < 0) {
+    return r;
+  }
+  decode_answer(answer, r_answer);
+  return 0;
+}
+
+int Device::get_status(StatusAnswer *r_answer) {
+  unsigned char report[PACKET_INT_LEN], answer[PACKET_INT_LEN];
+  init_report(COMMAND_GET_STATUS, report);
+  int r = request(report, answer);
+  if (r < 0) {
+    return r;
+  }
+  decode_answer(answer, r_answer);
+  return 0;
+}
+
+int Device::get_name(const GetNameRequest &request, NameAnswer *r_answer) {
+  unsigned char report[PACKET_INT_LEN], answer[PACKET_INT_LEN];
+  int r = encode_request(request, report);
+  if (r == 0) {
+    r = this->request(report, answer);
+  }
+  if (r < 0) {
+    return r;
+  }
+  decode_answer(answer, r_answer);
+  return 0;
+}
+
+int Device::get_snapshot(SnapshotAnswer *r_answer) {
+  int r;
+  if (may_support(COMMAND_GET_SNAPSHOT)) {
+    unsigned char report[PACKET_INT_LEN], answer[PACKET_INT_LEN];
+    init_report(COMMAND_GET_SNAPSHOT, report);
+    r = request(report, answer);
+    if (r >= 0) {
+      decode_answer(answer, r_answer);
+      return 0;
+    }
+    /* Lost answer is not a reason to fall back when the firmware told it
+     * knows the command.
+     */
+    if (r != LIBUSB_ERROR_TIMEOUT || capabilities_known_) {
+      return r;
+    }
+  }
+  /* Firmware doesn't know the snapshot, retrieve status field by field. */
+  memset(r_answer, 0, sizeof(*r_answer));
+  IpAnswer ip;
+  if ((r = get_ip(&ip)) < 0) {
+    return r;
+  }
+  memcpy(r_answer->ip, ip.ip, 4);
+  MacAnswer mac;
+  if ((r = get_mac(&mac)) < 0) {
+    return r;
+  }
+  memcpy(r_answer->mac, mac.mac, 6);
+  StatusAnswer status;
+  if ((r = get_status(&status)) < 0) {
+    return r;
+  }
+  r_answer->num_pcs = status.num_pcs;
+  r_answer->has_autoboot = false;
+  for (int i = 0; i < status.num_pcs; ++i) {
+    GetNameRequest name_request = {i};
+    NameAnswer name;
+    if ((r = get_name(name_request, &name)) < 0) {
+      return r;
+    }
+    r_answer->pcs[i].status = status.status[i];
+    memcpy(r_answer->pcs[i].name, name.name, sizeof(name.name));
+  }
+  return 0;
+}
+
+int Device::get_capabilities(CapabilitiesAnswer *r_answer) {
+  if (!capabilities_checked_) {
+    unsigned char report[PACKET_INT_LEN], answer[PACKET_INT_LEN];
+    init_report(COMMAND_GET_CAPABILITIES, report);
+    int r = request(report, answer);
+    if (r == 0) {
+      decode_answer(answer, &capabilities_);
+      capabilities_known_ = true;
+    } else if (r == LIBUSB_ERROR_TIMEOUT) {
+      legacy_capabilities(&capabilities_);
+      capabilities_known_ = false;
+    } else {
+      return r;
+    }
+    capabilities_checked_ = true;
+  }
+  *r_answer = capabilities_;
+  return 0;
+}
+
+bool Device::may_support(int command) {
+  CapabilitiesAnswer capabilities;
+  if (get_capabilities(&capabilities) < 0) {
+    /* Let the command itself fail. */
+    return true;
+  }
+  return !capabilities_known_ ||
+         capabilities_has_command(capabilities, command);
+}
+
+int Device::supports_frames(bool *r_supported) {
+  if (!may_support(COMMAND_FRAME)) {
+    *r_supported = false;
+    return 0;
+  }
+  if (capabilities_known_) {
+    *r_supported = true;
+    return 0;
+  }
+  if (!frames_checked_) {
+    unsigned char report[PACKET_INT_LEN], answer[PACKET_INT_LEN];
+    Frame probe;
+    frame_init(&probe);
+    init_report(COMMAND_TEST, report);
+    frame_add_report(&probe, report);
+    int request = device_submit_request(probe.buffer);
+    if (request < 0) {
+      return request;
+    }
+    int r = device_wait_answer_for(request, answer, PROBE_TIMEOUT);
+    if (r == 0) {
+      frames_supported_ = true;
+    } else if (r == LIBUSB_ERROR_TIMEOUT) {
+      frames_supported_ = false;
+    } else {
+      return r;
+    }
+    frames_checked_ = true;
+  }
+  *r_supported = frames_supported_;
+  return 0;
+}
+
+void Device::command_stats(int command, CommandStats *r_stats) const {
+  device_command_stats(command, r_stats);
+}
+
+void Device::begin_frame(void) {
+  collecting_ = true;
+  frame_init(&frame_);
+  frame_statuses_.clear();
+}
+
+bool Device::is_collecting_frame(void) const {
+  return collecting_;
+}
+
+int Device::num_frame_commands(void) const {
+  return frame_statuses_.size() + frame_.num_commands;
+}
+
+int Device::end_frame(std::vector<FrameStatus> *r_statuses) {
+  int r = send_frame();
+  collecting_ = false;
+  r_statuses->swap(frame_statuses_);
+  frame_statuses_.clear();
+  return r;
+}
+
+void Device::cancel_frame(void) {
+  collecting_ = false;
+  frame_init(&frame_);
+  frame_statuses_.clear();
+}
+
+/* Send commands from the frame one by one, for older firmware. */
+int Device::send_frame_reports(int first_command) {
+  for (int i = first_command; i < frame_.num_commands; ++i) {
+    unsigned char report[PACKET_INT_LEN];
+    frame_get_report(&frame_, i, report);
+    int r = device_send_buffer(report);
+    if (r < 0) {
+      return r;
+    }
+    FrameStatus status = {report[0], COMMAND_STATUS_OK};
+    frame_statuses_.push_back(status);
+  }
+  return 0;
+}
+
+/* Send all collected commands, the frame is empty afterwards even when
+ * sending failed.
+ */
+int Device::send_frame(void) {
+  int first_command = 0;
+  int r = 0;
+  if (frame_.num_commands != 0) {
+    bool supported;
+    r = supports_frames(&supported);
+    if (r < 0 || !supported) {
+      if (r == 0) {
+        r = send_frame_reports(0);
+      }
+      frame_init(&frame_);
+      return r;
+    }
+  }
+  while (first_command < frame_.num_commands) {
+    Frame current;
+    frame_init(&current);
+    for (int i = first_command; i < frame_.num_commands; ++i) {
+      unsigned char report[PACKET_INT_LEN];
+      frame_get_report(&frame_, i, report);
+      frame_add_report(&current, report);
+    }
+    unsigned char answer[PACKET_INT_LEN];
+    /* Commands of the frame might have executed even when its answer is
+     * lost, so they're never sent again.
+     */
+    r = request(current.buffer, answer);
+    if (r < 0) {
+      break;
+    }
+    FrameResult results[PACKET_INT_LEN];
+    int num_results = frame_parse_answer(answer, results, PACKET_INT_LEN);
+    if (num_results <= 0) {
+      r = LIBUSB_ERROR_IO;
+      break;
+    }
+    /* Commands which didn't fit go to the next frame. */
+    if (results[num_results - 1].status == COMMAND_STATUS_NO_SPACE) {
+      --num_results;
+    }
+    if (num_results == 0) {
+      /* Not even the first command fits, the same frame would be sent
+       * forever. Send the rest as separate reports.
+       */
+      r = send_frame_reports(first_command);
+      break;
+    }
+    for (int i = 0; i < num_results; ++i) {
+      FrameStatus status = {results[i].command, results[i].status};
+      frame_statuses_.push_back(status);
+    }
+    first_command += num_results;
+  }
+  frame_init(&frame_);
+  return r;
+}
@@ -0,0 +1,275 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __PCREMOTE_H__
+#define __PCREMOTE_H__
+
+#include <vector>
+
+#include "frame.h"
+#include "protocol.h"
+#include "retry_policy.h"
+
+/* libpcremote: typed access to the board for applications which embed it.
+ *
+ * All functions return 0 or a negative libusb error code. Besides transport
+ * errors there are LIBUSB_ERROR_INVALID_PARAM for arguments the board would
+ * reject, LIBUSB_ERROR_NOT_SUPPORTED for commands the firmware doesn't know
+ * and LIBUSB_ERROR_IO for malformed answers.
+ */
+
+/* Requests of the commands which take arguments. */
+
+struct PressRequest {
+  int pc;
+  /* Hold the switch long enough to force the computer off. */
+  bool force;
+};
+
+struct SetAutobootRequest {
+  int pc;
+  bool enabled;
+};
+
+struct SetIpRequest {
+  unsigned char ip[4];
+};
+
+struct SetMacRequest {
+  unsigned char mac[6];
+};
+
+struct SetNameRequest {
+  int pc;
+  /* Longer names are truncated to PC_MAX_NAME. */
+  const char *name;
+};
+
+struct GetAutobootRequest {
+  int pc;
+};
+
+struct GetNameRequest {
+  int pc;
+};
+
+/* Answers. */
+
+struct IpAnswer {
+  unsigned char ip[4];
+};
+
+struct MacAnswer {
+  unsigned char mac[6];
+};
+
+struct StatusAnswer {
+  int num_pcs;
+  /* PC_STATUS_* bits of every computer. */
+  unsigned char status[NUM_PCS];
+};
+
+struct AutobootAnswer {
+  bool enabled;
+};
+
+struct NameAnswer {
+  char name[PC_MAX_NAME + 1];
+};
+
+struct SnapshotAnswer {
+  unsigned char ip[4];
+  unsigned char mac[6];
+  int num_pcs;
+  /* False when the snapshot was assembled from separate queries, older
+   * firmware has no way to report autoboot of all computers at once.
+   */
+  bool has_autoboot;
+  struct {
+    unsigned char status;
+    bool autoboot;
+    char name[PC_MAX_NAME + 1];
+  } pcs[NUM_PCS];
+};
+
+/* What the firmware supports. Firmware which predates the capabilities
+ * command is described by legacy_capabilities().
+ */
+struct CapabilitiesAnswer {
+  /* Zero for the firmware without COMMAND_GET_CAPABILITIES. */
+  int protocol_version;
+  int num_pcs;
+  int max_name;
+  int report_size;
+  /* Number of answers the firmware queues while the endpoint is busy. */
+  int queue_size;
+  /* Space for COMMAND_FRAME records. */
+  int max_frame_size;
+  unsigned char commands[CAPABILITIES_BITMAP_SIZE];
+};
+
+/* Result of a single command sent within a frame. */
+struct FrameStatus {
+  int command;
+  /* COMMAND_STATUS_* */
+  int status;
+};
+
+/* Conversion between the typed requests/answers and 64 byte reports. */
+int encode_request(const PressRequest &request,
+                   unsigned char report[PACKET_INT_LEN]);
+int encode_request(const SetAutobootRequest &request,
+                   unsigned char report[PACKET_INT_LEN]);
+int encode_request(const SetIpRequest &request,
+                   unsigned char report[PACKET_INT_LEN]);
+int encode_request(const SetMacRequest &request,
+                   unsigned char report[PACKET_INT_LEN]);
+int encode_request(const SetNameRequest &request,
+                   unsigned char report[PACKET_INT_LEN]);
+int encode_request(const GetAutobootRequest &request,
+                   unsigned char report[PACKET_INT_LEN]);
+int encode_request(const GetNameRequest &request,
+                   unsigned char report[PACKET_INT_LEN]);
+
+void decode_answer(const unsigned char answer[PACKET_INT_LEN],
+                   IpAnswer *r_answer);
+void decode_answer(const unsigned char answer[PACKET_INT_LEN],
+                   MacAnswer *r_answer);
+void decode_answer(const unsigned char answer[PACKET_INT_LEN],
+                   StatusAnswer *r_answer);
+void decode_answer(const unsigned char answer[PACKET_INT_LEN],
+                   AutobootAnswer *r_answer);
+void decode_answer(const unsigned char answer[PACKET_INT_LEN],
+                   NameAnswer *r_answer);
+void decode_answer(const unsigned char answer[PACKET_INT_LEN],
+                   SnapshotAnswer *r_answer);
+void decode_answer(const unsigned char answer[PACKET_INT_LEN],
+                   CapabilitiesAnswer *r_answer);
+
+/* Capabilities of the firmware which doesn't answer
+ * COMMAND_GET_CAPABILITIES. Only the original commands are listed, the
+ * optional ones have to be probed.
+ */
+void legacy_capabilities(CapabilitiesAnswer *r_answer);
+bool capabilities_has_command(const CapabilitiesAnswer &capabilities,
+                              int command);
+
+const char *command_status_name(int status);
+/* Short lowercase name of the COMMAND_* opcode. */
+const char *command_name(int command);
+
+/* Handle of the opened board, it's closed when the handle goes away.
+ *
+ * The board is chosen with device_select() and device_set_backend(). There
+ * is only one opened board per process, use separate processes to talk to
+ * several boards at once.
+ */
+class Device {
+ public:
+  Device();
+  ~Device();
+
+  Device(const Device &other) = delete;
+  Device &operator=(const Device &other) = delete;
+
+  /* See device_open(). The board lives in the globals of device.cc, so
+   * only one Device can be open at a time, opening another one fails with
+   * LIBUSB_ERROR_BUSY.
+   */
+  int open(bool allow_daemon = true);
+  void close(void);
+  bool is_open(void) const;
+
+  int test(void);
+  int press(const PressRequest &request);
+  int set_autoboot(const SetAutobootRequest &request);
+  int set_ip(const SetIpRequest &request);
+  int set_mac(const SetMacRequest &request);
+  int set_name(const SetNameRequest &request);
+
+  int get_autoboot(const GetAutobootRequest &request,
+                   AutobootAnswer *r_answer);
+  int get_ip(IpAnswer *r_answer);
+  int get_mac(MacAnswer *r_answer);
+  int get_status(StatusAnswer *r_answer);
+  int get_name(const GetNameRequest &request, NameAnswer *r_answer);
+
+  /* Everything at once, in a single round trip when the firmware supports
+   * COMMAND_GET_SNAPSHOT.
+   */
+  int get_snapshot(SnapshotAnswer *r_answer);
+
+  /* Asked once per opened device and cached, legacy_capabilities() are
+   * given for older firmware.
+   */
+  int get_capabilities(CapabilitiesAnswer *r_answer);
+
+  /* Round trip times, timeouts and retries of the command, see
+   * device_command_stats().
+   */
+  void command_stats(int command, CommandStats *r_stats) const;
+
+  /* Commands which don't have an answer are packed into COMMAND_FRAME
+   * reports between begin_frame() and end_frame() instead of being sent
+   * one by one. Frame is sent when it's full, so a command might fail with
+   * the error of the previously collected ones.
+   */
+  void begin_frame(void);
+  bool is_collecting_frame(void) const;
+  /* Number of commands collected since begin_frame(). */
+  int num_frame_commands(void) const;
+  /* Send the rest of the frame, statuses of all commands collected since
+   * begin_frame() are stored in r_statuses in the order they were added.
+   */
+  int end_frame(std::vector<FrameStatus> *r_statuses);
+  /* Stop collecting, commands which were not sent yet are dropped. */
+  void cancel_frame(void);
+
+ protected:
+  int send(unsigned char report[PACKET_INT_LEN]);
+  int request(unsigned char report[PACKET_INT_LEN],
+              unsigned char answer[PACKET_INT_LEN]);
+  int send_frame(void);
+  int send_frame_reports(int first_command);
+  /* False when the firmware reported it doesn't know the command. */
+  bool may_support(int command);
+  /* Frames can't be probed with real commands, those might execute even
+   * when the answer is late, so firmware without capabilities gets a frame
+   * with COMMAND_TEST first.
+   */
+  int supports_frames(bool *r_supported);
+
+  bool open_;
+  bool capabilities_checked_;
+  /* Firmware reported its capabilities, otherwise they're legacy ones and
+   * optional commands are probed.
+   */
+  bool capabilities_known_;
+  CapabilitiesAnswer capabilities_;
+  bool frames_checked_;
+  bool frames_supported_;
+  bool collecting_;
+  Frame frame_;
+  /* Statuses of the commands from begin_frame() which were already sent. */
+  std::vector<FrameStatus> frame_statuses_;
+};
+
+#endif  /* __PCREMOTE_H__ */
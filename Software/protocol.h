@@ -0,0 +1,148 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+#define VENDOR_ID 0x04d8
+#define PRODUCT_ID 0x003f
+
+#define COMMAND_TEST             0x80
+#define COMMAND_SWITCH_PRESS     0x81
+#define COMMAND_CFG_SET_AUTOBOOT 0x82
+#define COMMAND_CFG_SET_IP       0x83
+#define COMMAND_CFG_SET_MAC      0x84
+#define COMMAND_CFG_SET_PC_NAME  0x85
+#define COMMAND_CFG_GET_AUTOBOOT 0x86
+#define COMMAND_CFG_GET_IP       0x87
+#define COMMAND_CFG_GET_MAC      0x88
+#define COMMAND_GET_STATUS       0x89
+#define COMMAND_CFG_GET_PC_NAME  0x90
+#define COMMAND_GET_SNAPSHOT     0x91
+#define COMMAND_FRAME            0x92
+#define COMMAND_SET_EVENTS       0x93
+#define COMMAND_GET_CAPABILITIES 0x94
+
+/* Commands which are known to the protocol. */
+#define COMMAND_FIRST COMMAND_TEST
+#define COMMAND_LAST  COMMAND_GET_CAPABILITIES
+
+/* Unsolicited reports which firmware sends once events are enabled. */
+#define EVENT_STATUS_CHANGED 0x01
+
+/* Layout of the EVENT_STATUS_CHANGED report. */
+#define EVENT_CHANGES_OFFSET 1
+#define EVENT_NUM_PCS_OFFSET 2
+#define EVENT_STATUS_OFFSET 3
+
+/* Status of a single command in COMMAND_FRAME answer. */
+#define COMMAND_STATUS_OK               0
+#define COMMAND_STATUS_INVALID_ARGUMENT 1
+#define COMMAND_STATUS_UNKNOWN_COMMAND  2
+#define COMMAND_STATUS_NO_SPACE         3
+
+#define NUM_PCS 2
+#define PC_MAX_NAME 16
+
+/* Bits of the computer status. */
+#define PC_STATUS_ON         (1 << 0)
+#define PC_STATUS_WILL_PRESS (1 << 1)
+#define PC_STATUS_PRESSED    (1 << 2)
+
+/* Layout of the COMMAND_GET_SNAPSHOT answer, see app_device_custom_hid.c. */
+#define SNAPSHOT_IP_OFFSET 0
+#define SNAPSHOT_MAC_OFFSET 4
+#define SNAPSHOT_NUM_PCS_OFFSET 10
+#define SNAPSHOT_PC_OFFSET 11
+#define SNAPSHOT_PC_SIZE (2 + PC_MAX_NAME)
+
+/* Layout of the COMMAND_GET_CAPABILITIES answer. */
+#define CAPABILITIES_VERSION_OFFSET 0
+#define CAPABILITIES_NUM_PCS_OFFSET 1
+#define CAPABILITIES_MAX_NAME_OFFSET 2
+#define CAPABILITIES_REPORT_SIZE_OFFSET 3
+#define CAPABILITIES_QUEUE_SIZE_OFFSET 4
+#define CAPABILITIES_FRAME_SIZE_OFFSET 5
+/* Bit (command - 0x80) is set for every supported command. */
+#define CAPABILITIES_BITMAP_OFFSET 6
+#define CAPABILITIES_BITMAP_SIZE 16
+
+const int PACKET_INT_LEN = 64;
+const int INTERFACE = 0;
+const int ENDPOINT_INT_IN = 0x81; /* endpoint 0x81 address for IN */
+const int ENDPOINT_INT_OUT = 0x01; /* endpoint 1 address for OUT */
+const int TIMEOUT = 5000; /* timeout in ms */
+/* Timeout for commands which older firmware might not support. */
+const int PROBE_TIMEOUT = 250;
+
+/* Last byte of the report is the request ID, firmware echoes it in the
+ * answer. Zero is used for untagged requests, older firmware also answers
+ * with zero there.
+ */
+const int REQUEST_ID_OFFSET = 63;
+const int REQUEST_ID_NONE = 0;
+const int REQUEST_ID_MIN = 1;
+const int REQUEST_ID_MAX = 254;
+/* Request ID of unsolicited event reports. */
+const int REQUEST_ID_EVENT = 255;
+
+/* Commands for which the firmware sends an IN report back. */
+inline bool command_has_answer(int command) {
+  switch (command) {
+    case COMMAND_CFG_GET_AUTOBOOT:
+    case COMMAND_CFG_GET_IP:
+    case COMMAND_CFG_GET_MAC:
+    case COMMAND_GET_STATUS:
+    case COMMAND_CFG_GET_PC_NAME:
+    case COMMAND_GET_SNAPSHOT:
+    case COMMAND_FRAME:
+    case COMMAND_GET_CAPABILITIES:
+      return true;
+  }
+  return false;
+}
+
+/* Commands which older firmware ignores without sending an answer. */
+inline bool command_is_optional(int command) {
+  return command == COMMAND_GET_SNAPSHOT ||
+         command == COMMAND_GET_CAPABILITIES;
+}
+
+/* Queries which might be sent again when their answer is lost. */
+inline bool command_is_idempotent(int command) {
+  switch (command) {
+    case COMMAND_CFG_GET_AUTOBOOT:
+    case COMMAND_CFG_GET_IP:
+    case COMMAND_CFG_GET_MAC:
+    case COMMAND_GET_STATUS:
+    case COMMAND_CFG_GET_PC_NAME:
+    case COMMAND_GET_SNAPSHOT:
+    case COMMAND_GET_CAPABILITIES:
+      return true;
+  }
+  return false;
+}
+
+inline int command_answer_timeout(int command) {
+  return command_is_optional(command) ? PROBE_TIMEOUT : TIMEOUT;
+}
+
+#endif  /* __PROTOCOL_H__ */
@@ -0,0 +1,565 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "provision.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <set>
+
+#include <libusb.h>
+
+namespace {
+
+bool parse_ip(const std::string &value, unsigned char ip[4]) {
+  int parts[4];
+  char extra;
+  if (sscanf(value.c_str(), "%d.%d.%d.%d%c",
+             &parts[0], &parts[1], &parts[2], &parts[3], &extra) != 4) {
+    return false;
+  }
+  for (int i = 0; i < 4; ++i) {
+    if (parts[i] < 0 || parts[i] > 255) {
+      return false;
+    }
+    ip[i] = parts[i];
+  }
+  return true;
+}
+
+bool parse_mac(const std::string &value, unsigned char mac[6]) {
+  unsigned int parts[6];
+  char extra;
+  if (sscanf(value.c_str(), "%x:%x:%x:%x:%x:%x%c",
+             &parts[0], &parts[1], &parts[2],
+             &parts[3], &parts[4], &parts[5], &extra) != 6) {
+    return false;
+  }
+  for (int i = 0; i < 6; ++i) {
+    if (parts[i] > 255) {
+      return false;
+    }
+    mac[i] = parts[i];
+  }
+  return true;
+}
+
+bool parse_bool(const std::string &value, bool *r_value) {
+  static const char *true_values[] = {"1", "on", "true", "yes", "enabled"};
+  static const char *false_values[] = {"0", "off", "false", "no",
+                                       "disabled"};
+  for (size_t i = 0; i < sizeof(true_values) / sizeof(*true_values); ++i) {
+    if (strcasecmp(value.c_str(), true_values[i]) == 0) {
+      *r_value = true;
+      return true;
+    }
+  }
+  for (size_t i = 0; i < sizeof(false_values) / sizeof(*false_values); ++i) {
+    if (strcasecmp(value.c_str(), false_values[i]) == 0) {
+      *r_value = false;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string format_ip(const unsigned char ip[4]) {
+  char buffer[16];
+  snprintf(buffer, sizeof(buffer), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+  return buffer;
+}
+
+std::string format_mac(const unsigned char mac[6]) {
+  char buffer[18];
+  snprintf(buffer, sizeof(buffer), "%02x:%02x:%02x:%02x:%02x:%02x",
+           mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  return buffer;
+}
+
+/* Column of the CSV or key of the JSON object, per-computer fields have
+ * the computer number appended.
+ */
+bool set_field(const std::string &field,
+               const std::string &value,
+               ProvisionEntry *entry,
+               std::string *r_error) {
+  int pc = -1;
+  size_t digits = field.find_first_of("0123456789");
+  std::string name = field.substr(0, digits);
+  if (digits != std::string::npos) {
+    pc = atoi(field.c_str() + digits);
+    if (pc < 0 || pc >= NUM_PCS) {
+      *r_error = "no computer " + field.substr(digits);
+      return false;
+    }
+  }
+  bool ok = true;
+  if (name == "board" && pc == -1) {
+    entry->board = value;
+    ok = !value.empty();
+  } else if (name == "ip" && pc == -1) {
+    ok = entry->has_ip = parse_ip(value, entry->ip);
+  } else if (name == "mac" && pc == -1) {
+    ok = entry->has_mac = parse_mac(value, entry->mac);
+  } else if (name == "name" && pc != -1) {
+    ok = entry->pcs[pc].has_name = value.size() <= PC_MAX_NAME;
+    snprintf(entry->pcs[pc].name, sizeof(entry->pcs[pc].name),
+             "%s", value.c_str());
+  } else if (name == "autoboot" && pc != -1) {
+    ok = entry->pcs[pc].has_autoboot = parse_bool(value,
+                                                  &entry->pcs[pc].autoboot);
+  } else {
+    *r_error = "unknown field " + field;
+    return false;
+  }
+  if (!ok) {
+    *r_error = "invalid " + field + " \"" + value + "\"";
+  }
+  return ok;
+}
+
+void init_entry(ProvisionEntry *entry) {
+  entry->board.clear();
+  entry->has_ip = false;
+  entry->has_mac = false;
+  memset(entry->pcs, 0, sizeof(entry->pcs));
+}
+
+/* Cells of the CSV line, double quotes allow commas in the names. */
+std::vector<std::string> split_csv_line(const std::string &line) {
+  std::vector<std::string> cells(1);
+  bool quoted = false;
+  for (size_t i = 0; i < line.size(); ++i) {
+    char c = line[i];
+    if (c == '"') {
+      if (quoted && i + 1 < line.size() && line[i + 1] == '"') {
+        cells.back() += c;
+        ++i;
+      } else {
+        quoted = !quoted;
+      }
+    } else if (c == ',' && !quoted) {
+      cells.push_back(std::string());
+    } else if (c != '\r' && c != '\n') {
+      cells.back() += c;
+    }
+  }
+  for (size_t i = 0; i < cells.size(); ++i) {
+    size_t start = cells[i].find_first_not_of(" \t");
+    size_t end = cells[i].find_last_not_of(" \t");
+    cells[i] = start == std::string::npos
+                   ? std::string()
+                   : cells[i].substr(start, end - start + 1);
+  }
+  return cells;
+}
+
+bool parse_csv(const std::string &text,
+               std::vector<ProvisionEntry> *r_entries,
+               std::string *r_error) {
+  std::vector<std::string> columns;
+  size_t start = 0;
+  int line_number = 0;
+  while (start < text.size()) {
+    size_t end = text.find('\n', start);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    std::string line = text.substr(start, end - start);
+    start = end + 1;
+    ++line_number;
+    if (line.find_first_not_of(" \t\r") == std::string::npos ||
+        line[line.find_first_not_of(" \t")] == '#') {
+      continue;
+    }
+    std::vector<std::string> cells = split_csv_line(line);
+    if (columns.empty()) {
+      columns = cells;
+      continue;
+    }
+    if (cells.size() > columns.size()) {
+      *r_error = "line " + std::to_string(line_number) +
+                 ": more cells than columns";
+      return false;
+    }
+    ProvisionEntry entry;
+    init_entry(&entry);
+    for (size_t i = 0; i < cells.size(); ++i) {
+      std::string error;
+      if (!cells[i].empty() &&
+          !set_field(columns[i], cells[i], &entry, &error)) {
+        *r_error = "line " + std::to_string(line_number) + ": " + error;
+        return false;
+      }
+    }
+    r_entries->push_back(entry);
+  }
+  return true;
+}
+
+/* Just enough of JSON for the manifest, see provision_load_manifest(). */
+class JsonParser {
+ public:
+  JsonParser(const std::string &text) : text_(text), position_(0) {
+  }
+
+  bool parse(std::vector<ProvisionEntry> *r_entries, std::string *r_error) {
+    bool ok = expect('[');
+    if (ok && !accept(']')) {
+      do {
+        ProvisionEntry entry;
+        init_entry(&entry);
+        ok = parse_entry(&entry);
+        r_entries->push_back(entry);
+      } while (ok && accept(','));
+      ok = ok && expect(']');
+    }
+    skip_space();
+    if (ok && position_ != text_.size()) {
+      fail("unexpected data after the array");
+      ok = false;
+    }
+    if (!ok) {
+      *r_error = error_;
+    }
+    return ok;
+  }
+
+ protected:
+  void skip_space(void) {
+    while (position_ < text_.size() && isspace(text_[position_])) {
+      ++position_;
+    }
+  }
+
+  bool fail(const std::string &message) {
+    if (error_.empty()) {
+      error_ = "offset " + std::to_string(position_) + ": " + message;
+    }
+    return false;
+  }
+
+  bool accept(char c) {
+    skip_space();
+    if (position_ < text_.size() && text_[position_] == c) {
+      ++position_;
+      return true;
+    }
+    return false;
+  }
+
+  bool expect(char c) {
+    return accept(c) || fail(std::string("expected '") + c + "'");
+  }
+
+  bool parse_string(std::string *r_value) {
+    if (!expect('"')) {
+      return false;
+    }
+    r_value->clear();
+    while (position_ < text_.size() && text_[position_] != '"') {
+      char c = text_[position_++];
+      if (c == '\\' && position_ < text_.size()) {
+        c = text_[position_++];
+        switch (c) {
+          case 'n': c = '\n'; break;
+          case 't': c = '\t'; break;
+          case 'r': c = '\r'; break;
+          case 'b': c = '\b'; break;
+          case 'f': c = '\f'; break;
+          case 'u': return fail("unicode escapes are not supported");
+        }
+      }
+      *r_value += c;
+    }
+    return expect('"');
+  }
+
+  /* String, number or literal as text, r_is_null is set for null. */
+  bool parse_scalar(std::string *r_value, bool *r_is_null) {
+    skip_space();
+    *r_is_null = false;
+    if (position_ < text_.size() && text_[position_] == '"') {
+      return parse_string(r_value);
+    }
+    size_t start = position_;
+    while (position_ < text_.size() &&
+           (isalnum(text_[position_]) || strchr("+-.", text_[position_]))) {
+      ++position_;
+    }
+    r_value->assign(text_, start, position_ - start);
+    if (r_value->empty()) {
+      return fail("expected a value");
+    }
+    *r_is_null = *r_value == "null";
+    return true;
+  }
+
+  bool parse_field(const std::string &field, ProvisionEntry *entry) {
+    std::string value, error;
+    bool is_null;
+    if (!parse_scalar(&value, &is_null)) {
+      return false;
+    }
+    if (!is_null && !set_field(field, value, entry, &error)) {
+      return fail(error);
+    }
+    return true;
+  }
+
+  bool parse_entry(ProvisionEntry *entry) {
+    if (!expect('{')) {
+      return false;
+    }
+    if (accept('}')) {
+      return true;
+    }
+    do {
+      std::string key;
+      if (!parse_string(&key) || !expect(':')) {
+        return false;
+      }
+      if (key != "names" && key != "autoboot") {
+        if (!parse_field(key, entry)) {
+          return false;
+        }
+        continue;
+      }
+      /* Per-computer values are arrays indexed by the computer. */
+      std::string field = key == "names" ? "name" : key;
+      if (!expect('[')) {
+        return false;
+      }
+      if (accept(']')) {
+        continue;
+      }
+      int pc = 0;
+      do {
+        if (!parse_field(field + std::to_string(pc++), entry)) {
+          return false;
+        }
+      } while (accept(','));
+      if (!expect(']')) {
+        return false;
+      }
+    } while (accept(','));
+    return expect('}');
+  }
+
+  const std::string &text_;
+  size_t position_;
+  std::string error_;
+};
+
+/* Current state of the fields the entry has. */
+int read_state(Device *device,
+               const ProvisionEntry &entry,
+               SnapshotAnswer *r_snapshot) {
+  int r = device->get_snapshot(r_snapshot);
+  if (r < 0) {
+    return r;
+  }
+  for (int i = 0; i < NUM_PCS; ++i) {
+    if ((entry.pcs[i].has_name || entry.pcs[i].has_autoboot) &&
+        i >= r_snapshot->num_pcs) {
+      return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    if (entry.pcs[i].has_autoboot && !r_snapshot->has_autoboot) {
+      GetAutobootRequest request = {i};
+      AutobootAnswer answer;
+      r = device->get_autoboot(request, &answer);
+      if (r < 0) {
+        return r;
+      }
+      r_snapshot->pcs[i].autoboot = answer.enabled;
+    }
+  }
+  return 0;
+}
+
+void add_change(const std::string &field,
+                const std::string &old_value,
+                const std::string &new_value,
+                std::vector<ProvisionChange> *r_changes) {
+  ProvisionChange change;
+  change.field = field;
+  change.old_value = old_value;
+  change.new_value = new_value;
+  change.verified = false;
+  r_changes->push_back(change);
+}
+
+void diff_state(const ProvisionEntry &entry,
+                const SnapshotAnswer &snapshot,
+                std::vector<ProvisionChange> *r_changes) {
+  if (entry.has_ip && memcmp(entry.ip, snapshot.ip, 4) != 0) {
+    add_change("ip", format_ip(snapshot.ip), format_ip(entry.ip), r_changes);
+  }
+  if (entry.has_mac && memcmp(entry.mac, snapshot.mac, 6) != 0) {
+    add_change("mac", format_mac(snapshot.mac), format_mac(entry.mac),
+               r_changes);
+  }
+  for (int i = 0; i < NUM_PCS; ++i) {
+    if (entry.pcs[i].has_name &&
+        strcmp(entry.pcs[i].name, snapshot.pcs[i].name) != 0) {
+      add_change("name " + std::to_string(i),
+                 snapshot.pcs[i].name, entry.pcs[i].name, r_changes);
+    }
+    if (entry.pcs[i].has_autoboot &&
+        entry.pcs[i].autoboot != snapshot.pcs[i].autoboot) {
+      add_change("autoboot " + std::to_string(i),
+                 snapshot.pcs[i].autoboot ? "on" : "off",
+                 entry.pcs[i].autoboot ? "on" : "off",
+                 r_changes);
+    }
+  }
+}
+
+/* All the changed fields are collected into frames. */
+int write_changes(Device *device,
+                  const ProvisionEntry &entry,
+                  const std::vector<ProvisionChange> &changes) {
+  device->begin_frame();
+  int r = 0;
+  for (size_t i = 0; i < changes.size() && r == 0; ++i) {
+    const std::string &field = changes[i].field;
+    size_t space = field.find(' ');
+    int pc = space != std::string::npos ? atoi(field.c_str() + space + 1) : 0;
+    if (field == "ip") {
+      SetIpRequest request;
+      memcpy(request.ip, entry.ip, sizeof(request.ip));
+      r = device->set_ip(request);
+    } else if (field == "mac") {
+      SetMacRequest request;
+      memcpy(request.mac, entry.mac, sizeof(request.mac));
+      r = device->set_mac(request);
+    } else if (field.compare(0, 5, "name ") == 0) {
+      SetNameRequest request = {pc, entry.pcs[pc].name};
+      r = device->set_name(request);
+    } else {
+      SetAutobootRequest request = {pc, entry.pcs[pc].autoboot};
+      r = device->set_autoboot(request);
+    }
+  }
+  if (r < 0) {
+    device->cancel_frame();
+    return r;
+  }
+  std::vector<FrameStatus> statuses;
+  r = device->end_frame(&statuses);
+  if (r < 0) {
+    return r;
+  }
+  for (size_t i = 0; i < statuses.size(); ++i) {
+    if (statuses[i].status != COMMAND_STATUS_OK) {
+      return LIBUSB_ERROR_IO;
+    }
+  }
+  return 0;
+}
+
+}  /* namespace */
+
+int provision_load_manifest(const char *path,
+                            std::vector<ProvisionEntry> *r_entries,
+                            std::string *r_error) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return -errno;
+  }
+  std::string text;
+  char buffer[4096];
+  size_t len;
+  while ((len = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    text.append(buffer, len);
+  }
+  bool read_failed = ferror(file);
+  fclose(file);
+  if (read_failed) {
+    return -EIO;
+  }
+  r_entries->clear();
+  size_t first = text.find_first_not_of(" \t\r\n");
+  bool ok;
+  if (first != std::string::npos && text[first] == '[') {
+    ok = JsonParser(text).parse(r_entries, r_error);
+  } else {
+    ok = parse_csv(text, r_entries, r_error);
+  }
+  if (!ok) {
+    return -EINVAL;
+  }
+  std::set<std::string> boards;
+  for (size_t i = 0; i < r_entries->size(); ++i) {
+    const std::string &board = (*r_entries)[i].board;
+    if (board.empty()) {
+      *r_error = "entry " + std::to_string(i + 1) + " has no board";
+      return -EINVAL;
+    }
+    if (!boards.insert(board).second) {
+      *r_error = "board " + board + " is listed twice";
+      return -EINVAL;
+    }
+  }
+  return 0;
+}
+
+int provision_board(Device *device,
+                    const ProvisionEntry &entry,
+                    bool dry_run,
+                    std::vector<ProvisionChange> *r_changes) {
+  r_changes->clear();
+  SnapshotAnswer snapshot;
+  int r = read_state(device, entry, &snapshot);
+  if (r < 0) {
+    return r;
+  }
+  diff_state(entry, snapshot, r_changes);
+  if (dry_run || r_changes->empty()) {
+    return 0;
+  }
+  r = write_changes(device, entry, *r_changes);
+  if (r < 0) {
+    return r;
+  }
+  r = read_state(device, entry, &snapshot);
+  if (r < 0) {
+    return r;
+  }
+  std::vector<ProvisionChange> remaining;
+  diff_state(entry, snapshot, &remaining);
+  for (size_t i = 0; i < r_changes->size(); ++i) {
+    ProvisionChange *change = &(*r_changes)[i];
+    change->verified = true;
+    for (size_t j = 0; j < remaining.size(); ++j) {
+      if (remaining[j].field == change->field) {
+        change->verified = false;
+        r = LIBUSB_ERROR_IO;
+      }
+    }
+  }
+  return r;
+}
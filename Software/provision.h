@@ -0,0 +1,86 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __PROVISION_H__
+#define __PROVISION_H__
+
+#include <string>
+#include <vector>
+
+#include "pcremote.h"
+
+/* Desired configuration of a board, fields which are not given are left
+ * as they are.
+ */
+struct ProvisionEntry {
+  /* Serial number or bus-port path, see device_list(). */
+  std::string board;
+  bool has_ip;
+  unsigned char ip[4];
+  bool has_mac;
+  unsigned char mac[6];
+  struct {
+    bool has_name;
+    char name[PC_MAX_NAME + 1];
+    bool has_autoboot;
+    bool autoboot;
+  } pcs[NUM_PCS];
+};
+
+/* Manifest is either CSV with a header line:
+ *
+ *   board,ip,mac,name0,name1,autoboot0,autoboot1
+ *   A1B2C3,192.168.1.201,00:04:a3:00:00:02,web1,web2,on,off
+ *
+ * where columns can be in any order and empty cells are left as they are,
+ * or a JSON array of objects:
+ *
+ *   [{"board": "A1B2C3", "ip": "192.168.1.201", "mac": "00:04:a3:00:00:02",
+ *     "names": ["web1", "web2"], "autoboot": [true, false]}]
+ *
+ * where null or missing values are left as they are.
+ * Returns 0 or -EINVAL with the reason in r_error, negative errno when the
+ * file can't be read.
+ */
+int provision_load_manifest(const char *path,
+                            std::vector<ProvisionEntry> *r_entries,
+                            std::string *r_error);
+
+struct ProvisionChange {
+  /* "ip", "mac", "name <pc>" or "autoboot <pc>". */
+  std::string field;
+  std::string old_value;
+  std::string new_value;
+  /* Read back from the board after it was written. */
+  bool verified;
+};
+
+/* Compare the opened board with the entry, write the fields which differ
+ * in as few reports as possible and read them back.
+ * Returns 0 or a libusb error, LIBUSB_ERROR_IO when the board rejected a
+ * field or read back something else than was written.
+ */
+int provision_board(Device *device,
+                    const ProvisionEntry &entry,
+                    bool dry_run,
+                    std::vector<ProvisionChange> *r_changes);
+
+#endif  /* __PROVISION_H__ */
@@ -0,0 +1,132 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "retry_policy.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+namespace {
+
+/* Gains of the smoothed round trip time and its variation. */
+const double RTT_ALPHA = 1.0 / 8.0;
+const double RTT_BETA = 1.0 / 4.0;
+
+/* USB polls the endpoints every millisecond, but the host might not be
+ * scheduled right away.
+ */
+const double MIN_RTO_MS = 20.0;
+const double MAX_RTO_MS = TIMEOUT;
+/* Timeout until the first answer is seen. */
+const double INITIAL_RTO_MS = 1000.0;
+
+}  /* namespace */
+
+RetryPolicy::RetryPolicy() {
+  memset(stats_, 0, sizeof(stats_));
+  for (int i = 0; i < 256; ++i) {
+    stats_[i].rto_ms = command_is_optional(i) ? PROBE_TIMEOUT
+                                              : INITIAL_RTO_MS;
+  }
+}
+
+bool RetryPolicy::is_adaptive(int command) {
+  if (!command_is_idempotent(command)) {
+    return false;
+  }
+  return !command_is_optional(command) || stats_[command].num_answers != 0;
+}
+
+int RetryPolicy::timeout_ms(int command, double elapsed_ms) {
+  if (!is_adaptive(command)) {
+    return command_answer_timeout(command);
+  }
+  /* Last attempt waits for the rest of TIMEOUT, there would be no time
+   * left for another full one.
+   */
+  double rto_ms = stats_[command].rto_ms;
+  double left_ms = TIMEOUT - elapsed_ms;
+  if (left_ms < 2.0 * rto_ms) {
+    rto_ms = left_ms;
+  }
+  return std::max((int)ceil(rto_ms), 1);
+}
+
+bool RetryPolicy::should_retry(int command, double elapsed_ms) {
+  return is_adaptive(command) && elapsed_ms < TIMEOUT;
+}
+
+void RetryPolicy::record_request(int command) {
+  ++stats_[command].num_requests;
+}
+
+void RetryPolicy::record_answer(int command,
+                                double rtt_ms,
+                                double latency_ms,
+                                bool retried) {
+  CommandStats *stats = &stats_[command];
+  ++stats->num_answers;
+  int bucket = 0;
+  while (bucket < NUM_LATENCY_BUCKETS - 1 &&
+         latency_ms > LATENCY_BUCKETS_MS[bucket]) {
+    ++bucket;
+  }
+  ++stats->latency_buckets[bucket];
+  stats->latency_sum_ms += latency_ms;
+  if (retried) {
+    return;
+  }
+  /* First answers might have been retried, the estimate starts with the
+   * first sample.
+   */
+  if (stats->srtt_ms == 0.0) {
+    stats->srtt_ms = rtt_ms;
+    stats->rttvar_ms = rtt_ms / 2.0;
+  } else {
+    stats->rttvar_ms = (1.0 - RTT_BETA) * stats->rttvar_ms +
+                       RTT_BETA * fabs(stats->srtt_ms - rtt_ms);
+    stats->srtt_ms = (1.0 - RTT_ALPHA) * stats->srtt_ms + RTT_ALPHA * rtt_ms;
+  }
+  stats->rto_ms = std::min(std::max(stats->srtt_ms + 4.0 * stats->rttvar_ms,
+                                    MIN_RTO_MS),
+                           MAX_RTO_MS);
+}
+
+void RetryPolicy::record_timeout(int command) {
+  CommandStats *stats = &stats_[command];
+  ++stats->num_timeouts;
+  if (is_adaptive(command)) {
+    stats->rto_ms = std::min(stats->rto_ms * 2.0, MAX_RTO_MS);
+  }
+}
+
+void RetryPolicy::record_retry(int command) {
+  ++stats_[command].num_retries;
+}
+
+void RetryPolicy::get_stats(int command, CommandStats *r_stats) {
+  *r_stats = stats_[command & 0xff];
+  if (!is_adaptive(command & 0xff)) {
+    r_stats->rto_ms = command_answer_timeout(command & 0xff);
+  }
+}
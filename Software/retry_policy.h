@@ -0,0 +1,101 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __RETRY_POLICY_H__
+#define __RETRY_POLICY_H__
+
+#include "protocol.h"
+
+/* Upper bounds of the request latency histogram buckets, the last bucket
+ * takes everything slower.
+ */
+const double LATENCY_BUCKETS_MS[] = {
+  0.5, 1.0, 2.0, 5.0, 10.0, 20.0, 50.0, 100.0, 250.0, 500.0, 1000.0, 5000.0,
+};
+const int NUM_LATENCY_BUCKETS =
+    sizeof(LATENCY_BUCKETS_MS) / sizeof(*LATENCY_BUCKETS_MS) + 1;
+
+/* Counters of a single command type. */
+struct CommandStats {
+  int num_requests;
+  int num_answers;
+  int num_timeouts;
+  int num_retries;
+  /* Smoothed round trip time and its variation, zero until the first
+   * answer.
+   */
+  double srtt_ms;
+  double rttvar_ms;
+  /* Timeout of an attempt, it doubles with every timeout and stays backed
+   * off until the next round trip sample.
+   */
+  double rto_ms;
+  /* Time from submitting the request to its answer, retries included. */
+  int latency_buckets[NUM_LATENCY_BUCKETS];
+  double latency_sum_ms;
+};
+
+/* Derives answer timeouts from the observed round trip times the way TCP
+ * does (RFC 6298) and decides which requests are sent again when their
+ * answer doesn't come.
+ *
+ * Only idempotent queries are retried, until the request took TIMEOUT in
+ * total, so a board which stalls for a while is still waited for. Optional
+ * commands are only retried once they were answered, until then a timeout
+ * means the firmware doesn't support them. Everything else waits for the
+ * answer as long as before.
+ */
+class RetryPolicy {
+ public:
+  RetryPolicy();
+
+  /* How long to wait for the answer to the attempt sent elapsed_ms after
+   * the first one, before retrying or giving up.
+   */
+  int timeout_ms(int command, double elapsed_ms);
+
+  /* Whether to send the request again when its last attempt timed out
+   * elapsed_ms after the first one was sent.
+   */
+  bool should_retry(int command, double elapsed_ms);
+
+  void record_request(int command);
+  /* Round trip time of the last attempt is only sampled from requests
+   * which were not retried, since it's unknown which attempt was answered
+   * (Karn's algorithm). Latency counts from the first attempt.
+   */
+  void record_answer(int command,
+                     double rtt_ms,
+                     double latency_ms,
+                     bool retried);
+  /* Backs off the timeout of the command, see RFC 6298 section 5.5. */
+  void record_timeout(int command);
+  void record_retry(int command);
+
+  void get_stats(int command, CommandStats *r_stats);
+
+ protected:
+  bool is_adaptive(int command);
+
+  CommandStats stats_[256];
+};
+
+#endif  /* __RETRY_POLICY_H__ */
@@ -0,0 +1,202 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "status_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+
+/* Layout of the file. */
+struct SharedStatus {
+  uint32_t magic;
+  /* sizeof(SharedStatus), readers built with a different layout refuse the
+   * file.
+   */
+  uint32_t size;
+  /* Odd while the status is being updated. */
+  std::atomic<uint32_t> sequence;
+  CachedStatus status;
+};
+
+namespace {
+
+const char *DEFAULT_STATUS_CACHE_PATH = "/dev/shm/pcremotecontrol.status";
+const uint32_t STATUS_CACHE_MAGIC = 0x53435250;  /* "PRCS" */
+/* Update takes a few hundred nanoseconds, give up after way longer. */
+const int MAX_READ_ATTEMPTS = 1000000;
+
+}  /* namespace */
+
+const char *status_cache_path(void) {
+  const char *path = getenv("PCREMOTECONTROL_STATUS_CACHE");
+  if (path != NULL && path[0] != '\0') {
+    return path;
+  }
+  return DEFAULT_STATUS_CACHE_PATH;
+}
+
+int64_t status_cache_now_ns(void) {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+StatusCacheWriter::StatusCacheWriter() : shared_(NULL) {
+}
+
+StatusCacheWriter::~StatusCacheWriter() {
+  close();
+}
+
+int StatusCacheWriter::open(const char *path) {
+  close();
+  int fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -errno;
+  }
+  if (ftruncate(fd, sizeof(SharedStatus)) < 0) {
+    int r = -errno;
+    ::close(fd);
+    return r;
+  }
+  void *data = mmap(NULL,
+                    sizeof(SharedStatus),
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED,
+                    fd,
+                    0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return -errno;
+  }
+  shared_ = (SharedStatus *)data;
+  /* Readers of the previous file see the sequence moving on, the counter
+   * continues from where it was.
+   */
+  uint64_t num_updates = 0;
+  if (shared_->magic == STATUS_CACHE_MAGIC &&
+      shared_->size == sizeof(SharedStatus)) {
+    num_updates = shared_->status.num_updates;
+  }
+  uint32_t sequence = shared_->sequence.load(std::memory_order_relaxed);
+  shared_->sequence.store(sequence | 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memset(&shared_->status, 0, sizeof(shared_->status));
+  shared_->status.num_updates = num_updates;
+  shared_->magic = STATUS_CACHE_MAGIC;
+  shared_->size = sizeof(SharedStatus);
+  shared_->sequence.store((sequence | 1) + 1, std::memory_order_release);
+  return 0;
+}
+
+void StatusCacheWriter::close(void) {
+  if (shared_ != NULL) {
+    munmap(shared_, sizeof(SharedStatus));
+    shared_ = NULL;
+  }
+}
+
+bool StatusCacheWriter::is_open(void) const {
+  return shared_ != NULL;
+}
+
+void StatusCacheWriter::publish(CachedStatus *status) {
+  if (shared_ == NULL) {
+    return;
+  }
+  status->num_updates = shared_->status.num_updates + 1;
+  status->update_time_ns = status_cache_now_ns();
+  uint32_t sequence = shared_->sequence.load(std::memory_order_relaxed);
+  shared_->sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(&shared_->status, status, sizeof(*status));
+  shared_->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+StatusCacheReader::StatusCacheReader() : shared_(NULL) {
+}
+
+StatusCacheReader::~StatusCacheReader() {
+  close();
+}
+
+int StatusCacheReader::open(const char *path) {
+  close();
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int r = -errno;
+    ::close(fd);
+    return r;
+  }
+  if (st.st_size != sizeof(SharedStatus)) {
+    ::close(fd);
+    return -EPROTO;
+  }
+  void *data = mmap(NULL, sizeof(SharedStatus), PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return -errno;
+  }
+  shared_ = (const SharedStatus *)data;
+  if (shared_->magic != STATUS_CACHE_MAGIC ||
+      shared_->size != sizeof(SharedStatus)) {
+    close();
+    return -EPROTO;
+  }
+  return 0;
+}
+
+void StatusCacheReader::close(void) {
+  if (shared_ != NULL) {
+    munmap((void *)shared_, sizeof(SharedStatus));
+    shared_ = NULL;
+  }
+}
+
+int StatusCacheReader::read(CachedStatus *r_status) const {
+  if (shared_ == NULL) {
+    return -EBADF;
+  }
+  for (int i = 0; i < MAX_READ_ATTEMPTS; ++i) {
+    uint32_t sequence = shared_->sequence.load(std::memory_order_acquire);
+    if (sequence & 1) {
+      continue;
+    }
+    memcpy(r_status, &shared_->status, sizeof(*r_status));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (shared_->sequence.load(std::memory_order_relaxed) == sequence) {
+      return 0;
+    }
+  }
+  return -EAGAIN;
+}
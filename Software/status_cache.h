@@ -0,0 +1,96 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __STATUS_CACHE_H__
+#define __STATUS_CACHE_H__
+
+#include <stdint.h>
+
+#include "pcremote.h"
+
+/* Latest status of the board which the daemon shares with local readers
+ * through a memory-mapped file. Readers get it without a single syscall and
+ * without any traffic to the device.
+ *
+ * The file is updated under a sequence lock: the writer makes the sequence
+ * odd while it's updating the status, readers copy the status and retry if
+ * the sequence changed meanwhile.
+ */
+struct CachedStatus {
+  /* Incremented by every update, zero until the first one. */
+  uint64_t num_updates;
+  /* CLOCK_MONOTONIC time of the last update, see status_cache_now_ns(). */
+  int64_t update_time_ns;
+  /* False while the device is gone, the status is the last known one. */
+  bool connected;
+  SnapshotAnswer snapshot;
+};
+
+/* PCREMOTECONTROL_STATUS_CACHE overrides the default file on tmpfs. */
+const char *status_cache_path(void);
+
+int64_t status_cache_now_ns(void);
+
+struct SharedStatus;
+
+class StatusCacheWriter {
+ public:
+  StatusCacheWriter();
+  ~StatusCacheWriter();
+
+  /* Create the file, or take over the one of the previous writer.
+   * Returns 0 or negative errno.
+   */
+  int open(const char *path);
+  void close(void);
+  bool is_open(void) const;
+
+  /* Make the status visible to the readers, its num_updates and
+   * update_time_ns are filled in.
+   */
+  void publish(CachedStatus *status);
+
+ protected:
+  SharedStatus *shared_;
+};
+
+class StatusCacheReader {
+ public:
+  StatusCacheReader();
+  ~StatusCacheReader();
+
+  /* Returns 0 or negative errno, -EPROTO when the file has different
+   * layout.
+   */
+  int open(const char *path);
+  void close(void);
+
+  /* Consistent copy of the latest status. Returns -EAGAIN when the writer
+   * keeps the lock for too long, it might have died in the middle of an
+   * update.
+   */
+  int read(CachedStatus *r_status) const;
+
+ protected:
+  const SharedStatus *shared_;
+};
+
+#endif  /* __STATUS_CACHE_H__ */
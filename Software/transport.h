@@ -0,0 +1,65 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include "protocol.h"
+
+/* Moves 64 byte reports between the host and the board.
+ *
+ * OUT reports are submitted by the caller, IN reports are delivered to the
+ * report callback as soon as they come. Backends are the libusb transfer
+ * engine talking to the real board and the in-process emulator.
+ */
+class Transport {
+ public:
+  virtual ~Transport() {}
+
+  typedef void (*ReportCallback)(const unsigned char report[PACKET_INT_LEN],
+                                 void *user_data);
+  typedef void (*DeviceGoneCallback)(void *user_data);
+
+  /* Callbacks might be invoked from a backend's own thread, they must be
+   * set before start().
+   */
+  virtual void set_report_callback(ReportCallback callback,
+                                   void *user_data) = 0;
+  /* Invoked once when the device is unplugged. */
+  virtual void set_device_gone_callback(DeviceGoneCallback callback,
+                                        void *user_data) = 0;
+
+  virtual int start(void) = 0;
+  virtual void stop(void) = 0;
+
+  /* Submit OUT report without waiting for it to be delivered. */
+  virtual int submit_report(const unsigned char report[PACKET_INT_LEN],
+                            int timeout_ms) = 0;
+
+  /* Submit OUT report and wait for it to be delivered. */
+  virtual int send_report(const unsigned char report[PACKET_INT_LEN],
+                          int timeout_ms) = 0;
+
+  /* True once a report failed because the device is gone. */
+  virtual bool is_device_gone(void) = 0;
+};
+
+#endif  /* __TRANSPORT_H__ */
@@ -0,0 +1,447 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "usb_async.h"
+
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <chrono>
+
+namespace {
+
+/* Maximum number of IN reports which are waiting to be read. */
+const size_t MAX_QUEUED_IN_REPORTS = 64;
+
+}  /* namespace */
+
+int usb_transfer_status_to_error(libusb_transfer_status status) {
+  switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED: return LIBUSB_SUCCESS;
+    case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_CANCELLED: return LIBUSB_ERROR_INTERRUPTED;
+    case LIBUSB_TRANSFER_STALL: return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW: return LIBUSB_ERROR_OVERFLOW;
+    default: return LIBUSB_ERROR_IO;
+  }
+}
+
+UsbAsyncEngine::UsbAsyncEngine(libusb_context *ctx,
+                               libusb_device_handle *devh)
+    : ctx_(ctx),
+      devh_(devh),
+      report_callback_(NULL),
+      report_callback_data_(NULL),
+      device_gone_callback_(NULL),
+      device_gone_callback_data_(NULL),
+      epoll_fd_(-1),
+      wakeup_fd_(-1),
+      stopping_(false),
+      active_transfers_(0),
+      out_error_(0),
+      device_gone_(false) {
+}
+
+UsbAsyncEngine::~UsbAsyncEngine() {
+  stop();
+}
+
+void UsbAsyncEngine::set_report_callback(ReportCallback callback,
+                                         void *user_data) {
+  report_callback_ = callback;
+  report_callback_data_ = user_data;
+}
+
+void UsbAsyncEngine::set_device_gone_callback(DeviceGoneCallback callback,
+                                              void *user_data) {
+  device_gone_callback_ = callback;
+  device_gone_callback_data_ = user_data;
+}
+
+bool UsbAsyncEngine::is_device_gone(void) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return device_gone_;
+}
+
+bool UsbAsyncEngine::mark_device_gone_locked(void) {
+  if (device_gone_) {
+    return false;
+  }
+  device_gone_ = true;
+  return device_gone_callback_ != NULL;
+}
+
+int UsbAsyncEngine::start(void) {
+  return start(4, 8);
+}
+
+int UsbAsyncEngine::start(int num_in_transfers, int num_out_transfers) {
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  wakeup_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (epoll_fd_ < 0 || wakeup_fd_ < 0) {
+    stop();
+    return LIBUSB_ERROR_NO_MEM;
+  }
+  epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = wakeup_fd_;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wakeup_fd_, &event);
+
+  /* Register descriptors libusb already has, and keep the set in sync. */
+  const libusb_pollfd **pollfds = libusb_get_pollfds(ctx_);
+  if (pollfds == NULL) {
+    stop();
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+  }
+  for (int i = 0; pollfds[i] != NULL; ++i) {
+    pollfd_added_cb(pollfds[i]->fd, pollfds[i]->events, this);
+  }
+  libusb_free_pollfds(pollfds);
+  libusb_set_pollfd_notifiers(ctx_, pollfd_added_cb, pollfd_removed_cb, this);
+
+  in_transfers_.resize(num_in_transfers);
+  out_transfers_.resize(num_out_transfers);
+  for (size_t i = 0; i < in_transfers_.size() + out_transfers_.size(); ++i) {
+    bool is_in = i < in_transfers_.size();
+    Transfer *transfer = is_in ? &in_transfers_[i]
+                               : &out_transfers_[i - in_transfers_.size()];
+    memset(transfer->buffer, 0, sizeof(transfer->buffer));
+    transfer->engine = this;
+    transfer->state = TRANSFER_FREE;
+    transfer->collect_result = false;
+    transfer->result = 0;
+    transfer->transfer = libusb_alloc_transfer(0);
+    if (transfer->transfer == NULL) {
+      stop();
+      return LIBUSB_ERROR_NO_MEM;
+    }
+    libusb_fill_interrupt_transfer(transfer->transfer,
+                                   devh_,
+                                   is_in ? ENDPOINT_INT_IN : ENDPOINT_INT_OUT,
+                                   transfer->buffer,
+                                   PACKET_INT_LEN,
+                                   is_in ? in_transfer_cb : out_transfer_cb,
+                                   transfer,
+                                   0);
+  }
+
+  /* IN transfers never time out, they're re-submitted from the callback. */
+  for (size_t i = 0; i < in_transfers_.size(); ++i) {
+    int r = libusb_submit_transfer(in_transfers_[i].transfer);
+    if (r < 0) {
+      stop();
+      return r;
+    }
+    in_transfers_[i].state = TRANSFER_IN_FLIGHT;
+    ++active_transfers_;
+  }
+
+  event_thread_ = std::thread(&UsbAsyncEngine::event_loop, this);
+  return 0;
+}
+
+void UsbAsyncEngine::stop(void) {
+  if (event_thread_.joinable()) {
+    stopping_ = true;
+    uint64_t value = 1;
+    if (write(wakeup_fd_, &value, sizeof(value)) < 0) {
+      /* Event loop will still notice the flag on the next libusb event. */
+    }
+    event_thread_.join();
+  }
+  if (ctx_ != NULL && epoll_fd_ >= 0) {
+    libusb_set_pollfd_notifiers(ctx_, NULL, NULL, NULL);
+  }
+  /* Cancel everything which is still in flight and wait for the callbacks,
+   * only then it's safe to free the transfers.
+   */
+  std::vector<Transfer> *lists[2] = {&in_transfers_, &out_transfers_};
+  for (int i = 0; i < 2; ++i) {
+    for (size_t j = 0; j < lists[i]->size(); ++j) {
+      Transfer *transfer = &(*lists[i])[j];
+      if (transfer->state == TRANSFER_IN_FLIGHT) {
+        libusb_cancel_transfer(transfer->transfer);
+      }
+    }
+  }
+  while (active_transfers_ > 0) {
+    timeval tv = {0, 100000};
+    if (libusb_handle_events_timeout(ctx_, &tv) < 0) {
+      break;
+    }
+  }
+  free_transfers();
+  if (epoll_fd_ >= 0) {
+    close(epoll_fd_);
+    epoll_fd_ = -1;
+  }
+  if (wakeup_fd_ >= 0) {
+    close(wakeup_fd_);
+    wakeup_fd_ = -1;
+  }
+}
+
+void UsbAsyncEngine::free_transfers(void) {
+  std::vector<Transfer> *lists[2] = {&in_transfers_, &out_transfers_};
+  for (int i = 0; i < 2; ++i) {
+    for (size_t j = 0; j < lists[i]->size(); ++j) {
+      if ((*lists[i])[j].transfer != NULL) {
+        libusb_free_transfer((*lists[i])[j].transfer);
+      }
+    }
+    lists[i]->clear();
+  }
+}
+
+int UsbAsyncEngine::acquire_out_transfer(int timeout_ms,
+                                         Transfer **r_transfer) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  Transfer *out = NULL;
+  bool ready = cond_.wait_for(lock,
+                              std::chrono::milliseconds(timeout_ms),
+                              [this, &out] {
+    if (device_gone_) {
+      return true;
+    }
+    for (size_t i = 0; i < out_transfers_.size(); ++i) {
+      if (out_transfers_[i].state == TRANSFER_FREE) {
+        out = &out_transfers_[i];
+        return true;
+      }
+    }
+    return false;
+  });
+  if (!ready) {
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+  if (out == NULL) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  out->state = TRANSFER_IN_FLIGHT;
+  *r_transfer = out;
+  return 0;
+}
+
+int UsbAsyncEngine::submit_out_transfer(
+    Transfer *out,
+    const unsigned char report[PACKET_INT_LEN],
+    int timeout_ms,
+    bool collect_result) {
+  memcpy(out->buffer, report, PACKET_INT_LEN);
+  out->collect_result = collect_result;
+  out->transfer->timeout = timeout_ms;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++active_transfers_;
+  }
+  int r = libusb_submit_transfer(out->transfer);
+  if (r < 0) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    --active_transfers_;
+    out->state = TRANSFER_FREE;
+    cond_.notify_all();
+  }
+  return r;
+}
+
+int UsbAsyncEngine::submit_report(const unsigned char report[PACKET_INT_LEN],
+                                  int timeout_ms) {
+  Transfer *out;
+  int r = acquire_out_transfer(timeout_ms, &out);
+  if (r < 0) {
+    return r;
+  }
+  return submit_out_transfer(out, report, timeout_ms, false);
+}
+
+int UsbAsyncEngine::send_report(const unsigned char report[PACKET_INT_LEN],
+                                int timeout_ms) {
+  Transfer *out;
+  int r = acquire_out_transfer(timeout_ms, &out);
+  if (r < 0) {
+    return r;
+  }
+  r = submit_out_transfer(out, report, timeout_ms, true);
+  if (r < 0) {
+    return r;
+  }
+  /* Transfer has its own timeout, so the callback is guaranteed to come. */
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [out] { return out->state == TRANSFER_DONE; });
+  out->state = TRANSFER_FREE;
+  cond_.notify_all();
+  return out->result;
+}
+
+int UsbAsyncEngine::read_report(unsigned char report[PACKET_INT_LEN],
+                                int timeout_ms) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  bool ready = cond_.wait_for(lock,
+                              std::chrono::milliseconds(timeout_ms),
+                              [this] {
+    return !in_reports_.empty() || device_gone_;
+  });
+  if (!ready) {
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+  if (in_reports_.empty()) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  memcpy(report, &in_reports_.front()[0], PACKET_INT_LEN);
+  in_reports_.pop_front();
+  return 0;
+}
+
+int UsbAsyncEngine::flush(void) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this] {
+    for (size_t i = 0; i < out_transfers_.size(); ++i) {
+      if (out_transfers_[i].state == TRANSFER_IN_FLIGHT) {
+        return false;
+      }
+    }
+    return true;
+  });
+  int r = out_error_;
+  out_error_ = 0;
+  return r;
+}
+
+void LIBUSB_CALL UsbAsyncEngine::in_transfer_cb(libusb_transfer *transfer) {
+  Transfer *in = (Transfer *)transfer->user_data;
+  UsbAsyncEngine *engine = in->engine;
+  /* Short reports are padded with zeros, same as synchronous reads
+   * into a zeroed buffer.
+   */
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+      transfer->actual_length < PACKET_INT_LEN) {
+    memset(in->buffer + transfer->actual_length,
+           0,
+           PACKET_INT_LEN - transfer->actual_length);
+  }
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+      engine->report_callback_ != NULL) {
+    engine->report_callback_(in->buffer, engine->report_callback_data_);
+  }
+  std::unique_lock<std::mutex> lock(engine->mutex_);
+  bool notify_gone = false;
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+      engine->report_callback_ != NULL) {
+    /* Report is already delivered. */
+  } else if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+    if (engine->in_reports_.size() == MAX_QUEUED_IN_REPORTS) {
+      /* Nobody is reading, drop the oldest report. */
+      engine->in_reports_.pop_front();
+    }
+    engine->in_reports_.push_back(
+        std::vector<unsigned char>(in->buffer, in->buffer + PACKET_INT_LEN));
+  } else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+    notify_gone = engine->mark_device_gone_locked();
+  }
+  if (!engine->stopping_ && !engine->device_gone_ &&
+      transfer->status != LIBUSB_TRANSFER_CANCELLED &&
+      libusb_submit_transfer(transfer) == 0) {
+    /* Keep the IN transfer posted. */
+  } else {
+    in->state = TRANSFER_FREE;
+    --engine->active_transfers_;
+  }
+  engine->cond_.notify_all();
+  lock.unlock();
+  if (notify_gone) {
+    engine->device_gone_callback_(engine->device_gone_callback_data_);
+  }
+}
+
+void LIBUSB_CALL UsbAsyncEngine::out_transfer_cb(libusb_transfer *transfer) {
+  Transfer *out = (Transfer *)transfer->user_data;
+  UsbAsyncEngine *engine = out->engine;
+  std::unique_lock<std::mutex> lock(engine->mutex_);
+  out->result = usb_transfer_status_to_error(transfer->status);
+  bool notify_gone = false;
+  if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+    notify_gone = engine->mark_device_gone_locked();
+  }
+  if (out->collect_result) {
+    out->state = TRANSFER_DONE;
+  } else {
+    if (out->result < 0 && engine->out_error_ == 0) {
+      engine->out_error_ = out->result;
+    }
+    out->state = TRANSFER_FREE;
+  }
+  --engine->active_transfers_;
+  engine->cond_.notify_all();
+  lock.unlock();
+  if (notify_gone) {
+    engine->device_gone_callback_(engine->device_gone_callback_data_);
+  }
+}
+
+void LIBUSB_CALL UsbAsyncEngine::pollfd_added_cb(int fd,
+                                                 short events,
+                                                 void *data) {
+  UsbAsyncEngine *engine = (UsbAsyncEngine *)data;
+  epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = ((events & POLLIN) ? EPOLLIN : 0) |
+                 ((events & POLLOUT) ? EPOLLOUT : 0);
+  event.data.fd = fd;
+  epoll_ctl(engine->epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+}
+
+void LIBUSB_CALL UsbAsyncEngine::pollfd_removed_cb(int fd, void *data) {
+  UsbAsyncEngine *engine = (UsbAsyncEngine *)data;
+  epoll_ctl(engine->epoll_fd_, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void UsbAsyncEngine::event_loop(void) {
+  const int MAX_EVENTS = 8;
+  epoll_event events[MAX_EVENTS];
+  while (!stopping_) {
+    /* On systems without timerfd libusb expects us to handle timeouts. */
+    int timeout_ms = -1;
+    timeval tv;
+    if (libusb_get_next_timeout(ctx_, &tv) == 1) {
+      timeout_ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+    }
+    int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, timeout_ms);
+    if (n < 0 && errno != EINTR) {
+      break;
+    }
+    for (int i = 0; i < n; ++i) {
+      if (events[i].data.fd == wakeup_fd_) {
+        uint64_t value;
+        if (read(wakeup_fd_, &value, sizeof(value)) < 0) {
+          /* Nothing to do, it's only used to wake the loop up. */
+        }
+      }
+    }
+    timeval zero = {0, 0};
+    libusb_handle_events_timeout(ctx_, &zero);
+  }
+}
@@ -0,0 +1,142 @@
+/* Copyright (C) 2015 Sergey Sharybin <sergey.vfx@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __USB_ASYNC_H__
+#define __USB_ASYNC_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <libusb.h>
+
+#include "protocol.h"
+#include "transport.h"
+
+/* Asynchronous transfer engine on top of libusb_submit_transfer().
+ *
+ * All transfers are allocated once in start(). IN transfers are kept posted
+ * all the time and every received report goes to a queue, OUT reports are
+ * submitted from a pool, so several OUT and IN reports might be in flight.
+ * Completion callbacks are invoked from a dedicated event thread, which waits
+ * for libusb file descriptors using epoll.
+ */
+class UsbAsyncEngine : public Transport {
+ public:
+  UsbAsyncEngine(libusb_context *ctx, libusb_device_handle *devh);
+  ~UsbAsyncEngine();
+
+  /* Deliver IN reports to the callback instead of the queue, the callback
+   * is invoked from the event thread. Must be set before start().
+   */
+  void set_report_callback(ReportCallback callback, void *user_data);
+
+  /* Invoked once from the event thread when the device is unplugged.
+   * Must be set before start().
+   */
+  void set_device_gone_callback(DeviceGoneCallback callback, void *user_data);
+
+  /* True once a transfer failed because the device is gone. */
+  bool is_device_gone(void);
+
+  int start(void);
+  int start(int num_in_transfers, int num_out_transfers);
+  void stop(void);
+
+  /* Submit OUT report without waiting for it to be delivered.
+   * Blocks only when all OUT transfers are in flight.
+   */
+  int submit_report(const unsigned char report[PACKET_INT_LEN],
+                    int timeout_ms);
+
+  /* Submit OUT report and wait for it to be delivered. */
+  int send_report(const unsigned char report[PACKET_INT_LEN], int timeout_ms);
+
+  /* Wait for the next IN report. */
+  int read_report(unsigned char report[PACKET_INT_LEN], int timeout_ms);
+
+  /* Wait for all submitted OUT reports, returns error of the first failed
+   * one since the previous flush.
+   */
+  int flush(void);
+
+ protected:
+  enum TransferState {
+    TRANSFER_FREE,
+    TRANSFER_IN_FLIGHT,
+    TRANSFER_DONE,  /* Completed, result is to be collected by the sender. */
+  };
+
+  struct Transfer {
+    UsbAsyncEngine *engine;
+    libusb_transfer *transfer;
+    unsigned char buffer[PACKET_INT_LEN];
+    TransferState state;
+    bool collect_result;
+    int result;
+  };
+
+  static void LIBUSB_CALL in_transfer_cb(libusb_transfer *transfer);
+  static void LIBUSB_CALL out_transfer_cb(libusb_transfer *transfer);
+  static void LIBUSB_CALL pollfd_added_cb(int fd, short events, void *data);
+  static void LIBUSB_CALL pollfd_removed_cb(int fd, void *data);
+
+  int acquire_out_transfer(int timeout_ms, Transfer **r_transfer);
+  int submit_out_transfer(Transfer *out,
+                          const unsigned char report[PACKET_INT_LEN],
+                          int timeout_ms,
+                          bool collect_result);
+  /* Returns true when the device wasn't known to be gone before. */
+  bool mark_device_gone_locked(void);
+  void event_loop(void);
+  void free_transfers(void);
+
+  libusb_context *ctx_;
+  libusb_device_handle *devh_;
+  ReportCallback report_callback_;
+  void *report_callback_data_;
+  DeviceGoneCallback device_gone_callback_;
+  void *device_gone_callback_data_;
+
+  int epoll_fd_;
+  int wakeup_fd_;
+  std::thread event_thread_;
+  std::atomic<bool> stopping_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<Transfer> in_transfers_;
+  std::vector<Transfer> out_transfers_;
+  std::deque<std::vector<unsigned char> > in_reports_;
+  int active_transfers_;
+  int out_error_;
+  bool device_gone_;
+};
+
+/* Convert libusb transfer status to the libusb error code. */
+int usb_transfer_status_to_error(libusb_transfer_status status);
+
+#endif  /* __USB_ASYNC_H__ */